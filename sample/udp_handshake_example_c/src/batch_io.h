@@ -0,0 +1,80 @@
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+// Batched datagram I/O on a UDP socket.
+//
+// batch_io_recv() takes up to `cap` datagrams off the socket with one recvmmsg() into
+// preallocated receive slots. Replies are written into preallocated reply slots with
+// batch_io_reply() and go out together with one sendmmsg() on batch_io_flush(). When only
+// one datagram or reply is pending, and on kernels without recvmmsg/sendmmsg, the plain
+// recvfrom()/sendto() calls are used.
+//
+// batch_io_use_uring() moves both directions onto an io_uring instead: one multishot recvmsg
+// keeps receiving into a ring of provided buffers without a system call per batch, and the
+// replies of a batch are submitted as sendmsg SQEs with one io_uring_enter(). The calls below
+// work the same with either backend.
+
+struct batch_io_uring;
+
+typedef struct batch_io {
+    int fd;
+    unsigned int cap;           // slots per direction
+    size_t rx_size;             // bytes per receive slot
+    size_t tx_size;             // bytes per reply slot
+    char *rx_buf;
+    char *tx_buf;
+    struct sockaddr_in *rx_addr;
+    struct sockaddr_in *tx_addr;
+    struct iovec *rx_iov;
+    struct iovec *tx_iov;
+    struct mmsghdr *rx_msgs;    // complete type only with _GNU_SOURCE, used in batch_io.c
+    struct mmsghdr *tx_msgs;
+    unsigned int tx_count;      // replies waiting for batch_io_flush()
+    int no_mmsg;                // recvmmsg/sendmmsg not available
+    struct batch_io_uring *uring; // io_uring backend, NULL for recvmmsg/sendmmsg
+} batch_io;
+
+// Slots for `cap` datagrams of up to `rx_size` bytes and `cap` replies of `tx_size` bytes.
+// Returns NULL if out of memory.
+batch_io *batch_io_create(int fd, unsigned int cap, size_t rx_size, size_t tx_size);
+
+void batch_io_destroy(batch_io *b);
+
+// Switch to the io_uring backend (multishot recvmsg needs Linux 6.0). Returns 0, -1 if io_uring
+// is not available here, the recvmmsg/sendmmsg backend stays in use then. Should a kernel turn
+// down the multishot receive later on, batch_io_recv() goes back to recvmmsg by itself.
+int batch_io_use_uring(batch_io *b);
+
+// Wait up to `timeout_ms` (< 0 without limit) for datagrams to receive, like poll() on the socket.
+// Returns 1 if there are some, 0 on timeout, -1 on error (errno set).
+int batch_io_wait(batch_io *b, int timeout_ms);
+
+// Receive up to `cap` datagrams. `flags` as for recvmmsg(): MSG_WAITFORONE blocks until the first
+// datagram and then takes only what is already queued, MSG_DONTWAIT never blocks.
+// Returns the number received, 0 if none was queued with MSG_DONTWAIT, -1 on error (errno set).
+int batch_io_recv(batch_io *b, int flags);
+
+// Payload, length and sender of the i-th datagram of the last batch_io_recv(),
+// valid until the next batch_io_wait() or batch_io_recv()
+static inline void *batch_io_rx_data(batch_io *b, int i) {
+    return b->rx_iov[i].iov_base;
+}
+
+int batch_io_rx_len(const batch_io *b, int i);
+
+static inline struct sockaddr_in *batch_io_rx_addr(batch_io *b, int i) {
+    return &b->rx_addr[i];
+}
+
+// Zeroed slot of `tx_size` bytes for a reply to `to`, sent on the next batch_io_flush().
+// Flushes first if all reply slots are taken.
+void *batch_io_reply(batch_io *b, const struct sockaddr_in *to);
+
+// Send the pending replies. Returns the number of replies that could not be sent.
+int batch_io_flush(batch_io *b);
+
+#endif
@@ -89,6 +89,26 @@
 #define SERVER_WAIT_TIMEOUT 2000
 #endif
 
+// Maximum number of packets the server receives, and responses it sends, with one syscall
+#ifndef RECV_BATCH_SIZE
+#define RECV_BATCH_SIZE 64
+#endif
+
+// Upper limit for the server's worker threads (-t)
+#ifndef MAX_WORKERS
+#define MAX_WORKERS 256
+#endif
+
+// Seconds between two reports of the workers' packet rates
+#ifndef STATS_INTERVAL
+#define STATS_INTERVAL 10
+#endif
+
+// Initial number of client sessions the server makes room for, grows as needed
+#ifndef SESSION_TABLE_CAPACITY
+#define SESSION_TABLE_CAPACITY 4096
+#endif
+
 // Timeout for client to receive next ACK packet from the server
 #ifndef CLIENT_RECV_TIMEOUT
 #define CLIENT_RECV_TIMEOUT 3000
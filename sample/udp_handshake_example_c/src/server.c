@@ -1,17 +1,55 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "batch_io.h"
 #include "const.h"
 #include "log.h"
+#include "session.h"
+#include "shard.h"
+
+// State of one worker: its own socket, packet buffers and client sessions, nothing shared
+typedef struct worker {
+    int index;
+    int cpu;                    // CPU the worker runs on, -1 if not pinned
+    int server_fd;              // socket file descriptor
+    batch_io *io;               // receives up to RECV_BATCH_SIZE packets and sends their responses with one syscall each
+    session_table *sessions;    // expected packet-segment-num of every client heard from in the last SERVER_WAIT_TIMEOUT ms
+    pthread_t thread;
+    shard_stats stats;
+} worker;
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void log_lock(bool lock, void *udata) {
+    if (lock) {
+        pthread_mutex_lock(&log_mutex);
+    } else {
+        pthread_mutex_unlock(&log_mutex);
+    }
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void on_session_expired(const session *s, void *arg) {
+    struct in_addr addr = { .s_addr = s->addr };
+    log_info("Client ip = %s port = %d id = %d connection time out.", inet_ntoa(addr), ntohs(s->port), s->client_id);
+}
 
 void init_resp_packet(response_packet *rsp_pkt, request_packet *req_pkt) {
     // Whether ACK or REJECT, the return packets have similar values
@@ -45,103 +83,202 @@ void handle_cases(response_packet *rsp_pkt, request_packet *req_pkt, int *packet
     }
 }
 
+static void *serve(void *arg) {
+    worker *w = (worker *)arg;
+    struct sockaddr_in client_addr; // sock address of the client of the packet at hand
+    int recv_bytes; // received packet size in bytes, used as sanity check
+    request_packet *req_pkt; // packet from the client, in a receive slot of io
+    response_packet *rsp_pkt; // response packet from server, in a reply slot of io
+    int recv_count; // number of packets received in one go
+    int send_failed; // responses of a batch which could not be sent
+    int poll_ret; // return value for batch_io_wait(), 1 if packets are waiting, 0 on timeout. Used as sanity check
+    session *sess;
+
+    if (w->cpu >= 0 && shard_pin_cpu(w->cpu) < 0) {
+        log_warn("Worker %d: could not be pinned to CPU %d.", w->index, w->cpu);
+    }
+
+    // ======================== SERVER LOOP ========================
+    // since we're using UDP protocol, no need to call accept()
+    while (TRUE) {
+        // Wait for the next packet, or until the next client session times out.
+        // Unlike the Timer used in the Client (which wait for ACK/REJECT from Server)
+        // this wakes the Server up when a client session is due, so that it can be
+        // dropped while other clients keep sending.
+        poll_ret = batch_io_wait(w->io, session_table_next_timeout(w->sessions, now_ms()));
+        if (poll_ret < 0) { // handle error polling
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Error waiting for packets. Stop.");
+            exit(EXIT_FAILURE);
+        }
+        session_table_expire(w->sessions, now_ms(), on_session_expired, NULL);
+        if (poll_ret == 0) { // no state mutated after poll returns, can only be timeout
+            continue;
+        }
+
+        // Take every packet already queued on the socket (up to RECV_BATCH_SIZE) with one call
+        recv_count = batch_io_recv(w->io, MSG_DONTWAIT);
+        if (recv_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Error receiving packets.");
+            exit(EXIT_FAILURE);
+        }
+        if (recv_count > 0) {
+            shard_stats_add(&w->stats.rx_packets, recv_count);
+            shard_stats_add(&w->stats.batches, 1);
+        }
+
+        for (int i = 0; i < recv_count; i++) {
+            req_pkt = batch_io_rx_data(w->io, i);
+            recv_bytes = batch_io_rx_len(w->io, i);
+            client_addr = *batch_io_rx_addr(w->io, i);
+            char * client_ip = inet_ntoa(client_addr.sin_addr);
+            // Sanity check: packet has content
+            if (recv_bytes == 0) {
+                log_warn("Received zero bytes at recvfrom(), client ip = %s", client_ip); // datagram sockets might permit zero length packets
+            } else {
+                log_info("Message received from client ip = %s", client_ip);
+            }
+
+            // Judge the packet against this client's own sequence, restarting its timeout
+            if (!(sess = session_get(w->sessions, &client_addr, req_pkt->client_id, now_ms()))) {
+                log_error("Out of memory for client session, client ip = %s", client_ip);
+                continue;
+            }
+            rsp_pkt = batch_io_reply(w->io, &client_addr);
+            init_resp_packet(rsp_pkt, req_pkt);
+            handle_cases(rsp_pkt, req_pkt, &sess->packet_counter);
+        }
+
+        // Send the return packets of the whole batch to the Clients via the socket.
+        unsigned int replies = w->io->tx_count;
+        if ((send_failed = batch_io_flush(w->io)) > 0) {
+            log_error("Server Error: Failed to Send %d Packets to Clients.", send_failed);
+            // doesn't return -1 on this failure: Server continues to operate in case issue was on Client's end
+            shard_stats_add(&w->stats.send_failed, send_failed);
+        }
+        shard_stats_add(&w->stats.tx_packets, replies - send_failed);
+    }  // No exit for the Server - it will always wait for Clients. Force-kill Server via CLI (ctrl-C).
+    return NULL;
+}
+
 int main(int argc, char **argv) {
-    struct sockaddr_in server_addr, client_addr; // sock addresses for client and server.
-    int server_fd; // socket file descriptor
     int port = DEFAULT_SERVER_PORT;
-    socklen_t addrlen = sizeof(struct sockaddr_in); // length of a sockaddr_in to be used in bind() and recvfrom(), sendto()
-    int recv_bytes; // received packet size in bytes, used as sanity check
-    request_packet req_pkt; // struct to hold data from recv()
-    response_packet rsp_pkt; // struct for response packet from server
-    int poll_ret; // return value for poll(), the number of fds which status changes been detected. Used as sanity check
-    int packet_counter = 0; // packet-segment-num expected
-    int is_connect_alive = FALSE; // flag for determining if a connection is still alive
+    int num_workers = 1; // worker threads, each with its own SO_REUSEPORT socket
+    int use_cbpf = FALSE; // steer each client to a fixed worker with a BPF program
+    int use_uring = FALSE; // receive and send through io_uring instead of recvmmsg/sendmmsg
+    int cpus[MAX_WORKERS]; // CPUs the workers are pinned to
+    int num_cpus;
+    int opt;
+    worker *workers;
     log_info("test");
 
+    // Parse options: -t <threads> (0 = one per CPU), -b (BPF steering), -u (io_uring), then the port
+    while ((opt = getopt(argc, argv, "t:bu")) != -1) {
+        if (opt == 't') {
+            num_workers = atoi(optarg);
+        } else if (opt == 'b') {
+            use_cbpf = TRUE;
+        } else if (opt == 'u') {
+            use_uring = TRUE;
+        } else {
+            log_fatal("Usage: %s [-t threads] [-b] [-u] [port]", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // Set port from command line argument
-    if (argc < 2) {
+    if (optind >= argc) {
         log_info("Using default port %d <port>", DEFAULT_SERVER_PORT);
     } else {
-        log_info("Using port %s", argv[1]);
-        port = atoi(argv[1]);
+        log_info("Using port %s", argv[optind]);
+        port = atoi(argv[optind]);
     }
 
-    // Create UDP socket
-    if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        log_fatal("Socket creation failed.");
-        exit(EXIT_FAILURE);
+    num_cpus = shard_cpus(cpus, MAX_WORKERS);
+    if (num_workers <= 0) {
+        num_workers = num_cpus > 0 ? num_cpus : 1;
+    }
+    if (num_workers > MAX_WORKERS) {
+        num_workers = MAX_WORKERS;
+    }
+    if (num_workers > 1) {
+        log_set_lock(log_lock, NULL);
     }
 
-    // Setup the Server Sock Addr
-    memset((char *)&server_addr, 0, addrlen);
-    memset((char *)&client_addr, 0, addrlen);
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY); // accepts traffic from all IPv4 addresses on the local machine
-    server_addr.sin_port = htons(port);
-
-    // Bind to the Socket and the Selected Port
-    if (bind(server_fd, (struct sockaddr *)&server_addr, addrlen) < 0) {
-        log_fatal("Binding Failed.");
+    if (!(workers = shard_calloc(num_workers, sizeof(worker)))) {
+        log_fatal("Worker allocation failed.");
         exit(EXIT_FAILURE);
     }
+    for (int i = 0; i < num_workers; i++) {
+        worker *w = &workers[i];
+        w->index = i;
+        w->cpu = num_workers > 1 && num_cpus > 0 ? cpus[i % num_cpus] : -1;
 
-    // Use poll() to detect timeout
-    // Unlike the Timer used in the Client (which wait for ACK/REJECT from Server)
-    // This Timer is used to determine if the Server needs to drop connection to a Client
-    // and instead ready itself for a new client to connect.
-    struct pollfd server_timer_pollfd;
-    server_timer_pollfd.fd = server_fd;
-    server_timer_pollfd.events = POLLIN; // notes anything coming in on the socket.
-
-    log_info("PA1 Server: Listening for incoming connection on port %d", port);
+        // Create the UDP socket and bind it to the selected port. With several workers every
+        // worker binds its own, the kernel spreads the packets over them.
+        if ((w->server_fd = shard_socket(port, num_workers > 1)) < 0) {
+            log_fatal("Socket creation or binding failed.");
+            exit(EXIT_FAILURE);
+        }
+        if (!(w->io = batch_io_create(w->server_fd, RECV_BATCH_SIZE, sizeof(request_packet), sizeof(response_packet)))) {
+            log_fatal("Packet buffer allocation failed.");
+            exit(EXIT_FAILURE);
+        }
+        if (use_uring && batch_io_use_uring(w->io) < 0) {
+            log_warn("io_uring not available (%s), using recvmmsg/sendmmsg.", strerror(errno));
+            use_uring = FALSE;
+        }
 
-    // ======================== SERVER LOOP ========================
-    // since we're using UDP protocol, no need to call accept()
-    while (TRUE) {
-        if (is_connect_alive) {
-            // Detect if socket status has been changed. If changed, then proceed to get data using recvfrom
-            // Otherwise, if poll returns, The Server will wait 2 seconds between each received packet.
-            // If the Server receives no packets from Client in 2 sec, Server will assume Client has
-            // no more packets to send and will reset itself, waiting for next Client.
-            poll_ret = poll(&server_timer_pollfd, 1, SERVER_WAIT_TIMEOUT);
-            if (poll_ret == 0) { // no state mutated after poll returns, can only be timeout
-                // we time-out and reset to wait for a new client.
-                log_info("Current client connection time out. Waiting for new client");
-                packet_counter = 0; // resetting the expected packet counter.
-            } else if (poll_ret < 0) { // handle error polling
-                log_error("Error at poll(). Stop.");
-                return -1;
-            }
+        // Every (ip, port, client_id) gets its own session, expired once the client has been
+        // silent for SERVER_WAIT_TIMEOUT ms. A client sending again after that starts over at seg_num 0.
+        if (!(w->sessions = session_table_create(SESSION_TABLE_CAPACITY, SERVER_WAIT_TIMEOUT, now_ms()))) {
+            log_fatal("Session table allocation failed.");
+            exit(EXIT_FAILURE);
         }
+    }
 
-        // We wait on the socket to get a data packet from the Client
-        recv_bytes = recvfrom(server_fd, &req_pkt, sizeof(request_packet), 0, (struct sockaddr *)&client_addr, &addrlen);
-        char * client_ip = inet_ntoa(client_addr.sin_addr);
-        // Sanity check: packet has content
-        if (recv_bytes < 0) {
-            log_error("Error at recvfrom(), client ip = %s", client_ip);
-            return -1;
-        } else if (recv_bytes == 0) {
-            log_warn("Received zero bytes at recvfrom(), client ip = %s", client_ip); // datagram sockets might permit zero length packets
-        } else {
-            log_info("Message received from client ip = %s", client_ip);
+    // The kernel's own hash already keeps a client on one worker; the BPF program makes the
+    // choice depend on the client's address and port alone
+    if (use_cbpf && num_workers > 1) {
+        if (shard_attach_cbpf(workers[0].server_fd, num_workers) < 0) {
+            log_fatal("Attaching the BPF program failed.");
+            exit(EXIT_FAILURE);
         }
+        log_info("Clients are steered to workers by source address and port.");
+    }
 
-        // Ensures that since we've got an active connection to the client
-        // that when Server waits on next packet, it uses the timer
-        // just in case the Client stops sending and the Server needs to wait
-        // for a new client.
-        is_connect_alive = TRUE;
-        init_resp_packet(&rsp_pkt, &req_pkt);
-        handle_cases(&rsp_pkt, &req_pkt, &packet_counter);
-
-        // Send return packet to the Client via the socket.
-        if (sendto(server_fd, &rsp_pkt, sizeof(response_packet), 0, (struct sockaddr *)&client_addr, addrlen) < 0) {
-            log_error("Server Error: Failed to Send Packet to Client ip = %s.", client_ip);
-            // doesn't return -1 on this failure: Server continues to operate in case issue was on Client's end
+    log_info("PA1 Server: Listening for incoming connection on port %d with %d worker(s), %s", port, num_workers, use_uring ? "io_uring" : "recvmmsg/sendmmsg");
+
+    if (num_workers == 1) {
+        serve(&workers[0]);
+        return 0;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, serve, &workers[i]) != 0) {
+            log_fatal("Could not start worker %d.", i);
+            exit(EXIT_FAILURE);
         }
-    }  // No exit for the Server - it will always wait for Clients. Force-kill Server via CLI (ctrl-C).
+    }
 
-    close(server_fd);
+    // The workers never return, the main thread reports their traffic
+    shard_stats *stats[MAX_WORKERS];
+    shard_stats *last = shard_calloc(num_workers, sizeof(shard_stats));
+    if (!last) {
+        log_fatal("Stats allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        stats[i] = &workers[i].stats;
+    }
+    while (TRUE) {
+        sleep(STATS_INTERVAL);
+        shard_log_stats(stats, last, num_workers, STATS_INTERVAL);
+    }
     return 0;
 }
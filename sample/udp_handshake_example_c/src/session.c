@@ -0,0 +1,233 @@
+#include "session.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WHEEL_MASK (SESSION_WHEEL_SLOTS - 1)
+
+static uint32_t session_hash(uint32_t addr, uint16_t port, char client_id) {
+    // 64-bit finalizer of MurmurHash3 over the packed key
+    uint64_t k = ((uint64_t)addr << 32) | ((uint32_t)port << 8) | (uint8_t)client_id;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (uint32_t)k;
+}
+
+static uint32_t to_tick(const session_table *t, uint64_t now_ms) {
+    return (uint32_t)((now_ms - t->base_ms) / SESSION_TICK_MS);
+}
+
+static void wheel_link(session_table *t, uint32_t idx) {
+    session *s = &t->slots[idx];
+    uint32_t *head = &t->wheel[s->expire_tick & WHEEL_MASK];
+    s->wheel_prev = SESSION_NIL;
+    s->wheel_next = *head;
+    if (*head != SESSION_NIL) {
+        t->slots[*head].wheel_prev = idx;
+    }
+    *head = idx;
+}
+
+static void wheel_unlink(session_table *t, uint32_t idx) {
+    session *s = &t->slots[idx];
+    if (s->wheel_prev != SESSION_NIL) {
+        t->slots[s->wheel_prev].wheel_next = s->wheel_next;
+    } else {
+        t->wheel[s->expire_tick & WHEEL_MASK] = s->wheel_next;
+    }
+    if (s->wheel_next != SESSION_NIL) {
+        t->slots[s->wheel_next].wheel_prev = s->wheel_prev;
+    }
+}
+
+// Move the session in slot `from` to the free slot `to`, keeping its wheel links valid
+static void session_move(session_table *t, uint32_t from, uint32_t to) {
+    t->slots[to] = t->slots[from];
+    session *s = &t->slots[to];
+    if (s->wheel_prev != SESSION_NIL) {
+        t->slots[s->wheel_prev].wheel_next = to;
+    } else {
+        t->wheel[s->expire_tick & WHEEL_MASK] = to;
+    }
+    if (s->wheel_next != SESSION_NIL) {
+        t->slots[s->wheel_next].wheel_prev = to;
+    }
+}
+
+// Remove the session in slot `idx`. Later sessions of the same probe run are shifted back
+// into the hole, so that every session stays reachable from its home slot without tombstones.
+static void session_remove(session_table *t, uint32_t idx) {
+    wheel_unlink(t, idx);
+    uint32_t hole = idx;
+    uint32_t j = idx;
+    while (1) {
+        j = (j + 1) & t->mask;
+        session *s = &t->slots[j];
+        if (!s->used) {
+            break;
+        }
+        uint32_t home = session_hash(s->addr, s->port, s->client_id) & t->mask;
+        // s can fill the hole unless its home lies cyclically in (hole, j]
+        if (((j - home) & t->mask) >= ((j - hole) & t->mask)) {
+            session_move(t, j, hole);
+            hole = j;
+        }
+    }
+    t->slots[hole].used = 0;
+    t->count--;
+}
+
+static int session_table_grow(session_table *t) {
+    uint32_t old_cap = t->mask + 1;
+    session *old = t->slots;
+    session *slots = calloc((size_t)old_cap * 2, sizeof(session));
+    if (!slots) {
+        return -1;
+    }
+    t->slots = slots;
+    t->mask = old_cap * 2 - 1;
+    for (int i = 0; i < SESSION_WHEEL_SLOTS; i++) {
+        t->wheel[i] = SESSION_NIL;
+    }
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (!old[i].used) {
+            continue;
+        }
+        uint32_t j = session_hash(old[i].addr, old[i].port, old[i].client_id) & t->mask;
+        while (slots[j].used) {
+            j = (j + 1) & t->mask;
+        }
+        slots[j] = old[i];
+        wheel_link(t, j);
+    }
+    free(old);
+    return 0;
+}
+
+session_table *session_table_create(uint32_t capacity, uint32_t timeout_ms, uint64_t now_ms) {
+    session_table *t = calloc(1, sizeof(session_table));
+    if (!t) {
+        return NULL;
+    }
+    // keep the load factor at or below 3/4
+    uint32_t cap = 16;
+    while (cap / 4 * 3 < capacity) {
+        cap <<= 1;
+    }
+    t->slots = calloc(cap, sizeof(session));
+    if (!t->slots) {
+        free(t);
+        return NULL;
+    }
+    t->mask = cap - 1;
+    t->timeout_ms = timeout_ms;
+    t->base_ms = now_ms;
+    for (int i = 0; i < SESSION_WHEEL_SLOTS; i++) {
+        t->wheel[i] = SESSION_NIL;
+    }
+    return t;
+}
+
+void session_table_destroy(session_table *t) {
+    if (t) {
+        free(t->slots);
+        free(t);
+    }
+}
+
+session *session_get(session_table *t, const struct sockaddr_in *addr, char client_id, uint64_t now_ms) {
+    uint32_t ip = addr->sin_addr.s_addr;
+    uint16_t port = addr->sin_port;
+    uint32_t hash = session_hash(ip, port, client_id);
+    uint32_t i = hash & t->mask;
+    session *s;
+    while ((s = &t->slots[i])->used) {
+        if (s->addr == ip && s->port == port && s->client_id == client_id) {
+            wheel_unlink(t, i);
+            break;
+        }
+        i = (i + 1) & t->mask;
+    }
+
+    if (!s->used) {
+        if (t->count + 1 > (t->mask + 1) / 4 * 3) {
+            if (session_table_grow(t) < 0) {
+                return NULL;
+            }
+            i = hash & t->mask;
+            while (t->slots[i].used) {
+                i = (i + 1) & t->mask;
+            }
+            s = &t->slots[i];
+        }
+        memset(s, 0, sizeof(session));
+        s->addr = ip;
+        s->port = port;
+        s->client_id = client_id;
+        s->used = 1;
+        t->count++;
+    }
+
+    // first tick at or after the deadline, never one already expired
+    s->expire_tick = (uint32_t)((now_ms - t->base_ms + t->timeout_ms + SESSION_TICK_MS - 1) / SESSION_TICK_MS);
+    if ((int32_t)(s->expire_tick - t->tick) <= 0) {
+        s->expire_tick = t->tick + 1;
+    }
+    wheel_link(t, i);
+    return s;
+}
+
+int session_table_expire(session_table *t, uint64_t now_ms, session_expire_fn on_expire, void *arg) {
+    uint32_t now_tick = to_tick(t, now_ms);
+    uint32_t ticks = now_tick - t->tick;
+    if ((int32_t)ticks <= 0) {
+        return 0;
+    }
+    if (ticks > SESSION_WHEEL_SLOTS) {
+        ticks = SESSION_WHEEL_SLOTS;
+    }
+
+    int expired = 0;
+    for (uint32_t k = 1; k <= ticks && t->count; k++) {
+        uint32_t *head = &t->wheel[(t->tick + k) & WHEEL_MASK];
+        uint32_t idx = *head;
+        while (idx != SESSION_NIL) {
+            session *s = &t->slots[idx];
+            if ((int32_t)(s->expire_tick - now_tick) > 0) {
+                // due on a later turn of the wheel
+                idx = s->wheel_next;
+                continue;
+            }
+            if (on_expire) {
+                on_expire(s, arg);
+            }
+            session_remove(t, idx);
+            expired++;
+            // removal may have moved sessions of this bucket to other slots
+            idx = *head;
+        }
+    }
+    t->tick = now_tick;
+    return expired;
+}
+
+int session_table_next_timeout(const session_table *t, uint64_t now_ms) {
+    if (!t->count) {
+        return -1;
+    }
+    uint32_t now_tick = to_tick(t, now_ms);
+    for (uint32_t k = 1; k <= SESSION_WHEEL_SLOTS; k++) {
+        uint32_t tick = t->tick + k;
+        if (t->wheel[tick & WHEEL_MASK] == SESSION_NIL) {
+            continue;
+        }
+        if ((int32_t)(tick - now_tick) <= 0) {
+            return 0;
+        }
+        return (int)(t->base_ms + (uint64_t)tick * SESSION_TICK_MS - now_ms);
+    }
+    return 0;
+}
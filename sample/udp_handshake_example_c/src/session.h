@@ -0,0 +1,71 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+// Per-client state of the handshake server, keyed by (client address, client port, client_id).
+//
+// Sessions live inline in an open-addressing table (linear probing, backward-shift deletion,
+// so there are no tombstones and lookups stay short under churn). Each session is also linked
+// into a timer wheel by slot index, which expires sessions that were idle for the table's
+// timeout in O(1) per session.
+
+// Granularity of the expiry wheel. A session expires at most one tick after its timeout.
+#ifndef SESSION_TICK_MS
+#define SESSION_TICK_MS 16
+#endif
+
+// Number of wheel buckets, a power of two. Timeouts up to SESSION_TICK_MS * SESSION_WHEEL_SLOTS
+// expire on the first pass over their bucket, longer ones are revisited once per turn.
+#ifndef SESSION_WHEEL_SLOTS
+#define SESSION_WHEEL_SLOTS 256
+#endif
+
+// "no slot" marker for wheel links
+#define SESSION_NIL 0xFFFFFFFFu
+
+typedef struct session {
+    uint32_t addr;          // client IPv4 address, network byte order
+    uint16_t port;          // client port, network byte order
+    char client_id;
+    uint8_t used;           // slot holds a session
+    int packet_counter;     // packet-segment-num expected next from this client
+    uint32_t expire_tick;   // wheel tick at which the session times out
+    uint32_t wheel_prev;    // neighbours in the wheel bucket, SESSION_NIL at the ends
+    uint32_t wheel_next;
+} session;
+
+typedef struct session_table {
+    session *slots;
+    uint32_t mask;          // capacity - 1, capacity is a power of two
+    uint32_t count;
+    uint32_t timeout_ms;
+    uint64_t base_ms;       // time of tick 0
+    uint32_t tick;          // last tick whose bucket was expired
+    uint32_t wheel[SESSION_WHEEL_SLOTS]; // first session of each bucket
+} session_table;
+
+typedef void (*session_expire_fn)(const session *s, void *arg);
+
+// Create a table sized for about `capacity` sessions (it grows when needed) expiring sessions
+// idle for `timeout_ms`. `now_ms` is the current time of a monotonic millisecond clock.
+// Returns NULL if out of memory.
+session_table *session_table_create(uint32_t capacity, uint32_t timeout_ms, uint64_t now_ms);
+
+void session_table_destroy(session_table *t);
+
+// Session of the client at `addr` with `client_id`, created with packet_counter 0 if there is
+// none. Its timeout is restarted. The pointer is valid until the next call changing the table.
+// Returns NULL if out of memory.
+session *session_get(session_table *t, const struct sockaddr_in *addr, char client_id, uint64_t now_ms);
+
+// Remove the sessions that timed out by `now_ms`, calling `on_expire` (if not NULL) for each
+// before it is removed. Returns the number of sessions removed.
+int session_table_expire(session_table *t, uint64_t now_ms, session_expire_fn on_expire, void *arg);
+
+// Milliseconds until session_table_expire() has work to do, to be used as a poll() timeout.
+// -1 if there are no sessions.
+int session_table_next_timeout(const session_table *t, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,114 @@
+#define _GNU_SOURCE  // CPU_SET, pthread_setaffinity_np
+#include "shard.h"
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+int shard_socket(int port, int reuseport) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        close(fd);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);  // accepts traffic from all IPv4 addresses on the local machine
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int shard_attach_cbpf(int fd, int count) {
+    // The program sees the packet from the UDP payload on, the headers are read relative to
+    // the network header (SKF_NET_OFF). The hash is a multiplicative one on address ^ port.
+    struct sock_filter code[] = {
+        { BPF_LDX | BPF_B | BPF_MSH, 0, 0, SKF_NET_OFF },        // X = IPv4 header length
+        { BPF_LD | BPF_H | BPF_IND, 0, 0, SKF_NET_OFF },         // A = UDP source port
+        { BPF_MISC | BPF_TAX, 0, 0, 0 },                         // X = A
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },    // A = IPv4 source address
+        { BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },                  // A ^= X
+        { BPF_ALU | BPF_MUL | BPF_K, 0, 0, 0x9E3779B1 },         // A *= 2^32 / golden ratio
+        { BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16 },                 // A >>= 16, keep the well mixed bits
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned int)count },// A %= count
+        { BPF_RET | BPF_A, 0, 0, 0 },                            // deliver to socket A
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int shard_cpus(int *cpus, int max) {
+    cpu_set_t set;
+    int n = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        return 0;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[n++] = cpu;
+        }
+    }
+    return n;
+}
+
+int shard_pin_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+void *shard_calloc(size_t count, size_t size) {
+    void *p;
+    if (size && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    if (posix_memalign(&p, _Alignof(shard_stats), count * size) != 0) {
+        return NULL;
+    }
+    memset(p, 0, count * size);
+    return p;
+}
+
+void shard_log_stats(shard_stats *const *stats, shard_stats *last, int count, unsigned int interval_sec) {
+    unsigned long total = 0;
+    for (int i = 0; i < count; i++) {
+        shard_stats now;
+        now.rx_packets = __atomic_load_n(&stats[i]->rx_packets, __ATOMIC_RELAXED);
+        now.tx_packets = __atomic_load_n(&stats[i]->tx_packets, __ATOMIC_RELAXED);
+        now.batches = __atomic_load_n(&stats[i]->batches, __ATOMIC_RELAXED);
+        now.send_failed = __atomic_load_n(&stats[i]->send_failed, __ATOMIC_RELAXED);
+        unsigned long rx = now.rx_packets - last[i].rx_packets;
+        unsigned long batches = now.batches - last[i].batches;
+        log_info("Worker %d: %lu pkt/s received, %lu pkt/s sent, %.1f pkt per recv, %lu send failures",
+                 i, rx / interval_sec, (now.tx_packets - last[i].tx_packets) / interval_sec,
+                 batches ? (double)rx / batches : 0.0, now.send_failed - last[i].send_failed);
+        total += rx;
+        last[i] = now;
+    }
+    log_info("All workers: %lu pkt/s received", total / interval_sec);
+}
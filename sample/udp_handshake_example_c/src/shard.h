@@ -0,0 +1,50 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+
+// Running the server as one worker thread per core.
+//
+// Every worker has its own UDP socket bound to the same port with SO_REUSEPORT, so the kernel
+// spreads the incoming packets over the workers and they share nothing. By default the kernel
+// picks the socket by a hash of the packet's addresses and ports. shard_attach_cbpf() installs
+// a classic BPF program instead, which picks it from the client's address and port alone, so
+// all packets of one client go to the same worker for as long as the worker count stays the same.
+
+// Per-worker counters, written by the worker only. Each worker's counters sit on their own cache line.
+typedef struct shard_stats {
+    unsigned long rx_packets;   // packets received
+    unsigned long tx_packets;   // responses sent
+    unsigned long batches;      // receive calls which returned packets
+    unsigned long send_failed;  // responses which could not be sent
+} __attribute__((aligned(64))) shard_stats;
+
+static inline void shard_stats_add(unsigned long *counter, unsigned long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// Zeroed array of `count` elements of `size` bytes, aligned for the cache-line aligned types
+// above (plain calloc() only guarantees 16 bytes). Free with free(). Returns NULL if out of memory.
+void *shard_calloc(size_t count, size_t size);
+
+// UDP socket bound to `port` on all local IPv4 addresses, with SO_REUSEPORT set if `reuseport`.
+// Returns the fd, -1 on error.
+int shard_socket(int port, int reuseport);
+
+// Have the reuseport group of `fd` deliver each packet to socket
+// hash(source address, source port) % `count`, sockets numbered in the order they were bound.
+// Returns 0, -1 on error.
+int shard_attach_cbpf(int fd, int count);
+
+// CPUs the process may run on, at most `max` of them. Returns how many were stored.
+int shard_cpus(int *cpus, int max);
+
+// Run the calling thread on `cpu` only. Returns 0, -1 on error.
+int shard_pin_cpu(int cpu);
+
+// Log packets per second of every worker since the previous call. `stats[i]` are the live
+// counters of worker i, read with atomic loads while the workers update them. `last` holds the
+// counters seen by the previous call and is updated.
+void shard_log_stats(shard_stats *const *stats, shard_stats *last, int count, unsigned int interval_sec);
+
+#endif
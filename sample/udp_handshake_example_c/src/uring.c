@@ -0,0 +1,176 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(uring *r, unsigned int entries) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(uring));
+    memset(&p, 0, sizeof(p));
+    // completions are only needed when the thread enters the kernel anyway, no need to interrupt it
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        r->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (r->fd < 0) {
+        return -1;
+    }
+    // waiting with a timeout needs IORING_ENTER_EXT_ARG (5.11)
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(r->fd);
+        r->fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size) {
+            r->sq_map_size = r->cq_map_size;
+        }
+        r->cq_map_size = r->sq_map_size;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            munmap(r->sq_map, r->sq_map_size);
+            close(r->fd);
+            r->fd = -1;
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_map != r->sq_map) {
+            munmap(r->cq_map, r->cq_map_size);
+        }
+        munmap(r->sq_map, r->sq_map_size);
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+
+    char *sq = r->sq_map;
+    char *cq = r->cq_map;
+    r->sq_entries = p.sq_entries;
+    r->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    r->sqe_tail = *r->sq_tail;
+    r->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // SQE i always sits at position i of the submission queue
+    unsigned int *array = (unsigned int *)(sq + p.sq_off.array);
+    for (unsigned int i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    return 0;
+}
+
+void uring_exit(uring *r) {
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_size);
+    }
+    munmap(r->sq_map, r->sq_map_size);
+    close(r->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring *r) {
+    if (uring_sq_pending(r) == r->sq_entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int uring_enter(uring *r, unsigned int min_complete, int timeout_ms) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned int flags = 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    if (min_complete) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = (unsigned long)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+    }
+    return sys_io_uring_enter(r->fd, uring_sq_pending(r), min_complete, flags, argp, argsz);
+}
+
+int uring_buf_ring_init(uring *r, uring_buf_ring *br, unsigned int entries, unsigned short bgid) {
+    struct io_uring_buf_reg reg;
+    size_t size = entries * sizeof(struct io_uring_buf);
+    memset(br, 0, sizeof(uring_buf_ring));
+    // the kernel wants the ring page aligned
+    br->ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br->ring == MAP_FAILED) {
+        br->ring = NULL;
+        return -1;
+    }
+    br->entries = entries;
+    br->bgid = bgid;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)br->ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = errno;
+        uring_buf_ring_free(br);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_buf_ring_free(uring_buf_ring *br) {
+    if (br->ring) {
+        munmap(br->ring, br->entries * sizeof(struct io_uring_buf));
+        br->ring = NULL;
+    }
+}
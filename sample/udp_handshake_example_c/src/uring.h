@@ -0,0 +1,93 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+// Minimal io_uring on the raw system calls, without liburing.
+//
+// SQEs are taken with uring_get_sqe() and filled in by the caller. uring_enter() submits all
+// of them with one system call and can wait for completions in the same call; completions are
+// read with uring_peek_cqe() and released with uring_cqe_seen(). A provided buffer ring
+// (uring_buf_ring) gives the kernel buffers to receive into: it picks one per completion and
+// names it in the CQE's flags, the buffer goes back to the ring with uring_buf_ring_add().
+
+typedef struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int sq_mask;
+    unsigned int *sq_head;      // SQEs consumed by the kernel
+    unsigned int *sq_tail;      // SQEs published to the kernel
+    unsigned int sqe_tail;      // SQEs taken, published on the next uring_enter()
+    struct io_uring_sqe *sqes;
+    unsigned int cq_mask;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;               // same as sq_map if the kernel maps both rings at once
+    size_t cq_map_size;
+    size_t sqes_size;
+} uring;
+
+typedef struct uring_buf_ring {
+    struct io_uring_buf_ring *ring;
+    unsigned int entries;       // power of two
+    unsigned short tail;        // buffers added, published with uring_buf_ring_publish()
+    unsigned short bgid;        // buffer group the SQEs select from
+} uring_buf_ring;
+
+// Ring with room for `entries` SQEs and 2 * `entries` CQEs. Returns 0, -1 on error (errno set),
+// e.g. ENOSYS on kernels without io_uring and EPERM where it is disabled; `fd` is -1 then.
+int uring_init(uring *r, unsigned int entries);
+
+void uring_exit(uring *r);
+
+// Next free SQE, zeroed. Returns NULL if all are taken and not submitted yet.
+struct io_uring_sqe *uring_get_sqe(uring *r);
+
+// SQEs taken but not yet consumed by the kernel
+static inline unsigned int uring_sq_pending(const uring *r) {
+    return r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// Submit the taken SQEs and wait until at least `min_complete` CQEs are ready, at most
+// `timeout_ms` (< 0 waits without limit). Returns the number of SQEs submitted, -1 on error
+// (errno set, ETIME if the timeout expired first).
+int uring_enter(uring *r, unsigned int min_complete, int timeout_ms);
+
+// Oldest CQE not seen yet, NULL if there is none
+static inline struct io_uring_cqe *uring_peek_cqe(uring *r) {
+    unsigned int head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+static inline void uring_cqe_seen(uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Register a ring of `entries` (power of two) buffers as buffer group `bgid`.
+// Returns 0, -1 on error (errno set, EINVAL on kernels before 5.19).
+int uring_buf_ring_init(uring *r, uring_buf_ring *br, unsigned int entries, unsigned short bgid);
+
+// Unmap the ring, after uring_exit()
+void uring_buf_ring_free(uring_buf_ring *br);
+
+static inline void uring_buf_ring_add(uring_buf_ring *br, void *addr, unsigned int len, unsigned short bid) {
+    struct io_uring_buf *buf = &br->ring->bufs[br->tail & (br->entries - 1)];
+    buf->addr = (unsigned long)addr;
+    buf->len = len;
+    buf->bid = bid;
+    br->tail++;
+}
+
+// Make the added buffers visible to the kernel
+static inline void uring_buf_ring_publish(uring_buf_ring *br) {
+    __atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE  // recvmmsg, sendmmsg
+#include "batch_io.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uring.h"
+
+#define URING_BGID 0
+#define URING_TAG_RECV 1
+#define URING_TAG_SEND 2
+
+// Received datagram still in its provided buffer
+typedef struct uring_rx {
+    unsigned short bid;
+    unsigned int len;           // bytes the kernel wrote to the buffer
+} uring_rx;
+
+typedef struct batch_io_uring {
+    uring ring;
+    uring_buf_ring bufs;
+    char *buf_mem;              // nbufs buffers of buf_size bytes, buffer id = index
+    unsigned int buf_size;
+    unsigned int nbufs;         // power of two, at least cap
+    struct msghdr recv_hdr;     // layout of the multishot recvmsg buffers: address, no control data
+    int recv_armed;             // the multishot recvmsg is still active
+    int recv_unsupported;       // the kernel turned down the multishot recvmsg
+    uring_rx *pending;          // completed, not yet returned by batch_io_recv(), FIFO of nbufs
+    unsigned int pending_head;
+    unsigned int pending_count;
+    unsigned short *held;       // buffers of the datagrams returned by the last batch_io_recv()
+    unsigned int held_count;
+    unsigned int sends_inflight;
+    int send_failed;
+} batch_io_uring;
+
+batch_io *batch_io_create(int fd, unsigned int cap, size_t rx_size, size_t tx_size) {
+    batch_io *b = calloc(1, sizeof(batch_io));
+    if (!b) {
+        return NULL;
+    }
+    b->fd = fd;
+    b->cap = cap;
+    b->rx_size = rx_size;
+    b->tx_size = tx_size;
+    b->rx_buf = calloc(cap, rx_size);
+    b->tx_buf = calloc(cap, tx_size);
+    b->rx_addr = calloc(cap, sizeof(struct sockaddr_in));
+    b->tx_addr = calloc(cap, sizeof(struct sockaddr_in));
+    b->rx_iov = calloc(cap, sizeof(struct iovec));
+    b->tx_iov = calloc(cap, sizeof(struct iovec));
+    b->rx_msgs = calloc(cap, sizeof(struct mmsghdr));
+    b->tx_msgs = calloc(cap, sizeof(struct mmsghdr));
+    if (!b->rx_buf || !b->tx_buf || !b->rx_addr || !b->tx_addr || !b->rx_iov || !b->tx_iov || !b->rx_msgs || !b->tx_msgs) {
+        batch_io_destroy(b);
+        return NULL;
+    }
+
+    // the headers always point at the same slots, only the lengths change between calls
+    for (unsigned int i = 0; i < cap; i++) {
+        b->rx_iov[i].iov_base = b->rx_buf + i * rx_size;
+        b->rx_iov[i].iov_len = rx_size;
+        b->rx_msgs[i].msg_hdr.msg_iov = &b->rx_iov[i];
+        b->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        b->rx_msgs[i].msg_hdr.msg_name = &b->rx_addr[i];
+
+        b->tx_iov[i].iov_base = b->tx_buf + i * tx_size;
+        b->tx_iov[i].iov_len = tx_size;
+        b->tx_msgs[i].msg_hdr.msg_iov = &b->tx_iov[i];
+        b->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+        b->tx_msgs[i].msg_hdr.msg_name = &b->tx_addr[i];
+        b->tx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    return b;
+}
+
+static void uring_free(batch_io_uring *u) {
+    if (u->ring.fd >= 0) {
+        uring_exit(&u->ring);
+    }
+    uring_buf_ring_free(&u->bufs);
+    free(u->buf_mem);
+    free(u->pending);
+    free(u->held);
+    free(u);
+}
+
+void batch_io_destroy(batch_io *b) {
+    if (!b) {
+        return;
+    }
+    if (b->uring) {
+        uring_free(b->uring);
+    }
+    free(b->rx_buf);
+    free(b->tx_buf);
+    free(b->rx_addr);
+    free(b->tx_addr);
+    free(b->rx_iov);
+    free(b->tx_iov);
+    free(b->rx_msgs);
+    free(b->tx_msgs);
+    free(b);
+}
+
+static void uring_arm_recv(batch_io_uring *u, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)&u->recv_hdr;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_TAG_RECV;
+    u->recv_armed = 1;
+}
+
+int batch_io_use_uring(batch_io *b) {
+    batch_io_uring *u;
+    if (b->uring) {
+        return 0;
+    }
+    if (!(u = calloc(1, sizeof(batch_io_uring)))) {
+        return -1;
+    }
+    u->ring.fd = -1;
+    u->nbufs = 1;
+    while (u->nbufs < b->cap) {
+        u->nbufs <<= 1;
+    }
+    // every buffer holds the recvmsg header and the sender's address ahead of the payload
+    u->buf_size = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + b->rx_size;
+    u->buf_mem = malloc((size_t)u->nbufs * u->buf_size);
+    u->pending = calloc(u->nbufs, sizeof(uring_rx));
+    u->held = calloc(u->nbufs, sizeof(unsigned short));
+    // SQEs for a full batch of replies plus the receive, CQEs for all buffers and replies
+    if (!u->buf_mem || !u->pending || !u->held || uring_init(&u->ring, u->nbufs * 2) < 0) {
+        uring_free(u);
+        return -1;
+    }
+    if (uring_buf_ring_init(&u->ring, &u->bufs, u->nbufs, URING_BGID) < 0) {
+        uring_free(u);
+        return -1;
+    }
+    for (unsigned int i = 0; i < u->nbufs; i++) {
+        uring_buf_ring_add(&u->bufs, u->buf_mem + (size_t)i * u->buf_size, u->buf_size, (unsigned short)i);
+    }
+    uring_buf_ring_publish(&u->bufs);
+    u->recv_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    // start receiving right away, datagrams arriving before the first batch_io_recv() wait in the buffers
+    uring_arm_recv(u, b->fd);
+    if (uring_enter(&u->ring, 0, -1) < 0) {
+        uring_free(u);
+        return -1;
+    }
+    b->uring = u;
+    return 0;
+}
+
+// Back to recvmmsg/sendmmsg, the receive slots hold the payloads again
+static void uring_drop(batch_io *b) {
+    uring_free(b->uring);
+    b->uring = NULL;
+    for (unsigned int i = 0; i < b->cap; i++) {
+        b->rx_iov[i].iov_base = b->rx_buf + i * b->rx_size;
+    }
+}
+
+// Move all CQEs off the completion queue: received datagrams to the pending FIFO, sends counted
+static void uring_reap(batch_io_uring *u) {
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&u->ring))) {
+        if (cqe->user_data == URING_TAG_RECV) {
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                // ended, e.g. with ENOBUFS while all buffers were taken; armed again on the next receive
+                u->recv_armed = 0;
+            }
+            if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                uring_rx *rx = &u->pending[(u->pending_head + u->pending_count) & (u->nbufs - 1)];
+                rx->bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                rx->len = (unsigned int)cqe->res;
+                u->pending_count++;
+            } else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                u->recv_unsupported = 1;
+            }
+        } else if (cqe->user_data == URING_TAG_SEND) {
+            u->sends_inflight--;
+            if (cqe->res < 0) {
+                u->send_failed++;
+            }
+        }
+        uring_cqe_seen(&u->ring);
+    }
+}
+
+// The caller is done with the datagrams of the last batch_io_recv(), their buffers go back to the kernel
+static void uring_recycle(batch_io_uring *u) {
+    if (!u->held_count) {
+        return;
+    }
+    for (unsigned int i = 0; i < u->held_count; i++) {
+        uring_buf_ring_add(&u->bufs, u->buf_mem + (size_t)u->held[i] * u->buf_size, u->buf_size, u->held[i]);
+    }
+    uring_buf_ring_publish(&u->bufs);
+    u->held_count = 0;
+}
+
+static int recv_uring(batch_io *b, int flags) {
+    batch_io_uring *u = b->uring;
+    uring_recycle(u);
+    while (1) {
+        uring_reap(u);
+        if (u->recv_unsupported && !u->pending_count) {
+            uring_drop(b);
+            return batch_io_recv(b, flags);
+        }
+        if (u->pending_count || ((flags & MSG_DONTWAIT) && !uring_sq_pending(&u->ring) && u->recv_armed)) {
+            break;
+        }
+        if (!u->recv_armed) {
+            uring_arm_recv(u, b->fd);
+        }
+        if (uring_enter(&u->ring, (flags & MSG_DONTWAIT) ? 0 : 1, -1) < 0) {
+            return -1;
+        }
+    }
+
+    int n = 0;
+    while (u->pending_count && (unsigned int)n < b->cap) {
+        uring_rx *rx = &u->pending[u->pending_head];
+        char *buf = u->buf_mem + (size_t)rx->bid * u->buf_size;
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+        char *name = buf + sizeof(struct io_uring_recvmsg_out);
+        char *payload = name + u->recv_hdr.msg_namelen;
+
+        memset(&b->rx_addr[n], 0, sizeof(struct sockaddr_in));
+        memcpy(&b->rx_addr[n], name, out->namelen < sizeof(struct sockaddr_in) ? out->namelen : sizeof(struct sockaddr_in));
+        b->rx_iov[n].iov_base = payload;
+        b->rx_msgs[n].msg_len = rx->len - (unsigned int)(payload - buf);
+        u->held[u->held_count++] = rx->bid;
+        u->pending_head = (u->pending_head + 1) & (u->nbufs - 1);
+        u->pending_count--;
+        n++;
+    }
+    return n;
+}
+
+static int flush_uring(batch_io *b) {
+    batch_io_uring *u = b->uring;
+    u->send_failed = 0;
+    for (unsigned int i = 0; i < b->tx_count; i++) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = b->fd;
+        sqe->addr = (unsigned long)&b->tx_msgs[i].msg_hdr;
+        sqe->user_data = URING_TAG_SEND;
+        u->sends_inflight++;
+    }
+    // one system call submits the whole batch, the reply slots are reused once all sends completed
+    while (u->sends_inflight) {
+        int ret = uring_enter(&u->ring, u->sends_inflight, -1);
+        uring_reap(u);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // the ring is unusable, nothing more will complete
+            u->send_failed += u->sends_inflight;
+            u->sends_inflight = 0;
+        }
+    }
+    b->tx_count = 0;
+    return u->send_failed;
+}
+
+int batch_io_wait(batch_io *b, int timeout_ms) {
+    batch_io_uring *u = b->uring;
+    if (!u) {
+        struct pollfd pfd = { .fd = b->fd, .events = POLLIN };
+        return poll(&pfd, 1, timeout_ms);
+    }
+    uring_recycle(u);
+    uring_reap(u);
+    if (!u->pending_count) {
+        if (!u->recv_armed) {
+            uring_arm_recv(u, b->fd);
+        }
+        if (uring_enter(&u->ring, 1, timeout_ms) < 0) {
+            return errno == ETIME ? 0 : -1;
+        }
+        uring_reap(u);
+    }
+    return u->pending_count || u->recv_unsupported ? 1 : 0;
+}
+
+static int recv_single(batch_io *b, int flags) {
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    ssize_t n = recvfrom(b->fd, b->rx_buf, b->rx_size, flags & MSG_DONTWAIT, (struct sockaddr *)&b->rx_addr[0], &addr_len);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) && (flags & MSG_DONTWAIT) ? 0 : -1;
+    }
+    b->rx_msgs[0].msg_len = (unsigned int)n;
+    return 1;
+}
+
+int batch_io_recv(batch_io *b, int flags) {
+    if (b->uring) {
+        return recv_uring(b, flags);
+    }
+    if (b->no_mmsg) {
+        return recv_single(b, flags);
+    }
+    for (unsigned int i = 0; i < b->cap; i++) {
+        b->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    int n = recvmmsg(b->fd, b->rx_msgs, b->cap, flags, NULL);
+    if (n < 0) {
+        if (errno == ENOSYS) {
+            b->no_mmsg = 1;
+            return recv_single(b, flags);
+        }
+        return (errno == EAGAIN || errno == EWOULDBLOCK) && (flags & MSG_DONTWAIT) ? 0 : -1;
+    }
+    return n;
+}
+
+int batch_io_rx_len(const batch_io *b, int i) {
+    return (int)b->rx_msgs[i].msg_len;
+}
+
+void *batch_io_reply(batch_io *b, const struct sockaddr_in *to) {
+    if (b->tx_count == b->cap) {
+        batch_io_flush(b);
+    }
+    unsigned int i = b->tx_count++;
+    b->tx_addr[i] = *to;
+    memset(b->tx_iov[i].iov_base, 0, b->tx_size);
+    return b->tx_iov[i].iov_base;
+}
+
+int batch_io_flush(batch_io *b) {
+    if (b->uring) {
+        return flush_uring(b);
+    }
+    int failed = 0;
+    unsigned int sent = 0;
+    while (sent < b->tx_count) {
+        if (b->no_mmsg || b->tx_count - sent == 1) {
+            if (sendto(b->fd, b->tx_iov[sent].iov_base, b->tx_size, 0, (struct sockaddr *)&b->tx_addr[sent], sizeof(struct sockaddr_in)) < 0) {
+                failed++;
+            }
+            sent++;
+            continue;
+        }
+        int n = sendmmsg(b->fd, &b->tx_msgs[sent], b->tx_count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOSYS) {
+                b->no_mmsg = 1;
+                continue;
+            }
+            // the first reply failed, skip it and go on with the rest
+            failed++;
+            sent++;
+        } else {
+            sent += n;
+        }
+    }
+    b->tx_count = 0;
+    return failed;
+}
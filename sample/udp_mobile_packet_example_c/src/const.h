@@ -67,6 +67,21 @@
 #define CLIENT_MAX_ATTEMPTS 3
 #endif
 
+// Maximum number of packets the server receives, and responses it sends, with one syscall
+#ifndef RECV_BATCH_SIZE
+#define RECV_BATCH_SIZE 64
+#endif
+
+// Upper limit for the server's worker threads (-t)
+#ifndef MAX_WORKERS
+#define MAX_WORKERS 256
+#endif
+
+// Seconds between two reports of the workers' packet rates
+#ifndef STATS_INTERVAL
+#define STATS_INTERVAL 10
+#endif
+
 // Timeout for client to receive next ACK packet from the server
 #ifndef CLIENT_RECV_TIMEOUT
 #define CLIENT_RECV_TIMEOUT 3000
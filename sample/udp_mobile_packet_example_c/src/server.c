@@ -1,8 +1,11 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,33 +13,149 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "batch_io.h"
 #include "const.h"
 #include "log.h"
+#include "shard.h"
+#include "subscriber.h"
 
-/**
- * Linear search on subscriber number array subn_arr to find the sub_num
- * Return index if found; -1 if not found
-*/
-int find(unsigned long *subn_arr, int arr_len, unsigned long sub_num) {
-    int ret_index = -1;
-    for (int i = 0; i < arr_len; i++) {
-        if (subn_arr[i] == sub_num) {
-            ret_index = i;
-            break;
+// State of one worker: its own socket and packet buffers, nothing shared but the database
+typedef struct worker {
+    int index;
+    int cpu;                  // CPU the worker runs on, -1 if not pinned
+    int server_fd;            // fd for socket
+    batch_io *io;             // receives up to RECV_BATCH_SIZE packets and sends their responses with one syscall each
+    const subscriber_table *db; // the verification database, read once at startup and shared read-only
+    pthread_t thread;
+    shard_stats stats;
+} worker;
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void log_lock(bool lock, void *udata) {
+    if (lock) {
+        pthread_mutex_lock(&log_mutex);
+    } else {
+        pthread_mutex_unlock(&log_mutex);
+    }
+}
+
+static void *serve(void *arg) {
+    worker *w = (worker *)arg;
+    const subscriber_table *db = w->db;
+    struct sockaddr_in client_addr;  // sock address of the client of the packet at hand
+    int recv_bytes;                  // variable to hold length of received message packet
+    message_packet *client_pkt;      // data packet sent to server, in a receive slot of io
+    message_packet *server_pkt;      // return packet from server, in a reply slot of io
+    int recv_count;                  // number of packets received in one go
+    int send_failed;                 // responses of a batch which could not be sent
+    const subscriber *sub;           // Record of a Subscriber Number on the Verified Database
+
+    if (w->cpu >= 0 && shard_pin_cpu(w->cpu) < 0) {
+        log_warn("Worker %d: could not be pinned to CPU %d.", w->index, w->cpu);
+    }
+
+    // ======================== SERVER LOOP ========================
+    while (TRUE) {
+        // We wait on the socket for at least one data packet from the Clients, and take
+        // the ones already queued behind it (up to RECV_BATCH_SIZE) with the same call
+        recv_count = batch_io_recv(w->io, MSG_WAITFORONE);
+        if (recv_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Error receiving packets.");
+            exit(EXIT_FAILURE);
+        }
+        shard_stats_add(&w->stats.rx_packets, recv_count);
+        shard_stats_add(&w->stats.batches, 1);
+
+        // Start loading the database records of the whole batch, so that their cache misses overlap
+        for (int i = 0; i < recv_count; i++) {
+            subscriber_prefetch(db, ((message_packet *)batch_io_rx_data(w->io, i))->sub_num);
+        }
+
+        for (int i = 0; i < recv_count; i++) {
+            client_pkt = batch_io_rx_data(w->io, i);
+            recv_bytes = batch_io_rx_len(w->io, i);
+            client_addr = *batch_io_rx_addr(w->io, i);
+            char *client_ip = inet_ntoa(client_addr.sin_addr);
+            // Sanity check: packet has content
+            if (recv_bytes == 0) {
+                log_warn("Received zero bytes at recvfrom(), client ip = %s", client_ip);  // datagram sockets might permit zero length packets
+            } else {
+                log_info("Message received from client ip = %s", client_ip);
+            }
+
+            // Data packes sent back to the user have several commonalities, regardless of response type.
+            server_pkt = batch_io_reply(w->io, &client_addr);
+            server_pkt->start_id = START_ID;
+            server_pkt->end_id = END_ID;
+            server_pkt->client_id = client_pkt->client_id;
+            server_pkt->seg_num = client_pkt->seg_num;
+            server_pkt->technology = client_pkt->technology;  // This will get changed later if there's a Tech Mis-Match.
+            server_pkt->sub_num = client_pkt->sub_num;
+            server_pkt->length = sizeof(client_pkt->technology) + sizeof(client_pkt->sub_num);
+
+            // First, search the database for the client's subscriber number, and verify it.
+            sub = subscriber_find(db, client_pkt->sub_num);
+            // Now, run through verification checks
+            if (!sub) {  // The subscriber number couldn't be found on the database.
+                log_warn("Access Denied: Subscriber %lu Does Not Exist in the Verification Database.", client_pkt->sub_num);
+                server_pkt->type = NOT_EXIST;
+            } else if (client_pkt->technology != sub->technology) {  // The subscriber number asked for the wrong Technology
+                log_warn("Access Denied: Subscriber %lu Requested Access to Incorrect Technology. Requested %dG, but is authorized for %dG.", client_pkt->sub_num, (int)client_pkt->technology, (int)sub->technology);
+                server_pkt->type = NOT_EXIST;
+                server_pkt->technology = (char)INVALID_TECHNOLOGY;
+            } else if (sub->paid == 0) {  // The subscriber number has not paid.
+                log_warn("Access Denied: Subscriber %lu have not paid.", client_pkt->sub_num);
+                server_pkt->type = NOT_PAID;
+            } else {  // No issues found in database or client-packet. Give Access Permission to Client.
+                log_info("Access Granted: Subscriber %lu request has been verified against the Database.", client_pkt->sub_num);
+                server_pkt->type = ACC_OK;
+            }
         }
+
+        // Send the information packets of the whole batch back to the clients
+        unsigned int replies = w->io->tx_count;
+        if ((send_failed = batch_io_flush(w->io)) > 0) {
+            log_error("Server Error: Failed to Send %d Packets to Clients.", send_failed);
+            // doesn't return -1 on this failure: Server continues to operate in case issue was on Client's end
+            shard_stats_add(&w->stats.send_failed, send_failed);
+        }
+        shard_stats_add(&w->stats.tx_packets, replies - send_failed);
     }
-    return ret_index;
+    return NULL;
 }
 
 int main(int argc, char **argv) {
     // ======================== CLI ARGS PARSING ========================
     int port = DEFAULT_SERVER_PORT;
+    int num_workers = 1;   // worker threads, each with its own SO_REUSEPORT socket
+    int use_cbpf = FALSE;  // steer each client to a fixed worker with a BPF program
+    int use_uring = FALSE; // receive and send through io_uring instead of recvmmsg/sendmmsg
+    int cpus[MAX_WORKERS]; // CPUs the workers are pinned to
+    int num_cpus;
+    int opt;
+    // Parse options: -t <threads> (0 = one per CPU), -b (BPF steering), -u (io_uring), then the port
+    while ((opt = getopt(argc, argv, "t:bu")) != -1) {
+        if (opt == 't') {
+            num_workers = atoi(optarg);
+        } else if (opt == 'b') {
+            use_cbpf = TRUE;
+        } else if (opt == 'u') {
+            use_uring = TRUE;
+        } else {
+            log_fatal("Usage: %s [-t threads] [-b] [-u] [port]", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
     // Set port from command line argument
-    if (argc < 2) {
+    if (optind >= argc) {
         log_info("Using default port %d <port>", DEFAULT_SERVER_PORT);
     } else {
-        log_info("Using port %s", argv[1]);
-        port = atoi(argv[1]);
+        log_info("Using port %s", argv[optind]);
+        port = atoi(argv[optind]);
     }
 
     // ======================== DB FILE PARSING ========================
@@ -53,18 +172,22 @@ int main(int argc, char **argv) {
     db_len = atoi(buffer);
     pclose(db_wc);
 
-    // parse the following field arrays from database file
-    unsigned long sub_nums[db_len];  // all subscriber numbers in the database
-    char sub_techs[db_len];          // technology which each subscribers is using
-    char sub_paid_arr[db_len];       // subscribers payment status (1 = paid, 0 = not paid).
+    // parse the database file into a table indexed by subscriber number
+    subscriber_table *db = subscriber_table_create(db_len);
+    if (!db) {
+        log_error("DB Error: Could not allocate the table for %d entries. Quit.", db_len);
+        return -1;
+    }
 
     // The following are just variables for getting the data out.
     size_t len = 0;
     ssize_t read;
     char *line = NULL;
     char *token = NULL;
-    int idx = 0;
     char *end_ptr;
+    unsigned long sub_num;
+    char sub_tech;
+    char sub_paid;
 
     FILE *input_dbfile = fopen(DB_FILE_NAME, "r");
     if (!input_dbfile) {
@@ -81,94 +204,94 @@ int main(int argc, char **argv) {
             }
         }
         buffer[j] = '\0';
-        sub_nums[idx] = strtoul(buffer, &end_ptr, 10);      // Parse substriber number and save to an unsigned long (4bytes)
-        sub_techs[idx] = (char)atoi(strtok(NULL, " "));     // Parse technology field
-        sub_paid_arr[idx] = (char)atoi(strtok(NULL, " "));  // Parse paid field
-        idx++;
+        sub_num = strtoul(buffer, &end_ptr, 10);      // Parse substriber number and save to an unsigned long
+        sub_tech = (char)atoi(strtok(NULL, " "));     // Parse technology field
+        sub_paid = (char)atoi(strtok(NULL, " "));     // Parse paid field
+        if (subscriber_add(db, sub_num, sub_tech, sub_paid) < 0) {
+            log_error("DB Error: Out of memory after %lu entries. Quit.", (unsigned long)db->count);
+            return -1;
+        }
     }
     fclose(input_dbfile);  // done with the data-base file. We can close it now.
+    free(line);
+    log_info("Loaded %lu subscribers from %s", (unsigned long)db->count, DB_FILE_NAME);
 
-    // ======================== INIT VARIABLES AND SOCKETS ========================
-    // Initializing values for completing socket programming communications
-    // Most of the following is just lifted from Assignment 1.
-    struct sockaddr_in server_addr, client_addr;      // sock addresses for client and server.
-    int server_fd;                                    // fd for socket
-    socklen_t addr_len = sizeof(struct sockaddr_in);  // length of a sockaddr_in
-    int recv_bytes;                                   // variable to hold length of received message packet
-    message_packet client_pkt;                        // struct to hold data packet being sent to server
-    message_packet server_pkt;                        // struct for return packet from server
-    int index = -1;                                   // Index of a Subscriber Number on the Verified Database
-
-    // Creating a UDP Socket for the Client
-    if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        log_fatal("Socket creation failed.");
-        exit(EXIT_FAILURE);
+    // ======================== INIT WORKERS AND SOCKETS ========================
+    worker *workers;
+    num_cpus = shard_cpus(cpus, MAX_WORKERS);
+    if (num_workers <= 0) {
+        num_workers = num_cpus > 0 ? num_cpus : 1;
+    }
+    if (num_workers > MAX_WORKERS) {
+        num_workers = MAX_WORKERS;
+    }
+    if (num_workers > 1) {
+        log_set_lock(log_lock, NULL);
     }
 
-    // Setup the Server Sock Addr
-    // Bind it to the Socket and the Selected Port for this communication
-    memset((char *)&server_addr, 0, addr_len);
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(port);
-    if (bind(server_fd, (struct sockaddr *)&server_addr, addr_len) < 0) {
-        log_fatal("Binding Failed.");
+    if (!(workers = shard_calloc(num_workers, sizeof(worker)))) {
+        log_fatal("Worker allocation failed.");
         exit(EXIT_FAILURE);
     }
+    for (int i = 0; i < num_workers; i++) {
+        worker *w = &workers[i];
+        w->index = i;
+        w->cpu = num_workers > 1 && num_cpus > 0 ? cpus[i % num_cpus] : -1;
+        w->db = db;
 
-    // Use poll() to detect timeout, easier to use than using C timers
-    struct pollfd server_timer_pollfd;
-    server_timer_pollfd.fd = server_fd;
-    server_timer_pollfd.events = POLLIN;  // notes anything coming in on the socket.
-
-    // ======================== SERVER LOOP ========================
-    while (TRUE) {
-        // We wait on the socket to get a data packet from the Client
-        recv_bytes = recvfrom(server_fd, &client_pkt, sizeof(message_packet), 0, (struct sockaddr *)&client_addr, &addr_len);
-        char *client_ip = inet_ntoa(client_addr.sin_addr);
-        // Sanity check: packet has content
-        if (recv_bytes < 0) {
-            log_error("Error at recvfrom(), client ip = %s", client_ip);
-            return -1;
-        } else if (recv_bytes == 0) {
-            log_warn("Received zero bytes at recvfrom(), client ip = %s", client_ip);  // datagram sockets might permit zero length packets
-        } else {
-            log_info("Message received from client ip = %s", client_ip);
+        // Create the UDP socket and bind it to the selected port. With several workers every
+        // worker binds its own, the kernel spreads the packets over them.
+        if ((w->server_fd = shard_socket(port, num_workers > 1)) < 0) {
+            log_fatal("Socket creation or binding failed.");
+            exit(EXIT_FAILURE);
+        }
+        if (!(w->io = batch_io_create(w->server_fd, RECV_BATCH_SIZE, sizeof(message_packet), sizeof(message_packet)))) {
+            log_fatal("Packet buffer allocation failed.");
+            exit(EXIT_FAILURE);
         }
+        if (use_uring && batch_io_use_uring(w->io) < 0) {
+            log_warn("io_uring not available (%s), using recvmmsg/sendmmsg.", strerror(errno));
+            use_uring = FALSE;
+        }
+    }
 
-        // Data packes sent back to the user have several commonalities, regardless of response type.
-        server_pkt.start_id = START_ID;
-        server_pkt.end_id = END_ID;
-        server_pkt.client_id = client_pkt.client_id;
-        server_pkt.seg_num = client_pkt.seg_num;
-        server_pkt.technology = client_pkt.technology;  // This will get changed later if there's a Tech Mis-Match.
-        server_pkt.sub_num = client_pkt.sub_num;
-        server_pkt.length = sizeof(client_pkt.technology) + sizeof(client_pkt.sub_num);
-
-        // First, search the database for the client's subscriber number, and verify it.
-        index = find(sub_nums, db_len, client_pkt.sub_num);
-        // Now, run through verification checks
-        if (index < 0) {  // The subscriber number couldn't be found on the database.
-            log_warn("Access Denied: Subscriber %lu Does Not Exist in the Verification Database.", client_pkt.sub_num);
-            server_pkt.type = NOT_EXIST;
-        } else if (client_pkt.technology != sub_techs[index]) {  // The subscriber number asked for the wrong Technology
-            log_warn("Access Denied: Subscriber %lu Requested Access to Incorrect Technology. Requested %dG, but is authorized for %dG.", client_pkt.sub_num, (int)client_pkt.technology, (int)sub_techs[index]);
-            server_pkt.type = NOT_EXIST;
-            server_pkt.technology = (char)INVALID_TECHNOLOGY;
-        } else if (sub_paid_arr[index] == 0) {  // The subscriber number has not paid.
-            log_warn("Access Denied: Subscriber %lu have not paid.", client_pkt.sub_num);
-            server_pkt.type = NOT_PAID;
-        } else {  // No issues found in database or client-packet. Give Access Permission to Client.
-            log_info("Access Granted: Subscriber %lu request has been verified against the Database.", client_pkt.sub_num);
-            server_pkt.type = ACC_OK;
+    // The kernel's own hash already keeps a client on one worker; the BPF program makes the
+    // choice depend on the client's address and port alone
+    if (use_cbpf && num_workers > 1) {
+        if (shard_attach_cbpf(workers[0].server_fd, num_workers) < 0) {
+            log_fatal("Attaching the BPF program failed.");
+            exit(EXIT_FAILURE);
         }
+        log_info("Clients are steered to workers by source address and port.");
+    }
 
-        // Send information packet back to client
-        if (sendto(server_fd, &server_pkt, sizeof(message_packet), 0, (struct sockaddr *)&client_addr, addr_len) < 0) {
-            log_error("Server Error: Failed to Send Packet to Client ip = %s.", client_ip);
-            // doesn't return -1 on this failure: Server continues to operate in case issue was on Client's end
+    log_info("Serving with %d worker(s), %s", num_workers, use_uring ? "io_uring" : "recvmmsg/sendmmsg");
+
+    if (num_workers == 1) {
+        serve(&workers[0]);
+        return 0;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, serve, &workers[i]) != 0) {
+            log_fatal("Could not start worker %d.", i);
+            exit(EXIT_FAILURE);
         }
     }
-    close(server_fd);
+
+    // The workers never return, the main thread reports their traffic
+    shard_stats *stats[MAX_WORKERS];
+    shard_stats *last = shard_calloc(num_workers, sizeof(shard_stats));
+    if (!last) {
+        log_fatal("Stats allocation failed.");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        stats[i] = &workers[i].stats;
+    }
+    while (TRUE) {
+        sleep(STATS_INTERVAL);
+        shard_log_stats(stats, last, num_workers, STATS_INTERVAL);
+    }
     return 0;
 }
@@ -0,0 +1,90 @@
+#include "subscriber.h"
+
+#include <stdlib.h>
+
+// Slots for at least `count` subscribers with the table at most 3/4 full
+static uint64_t table_capacity(uint64_t count) {
+    uint64_t cap = 16;
+    while (cap / 4 * 3 < count) {
+        cap <<= 1;
+    }
+    return cap;
+}
+
+static void insert_slot(subscriber *slots, uint64_t mask, const subscriber *s) {
+    uint64_t i = subscriber_hash(s->sub_num) & mask;
+    while (slots[i].used) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = *s;
+}
+
+static int subscriber_table_grow(subscriber_table *t) {
+    uint64_t old_cap = t->mask + 1;
+    // calloc leaves large tables to mmap, whose pages are zero without touching them here
+    subscriber *slots = calloc(old_cap * 2, sizeof(subscriber));
+    if (!slots) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < old_cap; i++) {
+        if (t->slots[i].used) {
+            insert_slot(slots, old_cap * 2 - 1, &t->slots[i]);
+        }
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->mask = old_cap * 2 - 1;
+    return 0;
+}
+
+subscriber_table *subscriber_table_create(uint64_t capacity) {
+    subscriber_table *t = calloc(1, sizeof(subscriber_table));
+    if (!t) {
+        return NULL;
+    }
+    uint64_t cap = table_capacity(capacity);
+    t->slots = calloc(cap, sizeof(subscriber));
+    if (!t->slots) {
+        free(t);
+        return NULL;
+    }
+    t->mask = cap - 1;
+    return t;
+}
+
+void subscriber_table_destroy(subscriber_table *t) {
+    if (t) {
+        free(t->slots);
+        free(t);
+    }
+}
+
+int subscriber_add(subscriber_table *t, uint64_t sub_num, char technology, char paid) {
+    if (subscriber_find(t, sub_num)) {
+        return 0;
+    }
+    if (t->count + 1 > (t->mask + 1) / 4 * 3 && subscriber_table_grow(t) < 0) {
+        return -1;
+    }
+    subscriber s = {
+        .sub_num = sub_num,
+        .technology = technology,
+        .paid = paid,
+        .used = 1,
+    };
+    insert_slot(t->slots, t->mask, &s);
+    t->count++;
+    return 1;
+}
+
+const subscriber *subscriber_find(const subscriber_table *t, uint64_t sub_num) {
+    uint64_t i = subscriber_hash(sub_num) & t->mask;
+    const subscriber *s;
+    while ((s = &t->slots[i])->used) {
+        if (s->sub_num == sub_num) {
+            return s;
+        }
+        i = (i + 1) & t->mask;
+    }
+    return NULL;
+}
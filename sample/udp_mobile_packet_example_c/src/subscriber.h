@@ -0,0 +1,59 @@
+#ifndef SUBSCRIBER_H
+#define SUBSCRIBER_H
+
+#include <stdint.h>
+
+// The verification database, indexed by subscriber number.
+//
+// Records are packed into 16 bytes, four to a cache line, and live inline in an open-addressing
+// table (linear probing, at most 3/4 full). A lookup hashes the number and reads the record in
+// its home slot, plus the few following ones on a collision, so it costs about one cache miss
+// whatever the size of the database. The table is filled once at startup and only read after
+// that, so any number of threads may look up concurrently.
+
+typedef struct subscriber {
+    uint64_t sub_num;
+    char technology;        // technology the subscriber is using
+    char paid;              // payment status (1 = paid, 0 = not paid)
+    uint8_t used;           // slot holds a subscriber
+    uint8_t reserved[5];
+} subscriber;
+
+_Static_assert(sizeof(subscriber) == 16, "subscriber records are packed into 16 bytes");
+
+typedef struct subscriber_table {
+    subscriber *slots;
+    uint64_t mask;          // capacity - 1, capacity is a power of two
+    uint64_t count;
+} subscriber_table;
+
+static inline uint64_t subscriber_hash(uint64_t sub_num) {
+    // 64-bit finalizer of MurmurHash3, phone numbers are far from uniform in their low bits
+    sub_num ^= sub_num >> 33;
+    sub_num *= 0xff51afd7ed558ccdULL;
+    sub_num ^= sub_num >> 33;
+    sub_num *= 0xc4ceb9fe1a85ec53ULL;
+    sub_num ^= sub_num >> 33;
+    return sub_num;
+}
+
+// Create a table sized for about `capacity` subscribers (it grows when needed).
+// Returns NULL if out of memory.
+subscriber_table *subscriber_table_create(uint64_t capacity);
+
+void subscriber_table_destroy(subscriber_table *t);
+
+// Add a subscriber. A number already in the table keeps its first record, like the linear
+// search of the database file did. Returns 1 if added, 0 if a duplicate, -1 if out of memory.
+int subscriber_add(subscriber_table *t, uint64_t sub_num, char technology, char paid);
+
+// Record of `sub_num`, NULL if there is none
+const subscriber *subscriber_find(const subscriber_table *t, uint64_t sub_num);
+
+// Start loading the home slot of `sub_num` into the cache, for a subscriber_find() shortly after.
+// Issued for a whole batch of requests first, the cache misses of the lookups overlap.
+static inline void subscriber_prefetch(const subscriber_table *t, uint64_t sub_num) {
+    __builtin_prefetch(&t->slots[subscriber_hash(sub_num) & t->mask]);
+}
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef __CPPSERVER_FD_MANAGER_H__
+#define __CPPSERVER_FD_MANAGER_H__
+
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+#include "mutex.h"
+#include "singleton.h"
+
+namespace cppserver {
+
+/**
+ * @brief What the hooks know about one fd
+ * @details Sockets are switched to O_NONBLOCK at the OS level as soon as they are
+ *          known, so the hooked calls can park the fiber on EAGAIN. Whether the user
+ *          asked for non-blocking mode is tracked separately: those sockets keep the
+ *          plain non-blocking behaviour.
+ */
+class FdCtx : public std::enable_shared_from_this<FdCtx> {
+public:
+    typedef std::shared_ptr<FdCtx> ptr;
+
+    FdCtx(int fd);
+    ~FdCtx();
+
+    bool isInit() const { return m_isInit;}
+    bool isSocket() const { return m_isSocket;}
+    bool isClose() const { return m_isClosed;}
+
+    /**
+     * @brief Non-blocking mode as set by the user with fcntl/ioctl
+     */
+    void setUserNonblock(bool v) { m_userNonblock = v;}
+    bool getUserNonblock() const { return m_userNonblock;}
+
+    /**
+     * @brief Non-blocking mode at the OS level
+     */
+    void setSysNonblock(bool v) { m_sysNonblock = v;}
+    bool getSysNonblock() const { return m_sysNonblock;}
+
+    /**
+     * @brief Set a timeout
+     * @param[in] type SO_RCVTIMEO or SO_SNDTIMEO
+     * @param[in] v milliseconds, ~0ull for none
+     */
+    void setTimeout(int type, uint64_t v);
+
+    /**
+     * @brief Timeout for SO_RCVTIMEO or SO_SNDTIMEO, ~0ull for none
+     */
+    uint64_t getTimeout(int type);
+private:
+    bool init();
+private:
+    bool m_isInit: 1;
+    bool m_isSocket: 1;
+    bool m_sysNonblock: 1;
+    bool m_userNonblock: 1;
+    bool m_isClosed: 1;
+    int m_fd;
+    uint64_t m_recvTimeout;
+    uint64_t m_sendTimeout;
+};
+
+/**
+ * @brief Table of FdCtx, indexed by fd
+ */
+class FdManager {
+public:
+    typedef RWMutex RWMutexType;
+
+    FdManager();
+
+    /**
+     * @brief Context of fd
+     * @param[in] auto_create create it if missing
+     * @return nullptr if missing and not created
+     */
+    FdCtx::ptr get(int fd, bool auto_create = false);
+
+    /**
+     * @brief Forget fd, called on close
+     */
+    void del(int fd);
+private:
+    RWMutexType m_mutex;
+    std::vector<FdCtx::ptr> m_datas;
+};
+
+typedef Singleton<FdManager> FdMgr;
+
+}
+
+#endif
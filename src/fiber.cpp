@@ -0,0 +1,304 @@
+#include "fiber.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+#include <vector>
+
+#include "fiber_stack.h"
+#include "log.h"
+#include "scheduler.h"
+#include "util.h"
+
+namespace cppserver {
+
+static Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+static std::atomic<uint64_t> s_fiber_id {0};
+static std::atomic<uint64_t> s_fiber_count {0};
+
+/// fiber running on this thread
+static thread_local Fiber* t_fiber = nullptr;
+/// main fiber of this thread, i.e. the thread's own stack
+static thread_local Fiber::ptr t_threadFiber = nullptr;
+
+/// default stack size of a fiber
+static const uint32_t g_fiber_stack_size = 128 * 1024;
+/// size and number of the shared stacks of each thread; more than one stack means fewer
+/// copies when a few shared-stack fibers take turns
+static const uint32_t g_shared_stack_size = 1024 * 1024;
+static const size_t g_shared_stack_count = 4;
+
+struct Fiber::SharedStack {
+    SharedStack(size_t size)
+        :size(size) {
+        stack = FiberStackPool::Alloc(size);
+        if(!stack) {
+            throw std::bad_alloc();
+        }
+    }
+    ~SharedStack() {
+        FiberStackPool::Dealloc(stack, size);
+    }
+
+    void* stack = nullptr;
+    size_t size = 0;
+    /// fiber whose frames are on the stack right now
+    Fiber* owner = nullptr;
+};
+
+/// shared stacks of this thread, handed out round robin
+static thread_local std::vector<std::shared_ptr<Fiber::SharedStack>> t_sharedStacks;
+static thread_local size_t t_sharedNext = 0;
+
+Fiber::Fiber() {
+    m_state = EXEC;
+    SetThis(this);
+    // the context is filled in by the first switch away from this thread's stack
+    ++s_fiber_count;
+}
+
+Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller, bool shared_stack)
+    :m_id(++s_fiber_id)
+    ,m_cb(cb)
+    ,m_use_caller(use_caller) {
+    ++s_fiber_count;
+#if CPPSERVER_FIBER_ASM
+    // copying needs the saved stack pointer, the ucontext backend always uses private stacks
+    if(shared_stack) {
+        if(t_sharedStacks.empty()) {
+            for(size_t i = 0; i < g_shared_stack_count; ++i) {
+                t_sharedStacks.emplace_back(new SharedStack(g_shared_stack_size));
+            }
+        }
+        m_shared = t_sharedStacks[t_sharedNext++ % t_sharedStacks.size()];
+        m_homeThread = GetThreadId();
+        m_stacksize = m_shared->size;
+        // the context is made on first run, the stack may be occupied right now
+        return;
+    }
+#endif
+    m_stacksize = stacksize ? stacksize : g_fiber_stack_size;
+
+    m_stack = FiberStackPool::Alloc(m_stacksize);
+    if(!m_stack) {
+        --s_fiber_count;
+        throw std::bad_alloc();
+    }
+    MakeFiberContext(&m_ctx, m_stack, m_stacksize, use_caller ? &Fiber::CallerMainEntry : &Fiber::MainEntry, nullptr);
+}
+
+Fiber::~Fiber() {
+    --s_fiber_count;
+    if(m_shared) {
+        assert(m_state == TERM || m_state == EXCEPT || m_state == INIT);
+        if(m_shared->owner == this) {
+            m_shared->owner = nullptr;
+        }
+        free(m_saved);
+    } else if(m_stack) {
+        assert(m_state == TERM || m_state == EXCEPT || m_state == INIT);
+        FiberStackPool::Dealloc(m_stack, m_stacksize);
+    } else {
+        // main fiber of a thread
+        assert(!m_cb);
+        assert(m_state == EXEC);
+        if(t_fiber == this) {
+            SetThis(nullptr);
+        }
+    }
+}
+
+void Fiber::reset(std::function<void()> cb) {
+    assert(m_stack || m_shared);
+    assert(m_state == TERM || m_state == EXCEPT || m_state == INIT);
+    m_cb = cb;
+    if(m_shared) {
+        m_savedSize = 0;
+        m_use_caller = false;
+    } else {
+        MakeFiberContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainEntry, nullptr);
+    }
+    m_state = INIT;
+}
+
+void Fiber::prepareSharedStack() {
+    // the image saved off the home thread's shared stack fits no other thread's
+    assert(m_homeThread == GetThreadId());
+    SharedStack* ss = m_shared.get();
+    if(ss->owner != this) {
+        // runs on the caller's stack, never on the shared one, so both copies are safe
+        if(ss->owner) {
+            ss->owner->saveSharedStack();
+        }
+        ss->owner = this;
+        if(m_savedSize) {
+            memcpy((char*)ss->stack + ss->size - m_savedSize, m_saved, m_savedSize);
+        }
+    }
+    if(m_state == INIT) {
+        MakeFiberContext(&m_ctx, ss->stack, ss->size
+                , m_use_caller ? &Fiber::CallerMainEntry : &Fiber::MainEntry, nullptr);
+    }
+}
+
+void Fiber::saveSharedStack() {
+#if CPPSERVER_FIBER_ASM
+    if(m_state == TERM || m_state == EXCEPT) {
+        m_savedSize = 0; // nothing on the stack is needed any more
+        return;
+    }
+    char* top = (char*)m_shared->stack + m_shared->size;
+    size_t used = top - (char*)m_ctx.sp;
+    if(used > m_savedCap) {
+        char* buf = (char*)realloc(m_saved, used);
+        if(!buf) {
+            throw std::bad_alloc();
+        }
+        m_saved = buf;
+        m_savedCap = used;
+    }
+    memcpy(m_saved, m_ctx.sp, used);
+    m_savedSize = used;
+#endif
+}
+
+void Fiber::call() {
+    if(m_shared) {
+        prepareSharedStack();
+    }
+    SetThis(this);
+    m_state = EXEC;
+    SwapFiberContext(&t_threadFiber->m_ctx, &m_ctx);
+}
+
+void Fiber::back() {
+    SetThis(t_threadFiber.get());
+    SwapFiberContext(&m_ctx, &t_threadFiber->m_ctx);
+}
+
+/**
+ * @brief Fiber that swapIn/swapOut switch against: the thread's scheduling loop,
+ *        or the thread's own stack outside of a scheduler
+ */
+static Fiber* GetSwapTarget() {
+    Fiber* main = Scheduler::GetMainFiber();
+    return main ? main : t_threadFiber.get();
+}
+
+void Fiber::swapIn() {
+    if(m_shared) {
+        prepareSharedStack();
+    }
+    Fiber* main = GetSwapTarget();
+    SetThis(this);
+    assert(m_state != EXEC);
+    m_state = EXEC;
+    SwapFiberContext(&main->m_ctx, &m_ctx);
+}
+
+void Fiber::swapOut() {
+    Fiber* main = GetSwapTarget();
+    SetThis(main);
+    SwapFiberContext(&m_ctx, &main->m_ctx);
+}
+
+void Fiber::SetThis(Fiber* f) {
+    t_fiber = f;
+    SetFiberId(f ? f->getId() : 0);
+}
+
+Fiber::ptr Fiber::GetThis() {
+    if(t_fiber) {
+        return t_fiber->shared_from_this();
+    }
+    Fiber::ptr main_fiber(new Fiber);
+    assert(t_fiber == main_fiber.get());
+    t_threadFiber = main_fiber;
+    return t_fiber->shared_from_this();
+}
+
+void Fiber::YieldToReady() {
+    Fiber::ptr cur = GetThis();
+    assert(cur->m_state == EXEC);
+    cur->m_state = READY;
+    cur->swapOut();
+}
+
+void Fiber::YieldToHold() {
+    Fiber::ptr cur = GetThis();
+    assert(cur->m_state == EXEC);
+    cur->m_state = HOLD;
+    cur->swapOut();
+}
+
+uint64_t Fiber::TotalFibers() {
+    return s_fiber_count;
+}
+
+uint64_t Fiber::GetFiberId() {
+    if(t_fiber) {
+        return t_fiber->getId();
+    }
+    return 0;
+}
+
+void Fiber::MainFunc() {
+    Fiber::ptr cur = GetThis();
+    assert(cur);
+    try {
+        cur->m_cb();
+        cur->m_cb = nullptr;
+        cur->m_state = TERM;
+    } catch (std::exception& ex) {
+        cur->m_state = EXCEPT;
+        CPPSERVER_LOG_ERROR(g_logger) << "Fiber Except: " << ex.what()
+            << " fiber_id=" << cur->getId();
+    } catch (...) {
+        cur->m_state = EXCEPT;
+        CPPSERVER_LOG_ERROR(g_logger) << "Fiber Except"
+            << " fiber_id=" << cur->getId();
+    }
+
+    // drop our reference before leaving for good, this stack is never unwound
+    auto raw_ptr = cur.get();
+    cur.reset();
+    raw_ptr->swapOut();
+
+    assert(false && "never reach fiber_id");
+}
+
+void Fiber::CallerMainFunc() {
+    Fiber::ptr cur = GetThis();
+    assert(cur);
+    try {
+        cur->m_cb();
+        cur->m_cb = nullptr;
+        cur->m_state = TERM;
+    } catch (std::exception& ex) {
+        cur->m_state = EXCEPT;
+        CPPSERVER_LOG_ERROR(g_logger) << "Fiber Except: " << ex.what()
+            << " fiber_id=" << cur->getId();
+    } catch (...) {
+        cur->m_state = EXCEPT;
+        CPPSERVER_LOG_ERROR(g_logger) << "Fiber Except"
+            << " fiber_id=" << cur->getId();
+    }
+
+    auto raw_ptr = cur.get();
+    cur.reset();
+    raw_ptr->back();
+
+    assert(false && "never reach fiber_id");
+}
+
+void Fiber::MainEntry(void*) {
+    MainFunc();
+}
+
+void Fiber::CallerMainEntry(void*) {
+    CallerMainFunc();
+}
+
+}
@@ -2,8 +2,11 @@
 #define __SYLAR_FIBER_H__
 
 #include <memory>
+#include <atomic>
 #include <functional>
-#include <ucontext.h>
+#include <stdint.h>
+
+#include "fiber_context.h"
 
 namespace cppserver {
 
@@ -36,10 +39,14 @@ public:
     /**
      * @brief Ctor
      * @param[in] cb Callback function to be execed by fiber
-     * @param[in] stacksize Stack size of fiber
+     * @param[in] stacksize Stack size of fiber, ignored with shared_stack
      * @param[in] use_caller Whether called on mainfiber
+     * @param[in] shared_stack Run on one of the creating thread's shared stacks and keep only
+     *            the used part of the stack, copied out while another fiber runs there
+     * @attention A shared-stack fiber must always be resumed on the thread that created it,
+     *            and the addresses of its locals are only valid while it runs
      */
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);
+    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false, bool shared_stack = false);
     ~Fiber();
 
     /**
@@ -77,6 +84,11 @@ public:
 
     uint64_t getId() const { return m_id;}
     State getState() const { return m_state;}
+    bool isSharedStack() const { return !!m_shared;}
+    /**
+     * @brief Thread a shared-stack fiber is bound to, -1 for a private stack
+     */
+    int getHomeThread() const { return m_homeThread;}
 
 public:
 
@@ -120,10 +132,29 @@ public:
      */
     static void CallerMainFunc();
 
+    /**
+     * @brief Entry points handed to MakeFiberContext, arg is unused
+     */
+    static void MainEntry(void* arg);
+    static void CallerMainEntry(void* arg);
+
     /**
      * @brief return current fiber id
      */
     static uint64_t GetFiberId();
+public:
+    /// stack shared by several fibers of a thread, defined in fiber.cpp
+    struct SharedStack;
+private:
+    /**
+     * @brief Put this fiber's stack in place on its shared stack before switching to it
+     */
+    void prepareSharedStack();
+
+    /**
+     * @brief Copy the used part of the shared stack out, the fiber is switched out
+     */
+    void saveSharedStack();
 private:
     /// fiber id
     uint64_t m_id = 0;
@@ -131,12 +162,24 @@ private:
     uint32_t m_stacksize = 0;
     /// fiber state enum
     State m_state = INIT;
-    /// fiber exec context
-    ucontext_t m_ctx;
+    /// fiber exec context, see fiber_context.h for the backends
+    FiberContext m_ctx;
     /// fiber stack pointer
     void* m_stack = nullptr;
     /// function to be executed by fiber
     std::function<void()> m_cb;
+    /// shared stack this fiber runs on, null for a private stack
+    std::shared_ptr<SharedStack> m_shared;
+    /// used part of the shared stack while another fiber occupies it
+    char* m_saved = nullptr;
+    size_t m_savedSize = 0;
+    size_t m_savedCap = 0;
+    /// entry of the context, made on the shared stack when the fiber first runs
+    bool m_use_caller = false;
+    /// thread owning the shared stack
+    int m_homeThread = -1;
+    /// claimed by the scheduler thread running it, until that thread has switched out of it
+    std::atomic<bool> m_running {false};
 };
 
 }
@@ -0,0 +1,194 @@
+#include "fiber_context.h"
+#include <stdint.h>
+#include <string.h>
+
+#if CPPSERVER_FIBER_ASM
+
+/**
+ * cppserver_swap_context(void** from_sp, void* to_sp)
+ * Push the callee-saved registers, store the stack pointer into *from_sp, switch to to_sp
+ * and pop the registers saved there. Everything else is caller-saved by the ABI, so the
+ * compiler has already spilled it around the call.
+ *
+ * cppserver_context_entry
+ * First "return address" of a new context: calls fn(arg) from the registers
+ * MakeFiberContext put in the initial frame.
+ */
+extern "C" void cppserver_swap_context(void** from_sp, void* to_sp);
+extern "C" void cppserver_context_entry();
+
+#if defined(__x86_64__)
+
+// frame, from the saved sp upwards:
+//   0: mxcsr (4) + x87 control word (2) + pad, 8: r15, 16: r14, 24: r13, 32: r12, 40: rbx, 48: rbp, 56: return address
+asm(R"(
+    .text
+    .globl cppserver_swap_context
+    .type cppserver_swap_context, @function
+    .p2align 4
+cppserver_swap_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size cppserver_swap_context, .-cppserver_swap_context
+
+    .globl cppserver_context_entry
+    .type cppserver_context_entry, @function
+    .p2align 4
+cppserver_context_entry:
+    movq %r12, %rdi
+    callq *%r13
+    ud2
+    .size cppserver_context_entry, .-cppserver_context_entry
+)");
+
+namespace cppserver {
+
+static const size_t FRAME_SIZE = 64;
+
+static void InitFrame(uint64_t* frame, void (*fn)(void*), void* arg) {
+    uint32_t mxcsr = 0x1f80; // all exceptions masked, round to nearest
+    uint16_t fpucw = 0x037f; // same for x87, extended precision
+    memcpy(frame, &mxcsr, sizeof(mxcsr));
+    memcpy((char*)frame + 4, &fpucw, sizeof(fpucw));
+    frame[1] = 0;                               // r15
+    frame[2] = 0;                               // r14
+    frame[3] = (uint64_t)(uintptr_t)fn;         // r13
+    frame[4] = (uint64_t)(uintptr_t)arg;        // r12
+    frame[5] = 0;                               // rbx
+    frame[6] = 0;                               // rbp, ends frame-pointer walks
+    frame[7] = (uint64_t)(uintptr_t)&cppserver_context_entry;
+}
+
+}
+
+#elif defined(__aarch64__)
+
+// frame, from the saved sp upwards:
+//   0: x19..x28, 80: x29 (fp), 88: x30 (lr, where ret goes), 96: d8..d15
+asm(R"(
+    .text
+    .globl cppserver_swap_context
+    .type cppserver_swap_context, %function
+    .p2align 4
+cppserver_swap_context:
+    sub sp, sp, #160
+    stp x19, x20, [sp, #0]
+    stp x21, x22, [sp, #16]
+    stp x23, x24, [sp, #32]
+    stp x25, x26, [sp, #48]
+    stp x27, x28, [sp, #64]
+    stp x29, x30, [sp, #80]
+    stp d8, d9, [sp, #96]
+    stp d10, d11, [sp, #112]
+    stp d12, d13, [sp, #128]
+    stp d14, d15, [sp, #144]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp x19, x20, [sp, #0]
+    ldp x21, x22, [sp, #16]
+    ldp x23, x24, [sp, #32]
+    ldp x25, x26, [sp, #48]
+    ldp x27, x28, [sp, #64]
+    ldp x29, x30, [sp, #80]
+    ldp d8, d9, [sp, #96]
+    ldp d10, d11, [sp, #112]
+    ldp d12, d13, [sp, #128]
+    ldp d14, d15, [sp, #144]
+    add sp, sp, #160
+    ret
+    .size cppserver_swap_context, .-cppserver_swap_context
+
+    .globl cppserver_context_entry
+    .type cppserver_context_entry, %function
+    .p2align 4
+cppserver_context_entry:
+    mov x0, x19
+    blr x20
+    brk #0
+    .size cppserver_context_entry, .-cppserver_context_entry
+)");
+
+namespace cppserver {
+
+static const size_t FRAME_SIZE = 160;
+
+static void InitFrame(uint64_t* frame, void (*fn)(void*), void* arg) {
+    memset(frame, 0, FRAME_SIZE);
+    frame[0] = (uint64_t)(uintptr_t)arg;        // x19
+    frame[1] = (uint64_t)(uintptr_t)fn;         // x20
+    frame[10] = 0;                              // x29, ends frame-pointer walks
+    frame[11] = (uint64_t)(uintptr_t)&cppserver_context_entry; // x30
+}
+
+}
+
+#endif
+
+namespace cppserver {
+
+void MakeFiberContext(FiberContext* ctx, void* stack, size_t size, void (*fn)(void*), void* arg) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+    // after the final ret the entry runs with rsp = top - 16, aligned as the ABI
+    // requires right before its call
+    top -= 16;
+#endif
+    uint64_t* frame = (uint64_t*)(top - FRAME_SIZE);
+    InitFrame(frame, fn, arg);
+    ctx->sp = frame;
+}
+
+void SwapFiberContext(FiberContext* from, FiberContext* to) {
+    cppserver_swap_context(&from->sp, to->sp);
+}
+
+}
+
+#else // ucontext
+
+namespace cppserver {
+
+// makecontext only passes int arguments, so the context pointer is split in two
+static void ContextEntry(unsigned int hi, unsigned int lo) {
+    FiberContext* ctx = (FiberContext*)(((uintptr_t)hi << 32) | (uintptr_t)lo);
+    ctx->fn(ctx->arg);
+}
+
+void MakeFiberContext(FiberContext* ctx, void* stack, size_t size, void (*fn)(void*), void* arg) {
+    getcontext(&ctx->uc);
+    ctx->uc.uc_link = nullptr;
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = size;
+    ctx->fn = fn;
+    ctx->arg = arg;
+    uint64_t p = (uint64_t)(uintptr_t)ctx;
+    makecontext(&ctx->uc, (void (*)())&ContextEntry, 2, (unsigned int)(p >> 32), (unsigned int)p);
+}
+
+void SwapFiberContext(FiberContext* from, FiberContext* to) {
+    swapcontext(&from->uc, &to->uc);
+}
+
+}
+
+#endif
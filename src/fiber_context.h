@@ -0,0 +1,48 @@
+#ifndef __CPPSERVER_FIBER_CONTEXT_H__
+#define __CPPSERVER_FIBER_CONTEXT_H__
+
+#include <stddef.h>
+
+/**
+ * Context switch backend, chosen at build time:
+ *  - x86-64 / aarch64: hand-written switch that saves only the callee-saved registers
+ *    (plus the FP control words), no signal mask and no syscall
+ *  - anything else, or -DCPPSERVER_FIBER_USE_UCONTEXT: makecontext/swapcontext
+ */
+#if !defined(CPPSERVER_FIBER_USE_UCONTEXT) && (defined(__x86_64__) || defined(__aarch64__))
+#define CPPSERVER_FIBER_ASM 1
+#else
+#define CPPSERVER_FIBER_ASM 0
+#include <ucontext.h>
+#endif
+
+namespace cppserver {
+
+/**
+ * @brief Saved execution context of a fiber
+ */
+struct FiberContext {
+#if CPPSERVER_FIBER_ASM
+    /// stack pointer with the callee-saved registers pushed on top
+    void* sp = nullptr;
+#else
+    ucontext_t uc;
+    void (*fn)(void*) = nullptr;
+    void* arg = nullptr;
+#endif
+};
+
+/**
+ * @brief Prepare ctx to run fn(arg) on [stack, stack + size) at the next switch to it
+ * @attention fn must never return, it has to switch away for the last time instead
+ */
+void MakeFiberContext(FiberContext* ctx, void* stack, size_t size, void (*fn)(void*), void* arg);
+
+/**
+ * @brief Save the running context into from and resume to
+ */
+void SwapFiberContext(FiberContext* from, FiberContext* to);
+
+}
+
+#endif
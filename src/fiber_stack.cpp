@@ -0,0 +1,158 @@
+#include "fiber_stack.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+
+namespace cppserver {
+
+static std::atomic<size_t> s_hot_limit {8};
+static std::atomic<size_t> s_max_limit {64};
+
+static size_t PageSize() {
+    static const size_t s_page = sysconf(_SC_PAGESIZE);
+    return s_page;
+}
+
+static size_t RoundToPages(size_t size) {
+    size_t page = PageSize();
+    return (size + page - 1) / page * page;
+}
+
+static void* MapStack(size_t size) {
+    size_t page = PageSize();
+    void* addr = mmap(nullptr, size + page, PROT_READ | PROT_WRITE
+                      ,MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if(addr == MAP_FAILED) {
+        return nullptr;
+    }
+    // guard page at the low end, the stack grows down into it
+    mprotect(addr, page, PROT_NONE);
+    return (char*)addr + page;
+}
+
+static void UnmapStack(void* stack, size_t size) {
+    size_t page = PageSize();
+    munmap((char*)stack - page, size + page);
+}
+
+namespace {
+
+/// set once this thread's cache is destroyed; stacks released later (e.g. by other
+/// thread_local objects holding fibers) are unmapped right away
+static thread_local bool t_cache_dead = false;
+
+/**
+ * @brief Stacks released on one thread, binned by size
+ */
+struct ThreadCache {
+    struct Entry {
+        void* stack;
+        bool trimmed;
+    };
+    struct Bin {
+        size_t size;
+        std::vector<Entry> stacks;
+    };
+
+    ~ThreadCache() {
+        t_cache_dead = true;
+        for(auto& bin : bins) {
+            for(auto& e : bin.stacks) {
+                UnmapStack(e.stack, bin.size);
+            }
+        }
+    }
+
+    Bin& getBin(size_t size) {
+        for(auto& bin : bins) {
+            if(bin.size == size) {
+                return bin;
+            }
+        }
+        bins.push_back(Bin{size, {}});
+        return bins.back();
+    }
+
+    std::vector<Bin> bins;
+};
+
+}
+
+static ThreadCache& GetThreadCache() {
+    static thread_local ThreadCache t_cache;
+    return t_cache;
+}
+
+void* FiberStackPool::Alloc(size_t size) {
+    size = RoundToPages(size);
+    if(t_cache_dead) {
+        return MapStack(size);
+    }
+    auto& bin = GetThreadCache().getBin(size);
+    if(!bin.stacks.empty()) {
+        // most recently released first, its pages are the most likely to be resident
+        void* stack = bin.stacks.back().stack;
+        bin.stacks.pop_back();
+        return stack;
+    }
+    return MapStack(size);
+}
+
+void FiberStackPool::Dealloc(void* stack, size_t size) {
+    if(!stack) {
+        return;
+    }
+    size = RoundToPages(size);
+    if(t_cache_dead) {
+        UnmapStack(stack, size);
+        return;
+    }
+    auto& bin = GetThreadCache().getBin(size);
+    if(bin.stacks.size() >= s_max_limit.load(std::memory_order_relaxed)) {
+        UnmapStack(stack, size);
+        return;
+    }
+    bin.stacks.push_back({stack, false});
+    // the last `hot` entries stay resident, the one that just fell out of that window is trimmed
+    size_t hot = s_hot_limit.load(std::memory_order_relaxed);
+    if(bin.stacks.size() > hot) {
+        auto& cold = bin.stacks[bin.stacks.size() - hot - 1];
+        if(!cold.trimmed) {
+            madvise(cold.stack, size, MADV_DONTNEED);
+            cold.trimmed = true;
+        }
+    }
+}
+
+void FiberStackPool::Trim() {
+    if(t_cache_dead) {
+        return;
+    }
+    for(auto& bin : GetThreadCache().bins) {
+        for(auto& e : bin.stacks) {
+            if(!e.trimmed) {
+                madvise(e.stack, bin.size, MADV_DONTNEED);
+                e.trimmed = true;
+            }
+        }
+    }
+}
+
+size_t FiberStackPool::GetCachedCount() {
+    size_t n = 0;
+    if(t_cache_dead) {
+        return 0;
+    }
+    for(auto& bin : GetThreadCache().bins) {
+        n += bin.stacks.size();
+    }
+    return n;
+}
+
+void FiberStackPool::SetCacheLimits(size_t hot, size_t max) {
+    s_hot_limit.store(hot, std::memory_order_relaxed);
+    s_max_limit.store(max, std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,48 @@
+#ifndef __CPPSERVER_FIBER_STACK_H__
+#define __CPPSERVER_FIBER_STACK_H__
+
+#include <stddef.h>
+
+namespace cppserver {
+
+/**
+ * @brief Fiber stack allocator
+ * @details Stacks are mmapped with a PROT_NONE guard page below them, so an overflow
+ *          faults instead of corrupting the neighbouring memory. Released stacks go to a
+ *          free list of the releasing thread and are handed out again without a syscall
+ *          or fresh page faults. Beyond a few hot stacks per size, cached stacks get their
+ *          pages dropped with madvise(MADV_DONTNEED): the mapping stays, the memory is
+ *          returned to the kernel. Past the cache limit stacks are unmapped.
+ */
+class FiberStackPool {
+public:
+    /**
+     * @brief Get a stack of at least size bytes (rounded up to whole pages)
+     * @return lowest usable address, the stack grows down from return value + size
+     */
+    static void* Alloc(size_t size);
+
+    /**
+     * @brief Give back a stack from Alloc, size must be the same as passed to Alloc
+     */
+    static void Dealloc(void* stack, size_t size);
+
+    /**
+     * @brief Drop the pages of every stack cached by the calling thread
+     */
+    static void Trim();
+
+    /**
+     * @brief Number of stacks cached by the calling thread
+     */
+    static size_t GetCachedCount();
+
+    /**
+     * @brief Per thread and size: stacks kept resident / kept at all
+     */
+    static void SetCacheLimits(size_t hot, size_t max);
+};
+
+}
+
+#endif
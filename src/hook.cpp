@@ -0,0 +1,552 @@
+#include "hook.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+#include "fd_manager.h"
+#include "fiber.h"
+#include "iomanager.h"
+#include "log.h"
+#include "util.h"
+
+static cppserver::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+namespace cppserver {
+
+static thread_local bool t_hook_enable = false;
+
+/// timeout of a hooked connect(), ~0ull for none
+static std::atomic<uint64_t> s_connect_timeout {~0ull};
+
+#define HOOK_FUN(XX) \
+    XX(sleep) \
+    XX(usleep) \
+    XX(nanosleep) \
+    XX(socket) \
+    XX(connect) \
+    XX(accept) \
+    XX(read) \
+    XX(recv) \
+    XX(recvfrom) \
+    XX(write) \
+    XX(send) \
+    XX(sendto) \
+    XX(poll) \
+    XX(close) \
+    XX(fcntl) \
+    XX(ioctl) \
+    XX(setsockopt)
+
+static void hook_init() {
+    static bool is_inited = false;
+    if(is_inited) {
+        return;
+    }
+#define XX(name) name ## _f = (name ## _fun)dlsym(RTLD_NEXT, #name);
+    HOOK_FUN(XX);
+#undef XX
+    is_inited = true;
+}
+
+struct _HookIniter {
+    _HookIniter() {
+        hook_init();
+    }
+};
+
+// before other static initializers, which may already call the hooked functions
+static _HookIniter s_hook_initer __attribute__((init_priority(101)));
+
+bool is_hook_enable() {
+    return t_hook_enable;
+}
+
+void set_hook_enable(bool flag) {
+    t_hook_enable = flag;
+}
+
+void set_connect_timeout(uint64_t ms) {
+    s_connect_timeout = ms;
+}
+
+}
+
+/**
+ * @brief Timeout state shared between a parked call and its timer
+ */
+struct timer_info {
+    int cancelled = 0;
+};
+
+/**
+ * @brief Run an IO call, parking the fiber on EAGAIN until fd is ready or the timeout hits
+ * @param[in] event IOManager::Event to wait for
+ * @param[in] timeout_so SO_RCVTIMEO or SO_SNDTIMEO, selects the timeout
+ */
+template<typename OriginFun, typename... Args>
+static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
+        uint32_t event, int timeout_so, Args&&... args) {
+    if(!cppserver::t_hook_enable) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    cppserver::FdCtx::ptr ctx = cppserver::FdMgr::GetInstance()->get(fd);
+    if(!ctx) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    if(ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(!ctx->isSocket() || ctx->getUserNonblock()) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    uint64_t to = ctx->getTimeout(timeout_so);
+    std::shared_ptr<timer_info> tinfo(new timer_info);
+
+retry:
+    ssize_t n = fun(fd, std::forward<Args>(args)...);
+    while(n == -1 && errno == EINTR) {
+        n = fun(fd, std::forward<Args>(args)...);
+    }
+    if(n == -1 && errno == EAGAIN) {
+        cppserver::IOManager* iom = cppserver::IOManager::GetThis();
+        if(!iom) {
+            // hooked thread of a plain Scheduler, nothing to park on
+            return n;
+        }
+        cppserver::Timer::ptr timer;
+        std::weak_ptr<timer_info> winfo(tinfo);
+
+        if(to != (uint64_t)-1) {
+            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() {
+                auto t = winfo.lock();
+                if(!t || t->cancelled) {
+                    return;
+                }
+                // what a blocking socket reports when SO_RCVTIMEO/SO_SNDTIMEO runs out
+                t->cancelled = EAGAIN;
+                iom->cancelEvent(fd, (cppserver::IOManager::Event)(event));
+            }, winfo);
+        }
+
+        int rt = iom->addEvent(fd, (cppserver::IOManager::Event)(event));
+        if(rt) {
+            CPPSERVER_LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
+                << fd << ", " << event << ")";
+            if(timer) {
+                timer->cancel();
+            }
+            return -1;
+        } else {
+            cppserver::Fiber::YieldToHold();
+            if(timer) {
+                timer->cancel();
+            }
+            if(tinfo->cancelled) {
+                errno = tinfo->cancelled;
+                return -1;
+            }
+            goto retry;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * @brief Park the calling fiber for ms milliseconds
+ * @return false if it cannot be parked, the caller should block instead
+ */
+static bool park_for(uint64_t ms) {
+    if(!cppserver::t_hook_enable) {
+        return false;
+    }
+    cppserver::IOManager* iom = cppserver::IOManager::GetThis();
+    if(!iom) {
+        return false;
+    }
+    cppserver::Fiber::ptr fiber = cppserver::Fiber::GetThis();
+    iom->addTimer(ms, [iom, fiber]() {
+        iom->schedule(fiber);
+    });
+    cppserver::Fiber::YieldToHold();
+    return true;
+}
+
+/**
+ * @brief Fiber parked in poll(), resumed by whichever of its events or its timer comes first
+ */
+struct poll_waiter {
+    std::atomic<bool> woken = {false};
+    cppserver::IOManager* iom = nullptr;
+    cppserver::Fiber::ptr fiber;
+
+    void wake() {
+        if(!woken.exchange(true)) {
+            iom->schedule(fiber);
+        }
+    }
+};
+
+extern "C" {
+#define XX(name) name ## _fun name ## _f = nullptr;
+    HOOK_FUN(XX);
+#undef XX
+
+unsigned int sleep(unsigned int seconds) {
+    if(!park_for(seconds * 1000ull)) {
+        return sleep_f(seconds);
+    }
+    return 0;
+}
+
+int usleep(useconds_t usec) {
+    if(!park_for(usec / 1000)) {
+        return usleep_f(usec);
+    }
+    return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+    if(!req || req->tv_nsec < 0 || req->tv_nsec >= 1000000000) {
+        return nanosleep_f(req, rem);
+    }
+    uint64_t ms = req->tv_sec * 1000ull + req->tv_nsec / 1000000;
+    if(!park_for(ms)) {
+        return nanosleep_f(req, rem);
+    }
+    return 0;
+}
+
+int socket(int domain, int type, int protocol) {
+    if(!cppserver::t_hook_enable) {
+        return socket_f(domain, type, protocol);
+    }
+    int fd = socket_f(domain, type, protocol);
+    if(fd == -1) {
+        return fd;
+    }
+    cppserver::FdMgr::GetInstance()->get(fd, true);
+    return fd;
+}
+
+int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen, uint64_t timeout_ms) {
+    if(!cppserver::t_hook_enable) {
+        return connect_f(fd, addr, addrlen);
+    }
+    cppserver::FdCtx::ptr ctx = cppserver::FdMgr::GetInstance()->get(fd);
+    if(!ctx || ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(!ctx->isSocket() || ctx->getUserNonblock()) {
+        return connect_f(fd, addr, addrlen);
+    }
+
+    int n = connect_f(fd, addr, addrlen);
+    if(n == 0) {
+        return 0;
+    } else if(n != -1 || errno != EINPROGRESS) {
+        return n;
+    }
+
+    cppserver::IOManager* iom = cppserver::IOManager::GetThis();
+    if(!iom) {
+        return n;
+    }
+    cppserver::Timer::ptr timer;
+    std::shared_ptr<timer_info> tinfo(new timer_info);
+    std::weak_ptr<timer_info> winfo(tinfo);
+
+    if(timeout_ms != (uint64_t)-1) {
+        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]() {
+                auto t = winfo.lock();
+                if(!t || t->cancelled) {
+                    return;
+                }
+                t->cancelled = ETIMEDOUT;
+                iom->cancelEvent(fd, cppserver::IOManager::WRITE);
+        }, winfo);
+    }
+
+    int rt = iom->addEvent(fd, cppserver::IOManager::WRITE);
+    if(rt == 0) {
+        cppserver::Fiber::YieldToHold();
+        if(timer) {
+            timer->cancel();
+        }
+        if(tinfo->cancelled) {
+            errno = tinfo->cancelled;
+            return -1;
+        }
+    } else {
+        if(timer) {
+            timer->cancel();
+        }
+        CPPSERVER_LOG_ERROR(g_logger) << "connect addEvent(" << fd << ", WRITE) error";
+    }
+
+    int error = 0;
+    socklen_t len = sizeof(int);
+    if(-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len)) {
+        return -1;
+    }
+    if(!error) {
+        return 0;
+    } else {
+        errno = error;
+        return -1;
+    }
+}
+
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    return connect_with_timeout(sockfd, addr, addrlen, cppserver::s_connect_timeout);
+}
+
+int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
+    int fd = do_io(s, accept_f, "accept", cppserver::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    if(fd >= 0 && cppserver::t_hook_enable) {
+        cppserver::FdMgr::GetInstance()->get(fd, true);
+    }
+    return fd;
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    return do_io(fd, read_f, "read", cppserver::IOManager::READ, SO_RCVTIMEO, buf, count);
+}
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+    return do_io(sockfd, recv_f, "recv", cppserver::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+}
+
+ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
+    return do_io(sockfd, recvfrom_f, "recvfrom", cppserver::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    return do_io(fd, write_f, "write", cppserver::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+}
+
+ssize_t send(int s, const void *msg, size_t len, int flags) {
+    return do_io(s, send_f, "send", cppserver::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+}
+
+ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    return do_io(s, sendto_f, "sendto", cppserver::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    if(!cppserver::t_hook_enable || timeout == 0) {
+        return poll_f(fds, nfds, timeout);
+    }
+    cppserver::IOManager* iom = cppserver::IOManager::GetThis();
+    if(!iom) {
+        return poll_f(fds, nfds, timeout);
+    }
+
+    uint64_t deadline = timeout < 0 ? ~0ull : cppserver::GetElapsedMS() + timeout;
+    while(true) {
+        int rt = poll_f(fds, nfds, 0);
+        if(rt != 0) {
+            return rt;
+        }
+        uint64_t now = cppserver::GetElapsedMS();
+        if(now >= deadline) {
+            return 0;
+        }
+
+        std::shared_ptr<poll_waiter> waiter(new poll_waiter);
+        waiter->iom = iom;
+        waiter->fiber = cppserver::Fiber::GetThis();
+        std::vector<std::pair<int, cppserver::IOManager::Event> > registered;
+        for(nfds_t i = 0; i < nfds; ++i) {
+            if(fds[i].fd < 0) {
+                continue;
+            }
+            if(fds[i].events & (POLLIN | POLLPRI)) {
+                if(iom->addEvent(fds[i].fd, cppserver::IOManager::READ, [waiter]() { waiter->wake(); }) == 0) {
+                    registered.push_back(std::make_pair(fds[i].fd, cppserver::IOManager::READ));
+                }
+            }
+            if(fds[i].events & POLLOUT) {
+                if(iom->addEvent(fds[i].fd, cppserver::IOManager::WRITE, [waiter]() { waiter->wake(); }) == 0) {
+                    registered.push_back(std::make_pair(fds[i].fd, cppserver::IOManager::WRITE));
+                }
+            }
+        }
+        if(registered.empty() && deadline == ~0ull) {
+            // nothing that can be waited for, same as the plain call
+            return poll_f(fds, nfds, timeout);
+        }
+
+        cppserver::Timer::ptr timer;
+        if(deadline != ~0ull) {
+            timer = iom->addTimer(deadline - now, [waiter]() { waiter->wake(); });
+        }
+        cppserver::Fiber::YieldToHold();
+        if(timer) {
+            timer->cancel();
+        }
+        // drop the events that did not fire
+        for(auto& i : registered) {
+            iom->delEvent(i.first, i.second);
+        }
+    }
+}
+
+int close(int fd) {
+    if(!cppserver::t_hook_enable) {
+        return close_f(fd);
+    }
+
+    cppserver::FdCtx::ptr ctx = cppserver::FdMgr::GetInstance()->get(fd);
+    if(ctx) {
+        auto iom = cppserver::IOManager::GetThis();
+        if(iom) {
+            iom->cancelAll(fd);
+        }
+        cppserver::FdMgr::GetInstance()->del(fd);
+    }
+    return close_f(fd);
+}
+
+int fcntl(int fd, int cmd, ... /* arg */ ) {
+    va_list va;
+    va_start(va, cmd);
+    switch(cmd) {
+        case F_SETFL:
+            {
+                int arg = va_arg(va, int);
+                va_end(va);
+                cppserver::FdCtx::ptr ctx = cppserver::FdMgr::GetInstance()->get(fd);
+                if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+                    return fcntl_f(fd, cmd, arg);
+                }
+                ctx->setUserNonblock(arg & O_NONBLOCK);
+                if(ctx->getSysNonblock()) {
+                    arg |= O_NONBLOCK;
+                } else {
+                    arg &= ~O_NONBLOCK;
+                }
+                return fcntl_f(fd, cmd, arg);
+            }
+            break;
+        case F_GETFL:
+            {
+                va_end(va);
+                int arg = fcntl_f(fd, cmd);
+                cppserver::FdCtx::ptr ctx = cppserver::FdMgr::GetInstance()->get(fd);
+                if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+                    return arg;
+                }
+                // report what the user asked for, not the non-blocking mode set underneath
+                if(ctx->getUserNonblock()) {
+                    return arg | O_NONBLOCK;
+                } else {
+                    return arg & ~O_NONBLOCK;
+                }
+            }
+            break;
+        case F_DUPFD:
+        case F_DUPFD_CLOEXEC:
+        case F_SETFD:
+        case F_SETOWN:
+        case F_SETSIG:
+        case F_SETLEASE:
+        case F_NOTIFY:
+#ifdef F_SETPIPE_SZ
+        case F_SETPIPE_SZ:
+#endif
+            {
+                int arg = va_arg(va, int);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg);
+            }
+            break;
+        case F_GETFD:
+        case F_GETOWN:
+        case F_GETSIG:
+        case F_GETLEASE:
+#ifdef F_GETPIPE_SZ
+        case F_GETPIPE_SZ:
+#endif
+            {
+                va_end(va);
+                return fcntl_f(fd, cmd);
+            }
+            break;
+        case F_SETLK:
+        case F_SETLKW:
+        case F_GETLK:
+            {
+                struct flock* arg = va_arg(va, struct flock*);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg);
+            }
+            break;
+        case F_GETOWN_EX:
+        case F_SETOWN_EX:
+            {
+                struct f_owner_ex* arg = va_arg(va, struct f_owner_ex*);
+                va_end(va);
+                return fcntl_f(fd, cmd, arg);
+            }
+            break;
+        default:
+            va_end(va);
+            return fcntl_f(fd, cmd);
+    }
+}
+
+int ioctl(int d, unsigned long int request, ...) {
+    va_list va;
+    va_start(va, request);
+    void* arg = va_arg(va, void*);
+    va_end(va);
+
+    if(FIONBIO == request && arg) {
+        bool user_nonblock = !!*(int*)arg;
+        cppserver::FdCtx::ptr ctx = cppserver::FdMgr::GetInstance()->get(d);
+        if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+            return ioctl_f(d, request, arg);
+        }
+        // the fd itself stays non-blocking
+        int on = 1;
+        int rt = ioctl_f(d, request, &on);
+        if(rt == 0) {
+            ctx->setUserNonblock(user_nonblock);
+        }
+        return rt;
+    }
+    return ioctl_f(d, request, arg);
+}
+
+int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+    if(!cppserver::t_hook_enable) {
+        return setsockopt_f(sockfd, level, optname, optval, optlen);
+    }
+    int rt = setsockopt_f(sockfd, level, optname, optval, optlen);
+    // record the timeout only once the kernel accepted it, optval is valid then
+    if(rt == 0 && level == SOL_SOCKET) {
+        if(optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) {
+            cppserver::FdCtx::ptr ctx = cppserver::FdMgr::GetInstance()->get(sockfd);
+            if(ctx) {
+                const timeval* v = (const timeval*)optval;
+                uint64_t ms = v->tv_sec * 1000 + v->tv_usec / 1000;
+                // a zero timeout means none, as for the plain option
+                ctx->setTimeout(optname, ms ? ms : (uint64_t)-1);
+            }
+        }
+    }
+    return rt;
+}
+
+}
@@ -0,0 +1,108 @@
+#ifndef __CPPSERVER_HOOK_H__
+#define __CPPSERVER_HOOK_H__
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Blocking calls made by fibers of an IOManager park the fiber instead of the thread.
+ *
+ * The functions below replace the libc ones for the whole program; the originals are
+ * looked up with dlsym(RTLD_NEXT) and available as <name>_f. Hooking is switched on per
+ * thread: IOManager workers turn it on, every other thread gets the plain libc behaviour.
+ * On a hooked thread a blocking socket call that would block registers the fd with the
+ * IOManager, yields, and retries once the fd is ready, honouring SO_RCVTIMEO/SO_SNDTIMEO.
+ * sleep/usleep/nanosleep park the fiber on a timer, poll parks it on all of its fds.
+ */
+namespace cppserver {
+
+/**
+ * @brief true if hooking is on for the calling thread
+ */
+bool is_hook_enable();
+
+/**
+ * @brief Turn hooking on or off for the calling thread
+ */
+void set_hook_enable(bool flag);
+
+/**
+ * @brief Timeout of a hooked connect() in milliseconds, ~0ull for none (the default)
+ */
+void set_connect_timeout(uint64_t ms);
+
+}
+
+extern "C" {
+
+//sleep
+typedef unsigned int (*sleep_fun)(unsigned int seconds);
+extern sleep_fun sleep_f;
+
+typedef int (*usleep_fun)(useconds_t usec);
+extern usleep_fun usleep_f;
+
+typedef int (*nanosleep_fun)(const struct timespec *req, struct timespec *rem);
+extern nanosleep_fun nanosleep_f;
+
+//socket
+typedef int (*socket_fun)(int domain, int type, int protocol);
+extern socket_fun socket_f;
+
+typedef int (*connect_fun)(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+extern connect_fun connect_f;
+
+typedef int (*accept_fun)(int s, struct sockaddr *addr, socklen_t *addrlen);
+extern accept_fun accept_f;
+
+//read
+typedef ssize_t (*read_fun)(int fd, void *buf, size_t count);
+extern read_fun read_f;
+
+typedef ssize_t (*recv_fun)(int sockfd, void *buf, size_t len, int flags);
+extern recv_fun recv_f;
+
+typedef ssize_t (*recvfrom_fun)(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
+extern recvfrom_fun recvfrom_f;
+
+//write
+typedef ssize_t (*write_fun)(int fd, const void *buf, size_t count);
+extern write_fun write_f;
+
+typedef ssize_t (*send_fun)(int s, const void *msg, size_t len, int flags);
+extern send_fun send_f;
+
+typedef ssize_t (*sendto_fun)(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen);
+extern sendto_fun sendto_f;
+
+//poll
+typedef int (*poll_fun)(struct pollfd *fds, nfds_t nfds, int timeout);
+extern poll_fun poll_f;
+
+//fd bookkeeping
+typedef int (*close_fun)(int fd);
+extern close_fun close_f;
+
+typedef int (*fcntl_fun)(int fd, int cmd, ... /* arg */ );
+extern fcntl_fun fcntl_f;
+
+typedef int (*ioctl_fun)(int d, unsigned long int request, ...);
+extern ioctl_fun ioctl_f;
+
+typedef int (*setsockopt_fun)(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
+extern setsockopt_fun setsockopt_f;
+
+/**
+ * @brief connect() that gives up after timeout_ms, parking the fiber while it waits
+ */
+extern int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen, uint64_t timeout_ms);
+
+}
+
+#endif
@@ -0,0 +1,384 @@
+#include "iomanager.h"
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+#include "log.h"
+
+namespace cppserver {
+
+static Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+/// upper bound of one epoll_wait, stopping() is rechecked at least this often
+static const int g_max_timeout_ms = 3000;
+/// events harvested by one epoll_wait
+static const int g_max_events = 256;
+
+IOManager::FdContext::EventContext& IOManager::FdContext::getContext(Event event) {
+    switch(event) {
+        case IOManager::READ:
+            return read;
+        case IOManager::WRITE:
+            return write;
+        default:
+            assert(false && "getContext");
+    }
+    throw std::invalid_argument("getContext invalid event");
+}
+
+void IOManager::FdContext::resetContext(EventContext& ctx) {
+    ctx.scheduler = nullptr;
+    ctx.fiber.reset();
+    ctx.cb = nullptr;
+}
+
+void IOManager::FdContext::triggerEvent(Event event) {
+    assert(events & event);
+    events = (Event)(events & ~event);
+    EventContext& ctx = getContext(event);
+    if(ctx.cb) {
+        ctx.scheduler->schedule(&ctx.cb);
+    } else {
+        ctx.scheduler->schedule(&ctx.fiber);
+    }
+    ctx.scheduler = nullptr;
+}
+
+IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
+    :Scheduler(threads, use_caller, name) {
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(m_epfd < 0) {
+        throw std::system_error(errno, std::system_category(), "epoll_create1");
+    }
+
+    m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_tickleFd < 0) {
+        int err = errno;
+        close(m_epfd);
+        throw std::system_error(err, std::system_category(), "eventfd");
+    }
+
+    epoll_event event;
+    memset(&event, 0, sizeof(epoll_event));
+    event.events = EPOLLIN | EPOLLET;
+    // fd contexts are never null, so a null pointer marks the tickle fd
+    event.data.ptr = nullptr;
+    if(epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event)) {
+        int err = errno;
+        close(m_tickleFd);
+        close(m_epfd);
+        throw std::system_error(err, std::system_category(), "epoll_ctl");
+    }
+
+    contextResize(32);
+
+    start();
+}
+
+IOManager::~IOManager() {
+    stop();
+    close(m_epfd);
+    close(m_tickleFd);
+
+    for(size_t i = 0; i < m_fdContexts.size(); ++i) {
+        delete m_fdContexts[i];
+    }
+}
+
+void IOManager::contextResize(size_t size) {
+    size_t old = m_fdContexts.size();
+    if(size <= old) {
+        return;
+    }
+    m_fdContexts.resize(size);
+    for(size_t i = old; i < size; ++i) {
+        m_fdContexts[i] = new FdContext;
+        m_fdContexts[i]->fd = i;
+    }
+}
+
+int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
+    // a callback added from a thread outside any scheduler runs on this one; the calling
+    // fiber can only be resumed if a scheduler runs it
+    Scheduler* scheduler = Scheduler::GetThis();
+    if(!scheduler) {
+        if(!cb) {
+            CPPSERVER_LOG_ERROR(g_logger) << "addEvent fd=" << fd
+                << " without a callback from a thread with no scheduler";
+            return -1;
+        }
+        scheduler = this;
+    }
+
+    FdContext* fd_ctx = nullptr;
+    RWMutexType::ReadLock lock(m_mutex);
+    if((int)m_fdContexts.size() > fd) {
+        fd_ctx = m_fdContexts[fd];
+        lock.unlock();
+    } else {
+        lock.unlock();
+        RWMutexType::WriteLock lock2(m_mutex);
+        contextResize(fd * 1.5 + 1);
+        fd_ctx = m_fdContexts[fd];
+    }
+
+    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    if(fd_ctx->events & event) {
+        CPPSERVER_LOG_ERROR(g_logger) << "addEvent assert fd=" << fd
+            << " event=" << event << " fd_ctx.event=" << fd_ctx->events;
+        assert(!(fd_ctx->events & event));
+        return -1;
+    }
+
+    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    epoll_event epevent;
+    epevent.events = EPOLLET | (uint32_t)(fd_ctx->events | event);
+    epevent.data.ptr = fd_ctx;
+
+    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    if(rt) {
+        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+            << op << ", " << fd << ", " << epevent.events << "):"
+            << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        return -1;
+    }
+
+    ++m_pendingEventCount;
+    fd_ctx->events = (Event)(fd_ctx->events | event);
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    assert(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb);
+
+    event_ctx.scheduler = scheduler;
+    if(cb) {
+        event_ctx.cb.swap(cb);
+    } else {
+        event_ctx.fiber = Fiber::GetThis();
+        assert(event_ctx.fiber->getState() == Fiber::EXEC);
+    }
+    return 0;
+}
+
+bool IOManager::delEvent(int fd, Event event) {
+    RWMutexType::ReadLock lock(m_mutex);
+    if((int)m_fdContexts.size() <= fd) {
+        return false;
+    }
+    FdContext* fd_ctx = m_fdContexts[fd];
+    lock.unlock();
+
+    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    if(!(fd_ctx->events & event)) {
+        return false;
+    }
+
+    Event new_events = (Event)(fd_ctx->events & ~event);
+    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    epoll_event epevent;
+    epevent.events = EPOLLET | (uint32_t)new_events;
+    epevent.data.ptr = fd_ctx;
+
+    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    if(rt) {
+        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+            << op << ", " << fd << ", " << epevent.events << "):"
+            << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        return false;
+    }
+
+    --m_pendingEventCount;
+    fd_ctx->events = new_events;
+    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    fd_ctx->resetContext(event_ctx);
+    return true;
+}
+
+bool IOManager::cancelEvent(int fd, Event event) {
+    RWMutexType::ReadLock lock(m_mutex);
+    if((int)m_fdContexts.size() <= fd) {
+        return false;
+    }
+    FdContext* fd_ctx = m_fdContexts[fd];
+    lock.unlock();
+
+    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    if(!(fd_ctx->events & event)) {
+        return false;
+    }
+
+    Event new_events = (Event)(fd_ctx->events & ~event);
+    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    epoll_event epevent;
+    epevent.events = EPOLLET | (uint32_t)new_events;
+    epevent.data.ptr = fd_ctx;
+
+    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    if(rt) {
+        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+            << op << ", " << fd << ", " << epevent.events << "):"
+            << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        return false;
+    }
+
+    fd_ctx->triggerEvent(event);
+    --m_pendingEventCount;
+    return true;
+}
+
+bool IOManager::cancelAll(int fd) {
+    RWMutexType::ReadLock lock(m_mutex);
+    if((int)m_fdContexts.size() <= fd) {
+        return false;
+    }
+    FdContext* fd_ctx = m_fdContexts[fd];
+    lock.unlock();
+
+    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    if(!fd_ctx->events) {
+        return false;
+    }
+
+    int op = EPOLL_CTL_DEL;
+    epoll_event epevent;
+    epevent.events = 0;
+    epevent.data.ptr = fd_ctx;
+
+    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    if(rt) {
+        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+            << op << ", " << fd << ", " << epevent.events << "):"
+            << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        return false;
+    }
+
+    if(fd_ctx->events & READ) {
+        fd_ctx->triggerEvent(READ);
+        --m_pendingEventCount;
+    }
+    if(fd_ctx->events & WRITE) {
+        fd_ctx->triggerEvent(WRITE);
+        --m_pendingEventCount;
+    }
+
+    assert(fd_ctx->events == 0);
+    return true;
+}
+
+void IOManager::onTimerInsertedAtFront() {
+    tickle();
+}
+
+IOManager* IOManager::GetThis() {
+    return dynamic_cast<IOManager*>(Scheduler::GetThis());
+}
+
+void IOManager::tickle() {
+    if(!hasIdleThreads()) {
+        return;
+    }
+    uint64_t one = 1;
+    int rt = write(m_tickleFd, &one, sizeof(one));
+    // EAGAIN only if the counter is saturated, i.e. a wake up is pending anyway
+    assert(rt == sizeof(one) || errno == EAGAIN);
+    (void)rt;
+}
+
+bool IOManager::stopping(uint64_t& timeout) {
+    timeout = getNextTimer();
+    return timeout == ~0ull
+        && m_pendingEventCount == 0
+        && Scheduler::stopping();
+}
+
+bool IOManager::stopping() {
+    uint64_t timeout = 0;
+    return stopping(timeout);
+}
+
+void IOManager::idle() {
+    CPPSERVER_LOG_DEBUG(g_logger) << "idle";
+    std::unique_ptr<epoll_event[]> events(new epoll_event[g_max_events]);
+
+    while(true) {
+        uint64_t next_timeout = 0;
+        if(stopping(next_timeout)) {
+            CPPSERVER_LOG_INFO(g_logger) << "name=" << getName()
+                                         << " idle stopping exit";
+            break;
+        }
+
+        int rt = 0;
+        do {
+            // a task queued while this worker was on its way here may not tickle
+            int timeout = hasPendingTasks() ? 0
+                : (int)std::min(next_timeout, (uint64_t)g_max_timeout_ms);
+            rt = epoll_wait(m_epfd, events.get(), g_max_events, timeout);
+        } while(rt < 0 && errno == EINTR);
+
+        std::vector<std::function<void()> > cbs;
+        listExpiredCb(cbs);
+        if(!cbs.empty()) {
+            schedule(cbs.begin(), cbs.end());
+            cbs.clear();
+        }
+
+        for(int i = 0; i < rt; ++i) {
+            epoll_event& event = events[i];
+            if(!event.data.ptr) {
+                uint64_t dummy;
+                while(read(m_tickleFd, &dummy, sizeof(dummy)) > 0);
+                continue;
+            }
+
+            FdContext* fd_ctx = (FdContext*)event.data.ptr;
+            FdContext::MutexType::Lock lock(fd_ctx->mutex);
+            if(event.events & (EPOLLERR | EPOLLHUP)) {
+                // wake both sides, the next read/write reports the error
+                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+            }
+            int real_events = NONE;
+            if(event.events & EPOLLIN) {
+                real_events |= READ;
+            }
+            if(event.events & EPOLLOUT) {
+                real_events |= WRITE;
+            }
+
+            real_events &= fd_ctx->events;
+            if(real_events == NONE) {
+                continue;
+            }
+
+            int left_events = (fd_ctx->events & ~real_events);
+            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+            event.events = EPOLLET | left_events;
+
+            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+            if(rt2) {
+                CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                    << op << ", " << fd_ctx->fd << ", " << event.events << "):"
+                    << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
+                continue;
+            }
+
+            if(real_events & READ) {
+                fd_ctx->triggerEvent(READ);
+                --m_pendingEventCount;
+            }
+            if(real_events & WRITE) {
+                fd_ctx->triggerEvent(WRITE);
+                --m_pendingEventCount;
+            }
+        }
+
+        Fiber::YieldToHold();
+    }
+}
+
+}
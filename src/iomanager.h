@@ -0,0 +1,144 @@
+#ifndef __CPPSERVER_IOMANAGER_H__
+#define __CPPSERVER_IOMANAGER_H__
+
+#include <vector>
+#include <atomic>
+#include <functional>
+
+#include "scheduler.h"
+#include "timer.h"
+
+namespace cppserver {
+
+/**
+ * @brief Fiber scheduler driven by epoll
+ * @details Idle workers wait in epoll_wait on one shared edge-triggered epoll instance.
+ *          A fiber (or callback) registers interest in an fd with addEvent(); when the fd
+ *          becomes ready the event is removed again and the fiber is scheduled, so each
+ *          addEvent() resumes its waiter exactly once. Workers waiting in epoll are woken
+ *          for new tasks through an eventfd. Timers run on the workers as well: epoll_wait
+ *          times out at the next timer deadline.
+ */
+class IOManager : public Scheduler, public TimerManager {
+public:
+    typedef std::shared_ptr<IOManager> ptr;
+    typedef RWMutex RWMutexType;
+
+    /**
+     * @brief IO events, values match EPOLLIN / EPOLLOUT
+     */
+    enum Event {
+        NONE    = 0x0,
+        READ    = 0x1,
+        WRITE   = 0x4,
+    };
+private:
+    /**
+     * @brief Waiters of one fd
+     */
+    struct FdContext {
+        typedef FutexMutex MutexType;
+        /**
+         * @brief Waiter of one event
+         */
+        struct EventContext {
+            /// scheduler to resume on
+            Scheduler* scheduler = nullptr;
+            /// fiber to resume
+            Fiber::ptr fiber;
+            /// or callback to run
+            std::function<void()> cb;
+        };
+
+        /**
+         * @brief Waiter of the given event
+         */
+        EventContext& getContext(Event event);
+
+        void resetContext(EventContext& ctx);
+
+        /**
+         * @brief Schedule the waiter of event and forget it, fd must be registered for event
+         */
+        void triggerEvent(Event event);
+
+        EventContext read;
+        EventContext write;
+        int fd = 0;
+        /// events registered in epoll
+        Event events = NONE;
+        MutexType mutex;
+    };
+
+public:
+    /**
+     * @brief Constructor, starts the workers
+     * @param[in] threads number of worker threads, including the caller with use_caller
+     * @param[in] use_caller run tasks on the constructing thread too
+     * @param[in] name scheduler name
+     * @exception std::system_error if the epoll instance or the eventfd cannot be created
+     */
+    IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "");
+
+    ~IOManager();
+
+    /**
+     * @brief Wait for event on fd
+     * @param[in] cb run when the event fires; if empty the calling fiber is resumed,
+     *               it should Fiber::YieldToHold() right after. Called from a thread
+     *               without a scheduler, cb runs on this IOManager and must be set
+     * @return 0 on success, -1 on error
+     */
+    int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+
+    /**
+     * @brief Stop waiting for event on fd without resuming the waiter
+     * @return true if the event was registered
+     */
+    bool delEvent(int fd, Event event);
+
+    /**
+     * @brief Stop waiting for event on fd and resume the waiter as if it fired
+     * @return true if the event was registered
+     */
+    bool cancelEvent(int fd, Event event);
+
+    /**
+     * @brief cancelEvent() for every event registered on fd
+     */
+    bool cancelAll(int fd);
+
+    /**
+     * @brief IOManager running on the calling thread, nullptr if none
+     */
+    static IOManager* GetThis();
+protected:
+    void tickle() override;
+    bool stopping() override;
+    void idle() override;
+    bool hookBlockingCalls() const override { return true;}
+    void onTimerInsertedAtFront() override;
+
+    /**
+     * @brief stopping(), also returning the time until the next timer
+     */
+    bool stopping(uint64_t& timeout);
+
+    /**
+     * @brief Grow the fd context table, m_mutex must be write locked
+     */
+    void contextResize(size_t size);
+private:
+    int m_epfd = 0;
+    /// eventfd waking up workers in epoll_wait
+    int m_tickleFd = 0;
+    /// events registered and not fired yet
+    std::atomic<size_t> m_pendingEventCount = {0};
+    RWMutexType m_mutex;
+    /// fd context per fd, indexed by fd
+    std::vector<FdContext*> m_fdContexts;
+};
+
+}
+
+#endif
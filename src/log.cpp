@@ -1,91 +1,1334 @@
 #include "log.h"
+#include <tuple>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
 
 namespace cppserver
 {
 
+    const char *LogLevelToString(LogLevel level)
+    {
+        switch (level)
+        {
+        case LogLevel::DEBUG:
+            return "DEBUG";
+        case LogLevel::INFO:
+            return "INFO";
+        case LogLevel::WARN:
+            return "WARN";
+        case LogLevel::ERROR:
+            return "ERROR";
+        case LogLevel::FATAL:
+            return "FATAL";
+        }
+        return "UNKNOWN";
+    }
+
+    // %m
+    class MessageFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        MessageFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            os << event->getContent();
+        }
+    };
+
+    // %p
+    class LevelFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        LevelFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            os << LogLevelToString(level);
+        }
+    };
+
+    // %r
+    class ElapseFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        ElapseFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            os << event->getElapse();
+        }
+    };
+
+    // %c
+    class NameFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        NameFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            os << logger->getName();
+        }
+    };
+
+    // %t
+    class ThreadIdFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        ThreadIdFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            os << event->getThreadId();
+        }
+    };
+
+    // %F
+    class FiberIdFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        FiberIdFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            os << event->getFiberId();
+        }
+    };
+
+    // %d{fmt}, fmt is passed to strftime
+    class DateTimeFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        DateTimeFormatItem(const std::string &format = "%Y-%m-%d %H:%M:%S") : m_format(format)
+        {
+            if (m_format.empty())
+            {
+                m_format = "%Y-%m-%d %H:%M:%S";
+            }
+        }
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            struct tm tm;
+            time_t time = event->getTime();
+            localtime_r(&time, &tm);
+            char buf[64];
+            size_t n = strftime(buf, sizeof(buf), m_format.c_str(), &tm);
+            os.write(buf, n);
+        }
+
+    private:
+        std::string m_format;
+    };
+
+    // %f
+    class FilenameFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        FilenameFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            if (event->getFile())
+            {
+                os << event->getFile();
+            }
+        }
+    };
+
+    // %l
+    class LineFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        LineFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            os << event->getLine();
+        }
+    };
+
+    // %n
+    class NewLineFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        NewLineFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            os << '\n';
+        }
+    };
+
+    // %T
+    class TabFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        TabFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            os << "\t";
+        }
+    };
+
+    // plain text between specifiers
+    class StringFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        StringFormatItem(const std::string &str) : m_string(str) {}
+        void format(std::ostream &os, Logger::ptr logger, LogLevel level, LogEvent::ptr event) override
+        {
+            os << m_string;
+        }
+
+    private:
+        std::string m_string;
+    };
+
+    // Map a specifier character to its item, nullptr if unknown.
+    // Keep in sync with the specifiers accepted by StaticLogFormatter in log_pattern.h.
+    static LogFormatter::FormatItem::ptr CreateFormatItem(char spec, const std::string &fmt)
+    {
+        switch (spec)
+        {
+#define XX(c, C)   \
+    case c:        \
+        return LogFormatter::FormatItem::ptr(new C(fmt));
+            XX('m', MessageFormatItem);
+            XX('p', LevelFormatItem);
+            XX('r', ElapseFormatItem);
+            XX('c', NameFormatItem);
+            XX('t', ThreadIdFormatItem);
+            XX('n', NewLineFormatItem);
+            XX('d', DateTimeFormatItem);
+            XX('f', FilenameFormatItem);
+            XX('l', LineFormatItem);
+            XX('T', TabFormatItem);
+            XX('F', FiberIdFormatItem);
+#undef XX
+        }
+        return nullptr;
+    }
+
+    void LogBuffer::grow(size_t need)
+    {
+        size_t cap = m_capacity * 2;
+        while (cap < need)
+        {
+            cap *= 2;
+        }
+        char *data = (char *)malloc(cap);
+        memcpy(data, m_data, m_size);
+        if (m_data != m_inline)
+        {
+            free(m_data);
+        }
+        m_data = data;
+        m_capacity = cap;
+    }
+
+    LogBuffer &LogBuffer::GetThreadLocal()
+    {
+        static thread_local LogBuffer t_buf;
+        return t_buf;
+    }
+
+    // Streams of the calling thread that are not in use. Nesting (logging from inside an
+    // operator<< of something being logged) takes a second one, so the pool rarely exceeds two.
+    static thread_local std::vector<std::unique_ptr<LogStream>> t_streams;
+
+    LogStream *LogStream::Acquire(LogBuffer &buf)
+    {
+        LogStream *stream;
+        if (t_streams.empty())
+        {
+            stream = new LogStream;
+        }
+        else
+        {
+            stream = t_streams.back().release();
+            t_streams.pop_back();
+        }
+        stream->m_streambuf.m_buf = &buf;
+        return stream;
+    }
+
+    void LogStream::Release(LogStream *stream)
+    {
+        // drop whatever manipulators the caller left behind
+        stream->clear();
+        stream->flags(std::ios_base::skipws | std::ios_base::dec);
+        stream->precision(6);
+        stream->width(0);
+        stream->fill(' ');
+        stream->m_streambuf.m_buf = nullptr;
+        t_streams.emplace_back(stream);
+    }
+
+    LogEvent::LogEvent(const char *file, int line, unsigned int elapse,
+                       unsigned int thread_id, unsigned int fiber_id, time_t time)
+        : m_file(file), m_line(line), m_elapse(elapse), m_threadId(thread_id), m_fiberId(fiber_id), m_time(time)
+    {
+    }
+
+    LogEvent::ptr LogEvent::Create(const char *file, int line, unsigned int elapse,
+                                   unsigned int thread_id, unsigned int fiber_id, time_t time)
+    {
+        static thread_local LogEvent::ptr t_event;
+        if (t_event && t_event.use_count() == 1)
+        {
+            // the last other owner may have released it on another thread (async dispatch),
+            // pair with that release before writing into the event again
+            std::atomic_thread_fence(std::memory_order_acquire);
+            t_event->reset(file, line, elapse, thread_id, fiber_id, time);
+            return t_event;
+        }
+        // still queued somewhere: leave it to its owner and start a new one
+        t_event.reset(new LogEvent(file, line, elapse, thread_id, fiber_id, time));
+        return t_event;
+    }
+
     Logger::Logger(const std::string &name) : m_name(name)
     {
+        m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"));
+    }
+
+    void Logger::addAppender(LogAppender::ptr appender)
+    {
+        MutexType::Lock lock(m_mutex);
+        if (!appender->getFormatter())
+        {
+            appender->setFormatter(m_formatter); // inherit the logger's formatter
+        }
+        auto appenders = m_appenders ? std::make_shared<std::vector<LogAppender::ptr>>(*m_appenders)
+                                     : std::make_shared<std::vector<LogAppender::ptr>>();
+        appenders->push_back(appender);
+        m_appenders = appenders;
+    }
+
+    void Logger::delAppender(LogAppender::ptr appender)
+    {
+        MutexType::Lock lock(m_mutex);
+        if (!m_appenders)
+        {
+            return;
+        }
+        auto it = std::find(m_appenders->begin(), m_appenders->end(), appender);
+        if (it != m_appenders->end())
+        {
+            auto appenders = std::make_shared<std::vector<LogAppender::ptr>>(*m_appenders);
+            appenders->erase(appenders->begin() + (it - m_appenders->begin()));
+            m_appenders = appenders;
+        }
+    }
+
+    void Logger::clearAppenders()
+    {
+        MutexType::Lock lock(m_mutex);
+        m_appenders.reset();
+    }
+
+    void Logger::setFormatter(LogFormatter::ptr val)
+    {
+        MutexType::Lock lock(m_mutex);
+        m_formatter = val;
+    }
+
+    LogFormatter::ptr Logger::getFormatter()
+    {
+        MutexType::Lock lock(m_mutex);
+        return m_formatter;
+    }
+
+    // Hazard pointers for Logger::m_asyncFast. log() publishes the dispatcher it is about to
+    // push into in a slot of its thread's record, setAsync() waits until no slot holds the
+    // one it replaced before dropping it. Records are never freed: a thread takes a free one
+    // on its first async log and hands it back at exit, so the list is as long as the most
+    // threads that ever logged at once.
+    struct AsyncHazards
+    {
+        static const int SLOTS = 4; // pushes nested deeper than this dispatch synchronously
+
+        std::atomic<LogDispatcher *> slots[SLOTS] = {};
+        int depth = 0; // slots in use, owner thread only
+        std::atomic<bool> used{false};
+        AsyncHazards *next = nullptr; // immutable once the record is on s_hazards
+
+        static AsyncHazards *Acquire();
+        static void WaitUntilUnused(LogDispatcher *dispatcher);
+    };
+
+    static std::atomic<AsyncHazards *> s_hazards{nullptr};
+    static thread_local AsyncHazards *t_hazards = nullptr;
+
+    struct AsyncHazardsRelease
+    {
+        ~AsyncHazardsRelease()
+        {
+            if (t_hazards)
+            {
+                t_hazards->used.store(false, std::memory_order_release);
+                t_hazards = nullptr;
+            }
+        }
+    };
+
+    AsyncHazards *AsyncHazards::Acquire()
+    {
+        for (AsyncHazards *h = s_hazards.load(std::memory_order_acquire); h; h = h->next)
+        {
+            if (!h->used.load(std::memory_order_relaxed) && !h->used.exchange(true, std::memory_order_acquire))
+            {
+                return h;
+            }
+        }
+        AsyncHazards *h = new AsyncHazards;
+        h->used.store(true, std::memory_order_relaxed);
+        h->next = s_hazards.load(std::memory_order_relaxed);
+        while (!s_hazards.compare_exchange_weak(h->next, h, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+        return h;
+    }
+
+    void AsyncHazards::WaitUntilUnused(LogDispatcher *dispatcher)
+    {
+        for (AsyncHazards *h = s_hazards.load(std::memory_order_acquire); h; h = h->next)
+        {
+            for (auto &slot : h->slots)
+            {
+                while (slot.load() == dispatcher) // seq_cst, pairs with the slot store in log()
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    static AsyncHazards *GetThreadHazards()
+    {
+        if (!t_hazards)
+        {
+            t_hazards = AsyncHazards::Acquire();
+            // constructed on the first call only; a thread that logs again from a later
+            // thread_local destructor keeps its second record for good
+            static thread_local AsyncHazardsRelease t_release;
+            (void)t_release;
+        }
+        return t_hazards;
+    }
+
+    void Logger::setAsync(LogDispatcher::ptr val)
+    {
+        LogDispatcher::ptr old;
+        {
+            MutexType::Lock lock(m_mutex);
+            old = m_async;
+            m_async = val;
+            m_asyncFast.store(val.get()); // seq_cst, before the hazard scan below
+        }
+        if (old)
+        {
+            // a log() that published old before the store above is still pushing, one that
+            // published it later sees the new pointer and retries
+            AsyncHazards::WaitUntilUnused(old.get());
+        }
+        // old is released here, if it was the last owner its destructor stops the consumer
+    }
+
+    LogDispatcher::ptr Logger::getAsync()
+    {
+        MutexType::Lock lock(m_mutex);
+        return m_async;
+    }
+
+    void Logger::log(LogLevel level, const LogEvent::ptr event)
+    {
+        if (level >= m_level)
+        {
+            LogDispatcher *async = m_asyncFast.load(std::memory_order_acquire);
+            if (async)
+            {
+                AsyncHazards *hazards = GetThreadHazards();
+                if (hazards->depth < AsyncHazards::SLOTS)
+                {
+                    std::atomic<LogDispatcher *> &slot = hazards->slots[hazards->depth];
+                    LogDispatcher *seen;
+                    do
+                    {
+                        seen = async;
+                        slot.store(seen); // seq_cst, ordered before the reload
+                        async = m_asyncFast.load();
+                    } while (async != seen);
+                    if (async)
+                    {
+                        ++hazards->depth;
+                        async->push(*this, level, event); // consumer thread calls dispatch()
+                        --hazards->depth;
+                        slot.store(nullptr, std::memory_order_release);
+                        return;
+                    }
+                    slot.store(nullptr, std::memory_order_release); // switched back to synchronous
+                }
+            }
+            dispatch(level, event);
+            if (level == LogLevel::FATAL)
+            {
+                flushAppenders();
+            }
+        }
+    }
+
+    void Logger::dispatch(LogLevel level, const LogEvent::ptr event)
+    {
+        dispatchFrom(shared_from_this(), level, event);
+    }
+
+    void Logger::dispatchFrom(const Logger::ptr &origin, LogLevel level, const LogEvent::ptr &event)
+    {
+        std::shared_ptr<const std::vector<LogAppender::ptr>> appenders;
+        {
+            MutexType::Lock lock(m_mutex);
+            appenders = m_appenders;
+        }
+        // outside the spinlock: an appender may block on I/O, or log through this logger itself
+        if (appenders && !appenders->empty())
+        {
+            for (auto &appender : *appenders)
+            {
+                appender->log(origin, level, event); // delegate the call to appender's function
+            }
+            return;
+        }
+        // no appenders of our own: the parent's write it, still under our name
+        if (m_root)
+        {
+            m_root->dispatchFrom(origin, level, event);
+        }
+    }
+
+    void Logger::flushAppenders()
+    {
+        std::shared_ptr<const std::vector<LogAppender::ptr>> appenders;
+        {
+            MutexType::Lock lock(m_mutex);
+            appenders = m_appenders;
+        }
+        if (appenders && !appenders->empty())
+        {
+            for (auto &appender : *appenders)
+            {
+                appender->flush();
+            }
+            return;
+        }
+        if (m_root)
+        {
+            m_root->flushAppenders();
+        }
+    }
+
+    void Logger::setLevel(LogLevel val)
+    {
+        std::vector<Logger *> children;
+        {
+            MutexType::Lock lock(m_mutex);
+            m_levelSet = true;
+            m_level.store(val, std::memory_order_relaxed);
+            children = m_children;
+        }
+        for (auto child : children)
+        {
+            child->inheritLevel(val);
+        }
+    }
+
+    void Logger::resetLevel()
+    {
+        {
+            MutexType::Lock lock(m_mutex);
+            m_levelSet = false;
+        }
+        if (m_root)
+        {
+            inheritLevel(m_root->getLevel());
+        }
+    }
+
+    void Logger::inheritLevel(LogLevel val)
+    {
+        std::vector<Logger *> children;
+        {
+            MutexType::Lock lock(m_mutex);
+            if (m_levelSet)
+            {
+                return; // our own level shadows the parent's for the whole subtree
+            }
+            m_level.store(val, std::memory_order_relaxed);
+            children = m_children;
+        }
+        for (auto child : children)
+        {
+            child->inheritLevel(val);
+        }
+    }
+
+    void Logger::addChild(Logger *child)
+    {
+        // under our lock so a concurrent setLevel() either sees the child or runs before it copies our level
+        MutexType::Lock lock(m_mutex);
+        m_children.push_back(child);
+        child->m_level.store(m_level.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    void Logger::info(LogEvent::ptr event)
+    {
+        log(LogLevel::INFO, event);
+    }
+
+    void Logger::debug(LogEvent::ptr event)
+    {
+        log(LogLevel::DEBUG, event);
+    }
+
+    void Logger::warn(LogEvent::ptr event)
+    {
+        log(LogLevel::WARN, event);
+    }
+
+    void Logger::fatal(LogEvent::ptr event)
+    {
+        log(LogLevel::FATAL, event);
+    }
+
+    LoggerManager::LoggerManager()
+    {
+        m_tables.emplace_back(new Table(64));
+        m_table.store(m_tables.back().get(), std::memory_order_release);
+
+        MutexType::Lock lock(m_mutex);
+        m_root = create("root");
+        m_root->setLevel(LogLevel::DEBUG);
+        m_root->addAppender(LogAppender::ptr(new StdoutLogAppender));
+    }
+
+    Logger::ptr LoggerManager::lookup(std::string_view name) const
+    {
+        const Table *table = m_table.load(std::memory_order_acquire);
+        size_t i = std::hash<std::string_view>()(name) & table->mask;
+        while (true)
+        {
+            const Entry *entry = table->slots[i].load(std::memory_order_acquire);
+            if (!entry)
+            {
+                return nullptr;
+            }
+            if (entry->name == name)
+            {
+                return entry->logger;
+            }
+            i = (i + 1) & table->mask;
+        }
+    }
+
+    Logger::ptr LoggerManager::getLogger(std::string_view name)
+    {
+        Logger::ptr logger = lookup(name);
+        if (logger)
+        {
+            return logger;
+        }
+        MutexType::Lock lock(m_mutex);
+        return create(name);
+    }
+
+    Logger::ptr LoggerManager::create(std::string_view name)
+    {
+        Logger::ptr logger = lookup(name);
+        if (logger)
+        {
+            return logger; // created by another thread while we waited for the lock
+        }
+        logger.reset(new Logger(std::string(name)));
+        if (m_root)
+        {
+            size_t dot = name.rfind('.');
+            Logger::ptr parent = dot == std::string_view::npos ? m_root : create(name.substr(0, dot));
+            logger->m_root = parent;
+            parent->addChild(logger.get());
+        }
+
+        Table *table = m_table.load(std::memory_order_relaxed);
+        if ((m_count + 1) * 2 > table->mask + 1)
+        {
+            // keep the load factor under 1/2; readers still on the old table find every
+            // name that existed when they loaded it
+            Table *bigger = new Table((table->mask + 1) * 2);
+            for (size_t i = 0; i <= table->mask; ++i)
+            {
+                Entry *entry = table->slots[i].load(std::memory_order_relaxed);
+                if (entry)
+                {
+                    Place(bigger, entry);
+                }
+            }
+            m_tables.emplace_back(bigger);
+            m_table.store(bigger, std::memory_order_release);
+            table = bigger;
+        }
+        m_entries.emplace_back(new Entry{std::string(name), logger});
+        Place(table, m_entries.back().get());
+        ++m_count;
+        return logger;
+    }
+
+    void LoggerManager::Place(Table *table, Entry *entry)
+    {
+        size_t i = std::hash<std::string_view>()(entry->name) & table->mask;
+        while (table->slots[i].load(std::memory_order_relaxed))
+        {
+            i = (i + 1) & table->mask;
+        }
+        // release: a reader that sees the pointer sees a fully built entry
+        table->slots[i].store(entry, std::memory_order_release);
+    }
+
+    // Every LogLimiter ever constructed; they are static locals of call sites and never go away
+    static std::atomic<LogLimiter *> s_limiters{nullptr};
+
+    LogLimiter::LogLimiter(const char *file, int line, uint32_t every_n, double rate, uint32_t burst,
+                           uint32_t summary_interval_ms)
+        : m_file(file), m_line(line), m_everyN(every_n), m_interval(0), m_tolerance(0),
+          m_summaryInterval(summary_interval_ms)
+    {
+        if (rate > 0)
+        {
+            m_interval = std::max<uint64_t>(1, (uint64_t)(1000000 / rate));
+            m_tolerance = (burst ? burst - 1 : 0) * m_interval;
+        }
+        m_lastReport.store(GetElapsedMS(), std::memory_order_relaxed);
+        m_next = s_limiters.load(std::memory_order_relaxed);
+        while (!s_limiters.compare_exchange_weak(m_next, this, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    bool LogLimiter::take()
+    {
+        // the coarse millisecond clock is enough: m_tat advances by m_interval per record
+        // regardless, the clock only decides how far the bucket has refilled
+        uint64_t now = GetElapsedMS() * 1000;
+        uint64_t tat = m_tat.load(std::memory_order_relaxed);
+        while (true)
+        {
+            if (tat > now + m_tolerance)
+            {
+                return false;
+            }
+            uint64_t next = std::max(tat, now) + m_interval;
+            if (m_tat.compare_exchange_weak(tat, next, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+    }
+
+    void LogLimiter::report(const std::shared_ptr<Logger> &logger, LogLevel level, bool force)
+    {
+        if (!m_pending.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        uint64_t now = GetElapsedMS();
+        uint64_t last = m_lastReport.load(std::memory_order_relaxed);
+        if (!force && now - last < m_summaryInterval)
+        {
+            return;
+        }
+        // one thread wins the report for this interval
+        if (!m_lastReport.compare_exchange_strong(last, now, std::memory_order_relaxed))
+        {
+            return;
+        }
+        uint64_t n = m_pending.exchange(0, std::memory_order_relaxed);
+        if (!n)
+        {
+            return;
+        }
+        char buf[128];
+        int len = snprintf(buf, sizeof(buf), "suppressed %llu records from this call site in the last %llu ms",
+                           (unsigned long long)n, (unsigned long long)(now - last));
+        LogEvent::ptr event = LogEvent::Create(m_file, m_line, now, GetThreadId(), GetFiberId(), time(0));
+        event->setContent(buf, len);
+        logger->log(level, event);
+    }
+
+    void LogLimiter::ReportAll(const std::shared_ptr<Logger> &logger, LogLevel level)
+    {
+        for (LogLimiter *l = s_limiters.load(std::memory_order_acquire); l; l = l->m_next)
+        {
+            l->report(logger, level, true);
+        }
+    }
+
+    LogAppender::~LogAppender()
+    {
+    }
+
+    void LogAppender::setFormatter(LogFormatter::ptr val)
+    {
+        MutexType::Lock lock(m_mutex);
+        m_formatter = val;
+    }
+
+    LogFormatter::ptr LogAppender::getFormatter()
+    {
+        MutexType::Lock lock(m_mutex);
+        return m_formatter;
+    }
+
+    std::string_view LogAppender::formatRecord(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event)
+    {
+        LogBuffer &buf = LogBuffer::GetThreadLocal();
+        buf.clear();
+        getFormatter()->format(buf, logger, level, event);
+        return buf.view();
+    }
+
+    BufferedLogAppender::~BufferedLogAppender()
+    {
+        Mutex::Lock lock(m_writeMutex);
+        writeOut(nullptr, 0);
+    }
+
+    void BufferedLogAppender::setFlushPolicy(size_t flush_size, uint32_t max_age_ms)
+    {
+        {
+            MutexType::Lock lock(m_mutex);
+            m_flushSize = flush_size;
+            m_maxAge = max_age_ms;
+        }
+        if (!flush_size)
+        {
+            Mutex::Lock lock(m_writeMutex);
+            writeOut(nullptr, 0);
+        }
+    }
+
+    void BufferedLogAppender::log(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event)
+    {
+        if (level >= m_level)
+        {
+            // format outside the lock, only the copy into the batch is serialized
+            std::string_view str = formatRecord(logger, level, event);
+            struct iovec iov = {(void *)str.data(), str.size()};
+            write(&iov, 1);
+        }
+    }
+
+    void BufferedLogAppender::write(const struct iovec *iov, int iovcnt)
+    {
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            len += iov[i].iov_len;
+        }
+        {
+            MutexType::Lock lock(m_mutex);
+            uint64_t now = GetElapsedMS();
+            if (m_pending.empty())
+            {
+                m_pendingSince = now;
+            }
+            if (m_pending.size() + len < m_flushSize && now - m_pendingSince < m_maxAge)
+            {
+                for (int i = 0; i < iovcnt; ++i)
+                {
+                    m_pending.append((const char *)iov[i].iov_base, iov[i].iov_len);
+                }
+                return;
+            }
+        }
+        // the batch is due: write it together with the new records, no need to copy those
+        Mutex::Lock lock(m_writeMutex);
+        writeOut(iov, iovcnt);
+    }
+
+    void BufferedLogAppender::flush()
+    {
+        Mutex::Lock lock(m_writeMutex);
+        writeOut(nullptr, 0);
+    }
+
+    void BufferedLogAppender::writeOut(const struct iovec *iov, int iovcnt)
+    {
+        {
+            // take the batch under the spinlock, a copy of at most flush_size bytes
+            MutexType::Lock lock(m_mutex);
+            m_writing.assign(m_pending.data(), m_pending.size());
+            m_pending.clear();
+        }
+        static const int MAX_IOV = 64;
+        struct iovec vec[MAX_IOV];
+        int cnt = 0;
+        if (!m_writing.empty())
+        {
+            vec[cnt].iov_base = m_writing.data();
+            vec[cnt].iov_len = m_writing.size();
+            ++cnt;
+        }
+        for (int i = 0; i <= iovcnt; ++i)
+        {
+            if (cnt == MAX_IOV || (i == iovcnt && cnt))
+            {
+                struct iovec *cur = vec;
+                int left = cnt;
+                while (left && m_fd >= 0)
+                {
+                    ssize_t n = ::writev(m_fd, cur, left);
+                    if (n < 0)
+                    {
+                        if (errno == EINTR)
+                        {
+                            continue;
+                        }
+                        break; // nowhere to report it, drop the batch
+                    }
+                    m_writes.fetch_add(1, std::memory_order_relaxed);
+                    // partial write: skip what went out and retry the rest
+                    while (left && (size_t)n >= cur->iov_len)
+                    {
+                        n -= cur->iov_len;
+                        ++cur;
+                        --left;
+                    }
+                    if (left)
+                    {
+                        cur->iov_base = (char *)cur->iov_base + n;
+                        cur->iov_len -= n;
+                    }
+                }
+                cnt = 0;
+            }
+            if (i < iovcnt && iov[i].iov_len)
+            {
+                vec[cnt++] = iov[i];
+            }
+        }
+        m_writing.clear();
+    }
+
+    void BufferedLogAppender::appendYaml(std::ostream &os)
+    {
+        os << "level: " << LogLevelToString(m_level) << "\n"
+           << "flush_size: " << m_flushSize << "\n"
+           << "max_age: " << m_maxAge << "\n";
+        if (m_formatter) // m_mutex is held, don't go through getFormatter()
+        {
+            os << "formatter: \"" << m_formatter->getPattern() << "\"\n";
+        }
+    }
+
+    FileLogAppender::FileLogAppender(const std::string &filename) : m_filename(filename)
+    {
+        reopen(); // don't forget the file should be reopened
+    }
+
+    FileLogAppender::~FileLogAppender()
+    {
+        Mutex::Lock lock(m_writeMutex);
+        writeOut(nullptr, 0);
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+            m_fd = -1;
+        }
     }
 
-    void Logger::addAppender(LogAppender::ptr appender)
+    bool FileLogAppender::reopen()
     {
-        m_appenders.push_back(appender);
+        Mutex::Lock lock(m_writeMutex);
+        writeOut(nullptr, 0); // pending records belong to the old file
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+        m_fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        return m_fd >= 0;
     }
 
-    void Logger::delAppender(LogAppender::ptr appender)
+    std::string FileLogAppender::toYamlString()
+    {
+        std::stringstream ss;
+        ss << "type: FileLogAppender\n"
+           << "file: " << m_filename << "\n";
+        MutexType::Lock lock(m_mutex);
+        appendYaml(ss);
+        return ss.str();
+    }
+
+    StdoutLogAppender::StdoutLogAppender()
+    {
+        m_fd = STDOUT_FILENO;
+    }
+
+    std::string StdoutLogAppender::toYamlString()
+    {
+        std::stringstream ss;
+        ss << "type: StdoutLogAppender\n";
+        MutexType::Lock lock(m_mutex);
+        appendYaml(ss);
+        return ss.str();
+    }
+
+    MmapFileLogAppender::MmapFileLogAppender(const std::string &basename, size_t segment_size,
+                                             uint32_t rotate_interval_sec, uint32_t sync_interval_ms)
+        : m_basename(basename), m_segmentSize(segment_size), m_rotateInterval(rotate_interval_sec),
+          m_syncInterval(sync_interval_ms ? sync_interval_ms : 1)
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        m_segmentSize = (m_segmentSize + page - 1) / page * page;
+        if (!m_segmentSize)
+        {
+            m_segmentSize = page;
+        }
+
+        char buf[32];
+        struct tm tm;
+        time_t now = time(0);
+        localtime_r(&now, &tm);
+        strftime(buf, sizeof(buf), "%Y%m%d-%H%M%S", &tm);
+        m_startTime = buf;
+
+        {
+            Mutex::Lock lock(m_rotateMutex);
+            m_current.store(openSegment());
+        }
+        m_thread = std::thread(&MmapFileLogAppender::run, this);
+    }
+
+    MmapFileLogAppender::~MmapFileLogAppender()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_threadMutex);
+            m_stopping = true;
+        }
+        m_wakeThread.notify_one();
+        m_thread.join();
+
+        Mutex::Lock lock(m_rotateMutex);
+        for (auto seg : m_retired)
+        {
+            closeSegment(seg);
+        }
+        m_retired.clear();
+        if (m_current.load())
+        {
+            closeSegment(m_current.load());
+            m_current.store(nullptr);
+        }
+        if (m_next)
+        {
+            // never written, don't leave an empty file behind
+            unlink(m_next->filename.c_str());
+            closeSegment(m_next);
+            m_next = nullptr;
+        }
+    }
+
+    MmapFileLogAppender::Segment *MmapFileLogAppender::openSegment()
     {
-        for (auto it = m_appenders.begin(); it != m_appenders.end(); ++it)
+        Segment *seg = new Segment;
+        seg->size = m_segmentSize;
+        seg->limit.store(m_segmentSize);
+        // O_EXCL so a restart within the same second never clobbers an older segment
+        while (seg->fd < 0)
         {
-            if (*it == appender)
+            seg->filename = m_basename + "." + m_startTime + "." + std::to_string(m_seq++);
+            seg->fd = open(seg->filename.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (seg->fd < 0 && errno != EEXIST)
             {
-                m_appenders.erase(it);
-                break;
+                delete seg;
+                return nullptr;
             }
         }
+        // reserve the blocks up front, writing into a hole could SIGBUS on a full disk
+        if (posix_fallocate(seg->fd, 0, seg->size) != 0 && ftruncate(seg->fd, seg->size) != 0)
+        {
+            close(seg->fd);
+            unlink(seg->filename.c_str());
+            delete seg;
+            return nullptr;
+        }
+        // MAP_POPULATE: fault the pages in here rather than on the first write
+        void *addr = mmap(nullptr, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, seg->fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            close(seg->fd);
+            unlink(seg->filename.c_str());
+            delete seg;
+            return nullptr;
+        }
+        seg->base = (char *)addr;
+        if (m_rotateInterval)
+        {
+            seg->deadline = time(0) + m_rotateInterval;
+        }
+        return seg;
     }
 
-    void Logger::log(LogLevel level, const LogEvent::ptr event)
+    void MmapFileLogAppender::closeSegment(Segment *seg)
     {
-        if (level >= m_level)
+        size_t used = std::min(seg->offset.load(), seg->limit.load());
+        msync(seg->base, seg->size, MS_ASYNC);
+        munmap(seg->base, seg->size);
+        if (ftruncate(seg->fd, used) != 0)
+        {
+            // keep the zero padded tail, readers skip NUL bytes
+        }
+        close(seg->fd);
+        delete seg;
+    }
+
+    MmapFileLogAppender::Segment *MmapFileLogAppender::acquire(uint64_t &epoch)
+    {
+        while (true)
         {
-            for (auto &appender : m_appenders)
+            epoch = m_epoch.load();
+            m_readers[epoch & 1].fetch_add(1);
+            // registered before the epoch moved on: waitForReaders() waits for us, so any
+            // segment read from m_current below stays alive until release()
+            if (m_epoch.load() == epoch)
             {
-                appender->log(level, event); // delegate the call to appender's function
+                Segment *seg = m_current.load();
+                if (!seg)
+                {
+                    release(epoch);
+                }
+                return seg;
             }
+            m_readers[epoch & 1].fetch_sub(1);
         }
     }
 
-    void Logger::info(LogEvent::ptr event)
+    void MmapFileLogAppender::release(uint64_t epoch)
     {
-        log(LogLevel::INFO, event);
+        m_readers[epoch & 1].fetch_sub(1);
     }
 
-    void Logger::debug(LogEvent::ptr event)
+    void MmapFileLogAppender::waitForReaders()
     {
-        log(LogLevel::DEBUG, event);
+        // readers entering from now on can only see segments still in m_current or m_next
+        uint64_t old = m_epoch.fetch_add(1);
+        while (m_readers[old & 1].load() != 0)
+        {
+            std::this_thread::yield();
+        }
     }
 
-    void Logger::warn(LogEvent::ptr event)
+    void MmapFileLogAppender::rotate(Segment *full)
     {
-        log(LogLevel::WARN, event);
+        {
+            Mutex::Lock lock(m_rotateMutex);
+            if (m_current.load() != full)
+            {
+                return; // someone else already switched
+            }
+            Segment *next = m_next ? m_next : openSegment();
+            m_next = nullptr;
+            if (next && m_rotateInterval)
+            {
+                next->deadline = time(0) + m_rotateInterval;
+            }
+            m_current.store(next); // nullptr => drop records until the background thread recovers
+            m_retired.push_back(full);
+        }
+        m_wakeThread.notify_one(); // prepare the next segment right away
     }
 
-    void Logger::fatal(LogEvent::ptr event)
+    void MmapFileLogAppender::write(const char *data, size_t len)
     {
-        log(LogLevel::FATAL, event);
+        struct iovec iov = {(void *)data, len};
+        write(&iov, 1);
     }
 
-    FileLogAppender::FileLogAppender(const std::string &filename) : m_filename(filename)
+    void MmapFileLogAppender::write(const struct iovec *iov, int iovcnt)
     {
-        reopen(); // don't forget the file should be reopened
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            len += iov[i].iov_len;
+        }
+        if (len > m_segmentSize)
+        {
+            if (iovcnt > 1)
+            {
+                // too large for one reservation, records may still fit one by one
+                for (int i = 0; i < iovcnt; ++i)
+                {
+                    write(&iov[i], 1);
+                }
+                return;
+            }
+            len = m_segmentSize;
+        }
+        while (true)
+        {
+            uint64_t epoch;
+            Segment *seg = acquire(epoch);
+            if (!seg)
+            {
+                return;
+            }
+            size_t start = seg->offset.fetch_add(len);
+            if (start + len <= seg->size)
+            {
+                // one reservation for the whole batch, then copy every piece into it
+                char *dst = seg->base + start;
+                size_t left = len;
+                for (int i = 0; i < iovcnt && left; ++i)
+                {
+                    size_t n = std::min(iov[i].iov_len, left);
+                    memcpy(dst, iov[i].iov_base, n);
+                    dst += n;
+                    left -= n;
+                }
+                release(epoch);
+                return;
+            }
+            // does not fit: the segment ends at the first failed reservation
+            size_t lim = seg->limit.load();
+            while (start < lim && !seg->limit.compare_exchange_weak(lim, start))
+            {
+            }
+            // still pinned, so seg cannot have been freed and reused for a newer segment
+            rotate(seg);
+            release(epoch);
+        }
     }
 
-    void FileLogAppender::log(LogLevel level, LogEvent::ptr event)
+    void MmapFileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event)
     {
         if (level >= m_level)
         {
-            m_filestream << m_formatter->format(event);
+            std::string_view str = formatRecord(logger, level, event);
+            write(str.data(), str.size());
         }
     }
 
-    bool FileLogAppender::reopen()
+    void MmapFileLogAppender::flush()
     {
-        if (m_filestream)
+        uint64_t epoch;
+        Segment *seg = acquire(epoch);
+        if (seg)
         {
-            m_filestream.close();
+            size_t used = std::min(seg->offset.load(), seg->limit.load());
+            msync(seg->base, used, MS_ASYNC);
+            release(epoch);
         }
-        m_filestream.open(m_filename);
-        !!m_filestream;
     }
 
-    void StdoutLogAppender::log(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event) {
+    std::string MmapFileLogAppender::toYamlString()
     {
-        if (level >= m_level)
+        std::stringstream ss;
+        ss << "type: MmapFileLogAppender\n"
+           << "file: " << m_basename << "\n"
+           << "segment_size: " << m_segmentSize << "\n"
+           << "rotate_interval: " << m_rotateInterval << "\n"
+           << "sync_interval: " << m_syncInterval << "\n"
+           << "level: " << LogLevelToString(m_level) << "\n";
+        auto formatter = getFormatter();
+        if (formatter)
         {
-            m_formatter->format(std::cout, logger, level, event);
+            ss << "formatter: \"" << formatter->getPattern() << "\"\n";
+        }
+        return ss.str();
+    }
+
+    void MmapFileLogAppender::run()
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_threadMutex);
+                m_wakeThread.wait_for(lock, std::chrono::milliseconds(m_syncInterval));
+                if (m_stopping)
+                {
+                    break;
+                }
+            }
+
+            // pre-create the next segment outside the lock, it may take a while
+            bool need_next = false;
+            {
+                Mutex::Lock lock(m_rotateMutex);
+                need_next = !m_next || !m_current.load();
+            }
+            Segment *fresh = need_next ? openSegment() : nullptr;
+
+            std::vector<Segment *> closing;
+            Segment *expired = nullptr;
+            {
+                Mutex::Lock lock(m_rotateMutex);
+                if (fresh)
+                {
+                    if (!m_current.load())
+                    {
+                        m_current.store(fresh);
+                    }
+                    else if (!m_next)
+                    {
+                        m_next = fresh;
+                    }
+                    else
+                    {
+                        m_retired.push_back(fresh);
+                    }
+                }
+                Segment *cur = m_current.load();
+                if (cur && cur->deadline && time(0) >= cur->deadline && cur->offset.load())
+                {
+                    expired = cur;
+                }
+                closing.swap(m_retired);
+            }
+            if (!closing.empty())
+            {
+                // all of them were swapped out of m_current before this point
+                waitForReaders();
+                for (auto seg : closing)
+                {
+                    closeSegment(seg);
+                }
+            }
+            if (expired)
+            {
+                rotate(expired);
+            }
+
+            // write back what was logged since the last round and drop those pages
+            // from our resident set, they stay in the page cache until written
+            uint64_t epoch;
+            Segment *seg = acquire(epoch);
+            if (seg)
+            {
+                size_t used = std::min(seg->offset.load(), seg->limit.load());
+                size_t done = used / page * page; // whole pages, writers may still be in the last one
+                if (done > seg->synced)
+                {
+                    msync(seg->base + seg->synced, done - seg->synced, MS_ASYNC);
+                    madvise(seg->base + seg->synced, done - seg->synced, MADV_DONTNEED);
+                    seg->synced = done;
+                }
+                release(epoch);
+            }
         }
     }
 
+    LogFormatter::LogFormatter(const std::string &pattern) : m_pattern(pattern)
+    {
+        init();
+    }
+
     std::string LogFormatter::format(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event) {
         std::stringstream ss;
         for (const auto &i : m_items)
@@ -95,58 +1338,310 @@ namespace cppserver
         return ss.str();
     }
 
-    // %xxx %xxx(xxx) %%
+    std::ostream &LogFormatter::format(std::ostream &ofs, std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event)
+    {
+        for (const auto &i : m_items)
+        {
+            i->format(ofs, logger, level, event);
+        }
+        return ofs;
+    }
+
+    void LogFormatter::format(LogBuffer &out, std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event)
+    {
+        LogStream *stream = LogStream::Acquire(out);
+        format(*stream, logger, level, event);
+        LogStream::Release(stream);
+    }
+
+    // %x %x{fmt} %%
     void LogFormatter::init()
     {
-        // str, format, type
-        std::vector<std::pair<std::string, int>> vec;
-        std::string str; // store non-token characters
+        // str, format, type (0 => literal, 1 => specifier)
+        std::vector<std::tuple<std::string, std::string, int>> vec;
+        std::string nstr; // store non-token characters
         for (size_t i = 0; i < m_pattern.size(); ++i)
         {
             // regular character: skip
             if (m_pattern[i] != '%')
             {
-                str.append(1, m_pattern[i]);
+                nstr.append(1, m_pattern[i]);
                 continue;
             }
-            size_t n = i + 1;
-            int fmt_status = 0; // 0 => outside bracket, 1 => inside bracket
-            size_t fmt_begin = 0;
-
-            std::string str;
+            if (i + 1 >= m_pattern.size())
+            {
+                // dangling '%' at the end of the pattern
+                vec.push_back(std::make_tuple("<<pattern_error>>", std::string(), 0));
+                has_error = true;
+                break;
+            }
+            if (m_pattern[i + 1] == '%')
+            {
+                nstr.append(1, '%');
+                ++i;
+                continue;
+            }
+            size_t n = i + 2;
+            std::string str = m_pattern.substr(i + 1, 1);
             std::string fmt;
 
-            while (n < m_pattern.size())
+            if (n < m_pattern.size() && m_pattern[n] == '{')
             {
-                if (isspace(m_pattern[n]))
+                // mark as begin of left bracket
+                size_t fmt_end = m_pattern.find('}', n);
+                if (fmt_end == std::string::npos)
                 {
+                    vec.push_back(std::make_tuple("<<pattern_error>>", std::string(), 0));
+                    has_error = true;
                     break;
                 }
+                fmt = m_pattern.substr(n + 1, fmt_end - n - 1);
+                n = fmt_end + 1;
+            }
+
+            if (!nstr.empty())
+            {
+                vec.push_back(std::make_tuple(nstr, std::string(), 0));
+                nstr.clear();
+            }
+            vec.push_back(std::make_tuple(str, fmt, 1));
+            i = n - 1;
+        }
+        if (!nstr.empty())
+        {
+            vec.push_back(std::make_tuple(nstr, std::string(), 0));
+        }
+
+        m_items.clear();
+        for (auto &i : vec)
+        {
+            if (std::get<2>(i) == 0)
+            {
+                m_items.push_back(FormatItem::ptr(new StringFormatItem(std::get<0>(i))));
+                continue;
+            }
+            FormatItem::ptr item = CreateFormatItem(std::get<0>(i)[0], std::get<1>(i));
+            if (!item)
+            {
+                m_items.push_back(FormatItem::ptr(new StringFormatItem("<<error_format %" + std::get<0>(i) + ">>")));
+                has_error = true;
+                continue;
+            }
+            m_items.push_back(item);
+        }
+    }
+
+    // Set by stop() when the dispatcher is being destroyed on its own flusher thread,
+    // run() must not touch the object after that
+    static thread_local bool t_flusherOrphaned = false;
+
+    AsyncLogDispatcher::AsyncLogDispatcher(size_t capacity, uint64_t flush_interval_ms, OverflowPolicy policy)
+        : m_capacity(capacity ? capacity : 1), m_flushInterval(flush_interval_ms), m_policy(policy)
+    {
+        m_front.reserve(m_capacity);
+        m_back.reserve(m_capacity);
+    }
+
+    AsyncLogDispatcher::~AsyncLogDispatcher()
+    {
+        stop();
+    }
+
+    void AsyncLogDispatcher::start()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_running)
+        {
+            return;
+        }
+        m_running = true;
+        m_thread = std::thread(&AsyncLogDispatcher::run, this);
+    }
+
+    void AsyncLogDispatcher::stop()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (!m_running)
+            {
+                return;
+            }
+            m_running = false;
+        }
+        m_wakeFlusher.notify_one();
+        m_notFull.notify_all();
+        if (m_thread.get_id() == std::this_thread::get_id())
+        {
+            // Last reference dropped by run() on the flusher itself, see there
+            m_thread.detach();
+            t_flusherOrphaned = true;
+        }
+        else if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    }
+
+    uint64_t AsyncLogDispatcher::getDropped() const
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_dropped;
+    }
+
+    bool AsyncLogDispatcher::isRunning() const
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_running;
+    }
+
+    bool AsyncLogDispatcher::push(Logger &logger, LogLevel level, LogEvent::ptr event)
+    {
+        uint64_t seq = 0;
+        bool wake = false;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_running && m_front.size() >= m_capacity)
+            {
+                if (m_policy != BLOCK && level != LogLevel::FATAL)
+                {
+                    ++m_dropped;
+                    return false;
+                }
+                m_wakeFlusher.notify_one();
+                m_notFull.wait(lock, [this]()
+                               { return m_front.size() < m_capacity || !m_running; });
+            }
+            if (m_running)
+            {
+                m_front.push_back(Record{logger.shared_from_this(), level, event});
+                seq = ++m_pushed;
+                if (level == LogLevel::FATAL)
+                {
+                    m_flushRequested = seq;
+                    wake = true;
+                }
+                else
+                {
+                    wake = m_front.size() == m_capacity / 2 + 1;
+                }
+            }
+        }
+        if (seq == 0)
+        {
+            // not running: fall back to writing on the caller's thread
+            logger.dispatch(level, event);
+            if (level == LogLevel::FATAL)
+            {
+                logger.flushAppenders();
+            }
+            return true;
+        }
+        if (wake)
+        {
+            m_wakeFlusher.notify_one();
+        }
+        if (level == LogLevel::FATAL)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_flushed.wait(lock, [this, seq]()
+                           { return m_written >= seq; });
+        }
+        return true;
+    }
+
+    void AsyncLogDispatcher::flush()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        uint64_t target = m_pushed;
+        if (m_written >= target)
+        {
+            return;
+        }
+        if (m_flushRequested < target)
+        {
+            m_flushRequested = target;
+        }
+        m_wakeFlusher.notify_one();
+        m_flushed.wait(lock, [this, target]()
+                       { return m_written >= target; });
+    }
+
+    void AsyncLogDispatcher::run()
+    {
+        while (true)
+        {
+            uint64_t target = 0;
+            uint64_t dropped = 0;
+            bool running = true;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wakeFlusher.wait_for(lock, std::chrono::milliseconds(m_flushInterval), [this]()
+                                       { return !m_running || m_front.size() > m_capacity / 2 || m_flushRequested > m_written; });
+                m_back.swap(m_front); // m_back is always empty here
+                target = m_pushed;
+                dropped = m_dropped - m_droppedReported;
+                m_droppedReported = m_dropped;
+                running = m_running;
+            }
+            m_notFull.notify_all();
+
+            // Releasing the batch may drop the last reference to a logger, and that logger the
+            // last one to us: pin ourselves until the batch is gone and the iteration is done
+            std::shared_ptr<AsyncLogDispatcher> self;
+            if (!m_back.empty())
+            {
+                self = weak_from_this().lock();
+                writeBatch(m_back, m_policy == DROP_REPORT ? dropped : 0);
+                m_back.clear(); // keeps capacity, so steady state does not allocate
+            }
+
+            bool done = false;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_written = target;
+                // push() stops accepting once m_running is false, so the front buffer is final
+                done = !running && m_front.empty();
+            }
+            m_flushed.notify_all();
 
-                if (fmt_status == 0)
+            // may run the destructor right here, which detaches this thread
+            self.reset();
+            if (done || t_flusherOrphaned)
+            {
+                return;
+            }
+        }
+    }
+
+    void AsyncLogDispatcher::writeBatch(std::vector<Record> &batch, uint64_t dropped)
+    {
+        std::vector<Logger *> loggers; // distinct loggers in this batch, usually one
+        for (auto &rec : batch)
+        {
+            rec.logger->dispatch(rec.level, rec.event);
+            if (loggers.empty() || loggers.back() != rec.logger.get())
+            {
+                bool seen = false;
+                for (auto l : loggers)
                 {
-                    if (m_pattern[n] == '{')
-                    {
-                        // mark as begin of left bracket
-                        str = m_pattern.substr(i + 1, n - i - 1);
-                        fmt_status = 1; // parse format
-                        fmt_begin = n;
-                        ++n;
-                        continue;
-                    }
+                    seen = seen || l == rec.logger.get();
                 }
-                if (fmt_status == 1)
+                if (!seen)
                 {
-                    if (m_pattern[n] == '}')
-                    {
-                        // mark as end of right bracket
-                        fmt = m_pattern.substr(fmt_begin + 1, n - fmt_begin - 1);
-                        fmt_status = 2;
-                        ++n;
-                        continue;
-                    }
+                    loggers.push_back(rec.logger.get());
                 }
             }
         }
+        if (dropped)
+        {
+            LogEvent::ptr event(new LogEvent(__FILE__, __LINE__, 0, 0, 0, time(0)));
+            event->setContent("AsyncLogDispatcher dropped " + std::to_string(dropped) + " log records");
+            batch.back().logger->dispatch(LogLevel::WARN, event);
+        }
+        // one flush per appender per batch instead of one per record
+        for (auto l : loggers)
+        {
+            l->flushAppenders();
+        }
     }
 }
@@ -5,14 +5,30 @@
 #include <string>
 #include <list>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <vector>
 #include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <streambuf>
+#include <string_view>
+#include <sys/uio.h>
+
+#include "mutex.h"
+#include "singleton.h"
 
 namespace cppserver
 {
+    class Logger;
+    class LogAppender;
+    class LogDispatcher;
+
     enum LogLevel
     {
         DEBUG = 1,
@@ -22,12 +38,171 @@ namespace cppserver
         FATAL = 5
     };
 
+    const char *LogLevelToString(LogLevel level);
+
+    // Growable char buffer with inline storage for the common short record.
+    // Used for event content and formatter output so a log call does not allocate.
+    class LogBuffer : Noncopyable
+    {
+    public:
+        static const size_t INLINE_SIZE = 256;
+        static const size_t MAX_RETAIN = 64 * 1024; // clear() gives back heap storage above this
+
+        LogBuffer() {}
+        ~LogBuffer()
+        {
+            if (m_data != m_inline)
+            {
+                free(m_data);
+            }
+        }
+
+        const char *data() const { return m_data; }
+        char *data() { return m_data; }
+        size_t size() const { return m_size; }
+        size_t capacity() const { return m_capacity; }
+        bool empty() const { return m_size == 0; }
+        std::string_view view() const { return std::string_view(m_data, m_size); }
+
+        void clear()
+        {
+            m_size = 0;
+            if (m_capacity > MAX_RETAIN)
+            {
+                free(m_data);
+                m_data = m_inline;
+                m_capacity = INLINE_SIZE;
+            }
+        }
+        void append(const char *str, size_t len)
+        {
+            if (m_size + len > m_capacity)
+            {
+                grow(m_size + len);
+            }
+            memcpy(m_data + m_size, str, len);
+            m_size += len;
+        }
+        void append(std::string_view str) { append(str.data(), str.size()); }
+        void append(char c) { append(&c, 1); }
+        void assign(const char *str, size_t len)
+        {
+            m_size = 0;
+            append(str, len);
+        }
+
+        // Direct writes: ensure `len` free bytes, write at tail(), then commit() what was used
+        char *reserveTail(size_t len)
+        {
+            if (m_size + len > m_capacity)
+            {
+                grow(m_size + len);
+            }
+            return m_data + m_size;
+        }
+        void commit(size_t len) { m_size += len; }
+
+        // Per-thread buffer for formatter output, see LogAppender::formatRecord
+        static LogBuffer &GetThreadLocal();
+
+    private:
+        void grow(size_t need);
+
+    private:
+        char *m_data = m_inline;
+        size_t m_size = 0;
+        size_t m_capacity = INLINE_SIZE;
+        char m_inline[INLINE_SIZE];
+    };
+
+    // std::ostream over a LogBuffer. Constructing a stream copies the global locale (an atomic
+    // refcount shared by every thread), so streams are pooled per thread and only re-pointed.
+    class LogStream : public std::ostream
+    {
+    public:
+        // Take a stream from the calling thread's pool; nested logging gets its own stream
+        static LogStream *Acquire(LogBuffer &buf);
+        static void Release(LogStream *stream);
+
+    private:
+        class StreamBuf : public std::streambuf
+        {
+        public:
+            LogBuffer *m_buf = nullptr;
+
+        protected:
+            int_type overflow(int_type c) override
+            {
+                if (c != traits_type::eof())
+                {
+                    m_buf->append((char)c);
+                }
+                return c;
+            }
+            std::streamsize xsputn(const char *s, std::streamsize n) override
+            {
+                m_buf->append(s, n);
+                return n;
+            }
+        };
+
+        LogStream() : std::ostream(&m_streambuf) {}
+
+    private:
+        StreamBuf m_streambuf;
+    };
+
     // Each LogEvent represents one log
-    class LogEvent
+    class LogEvent : Noncopyable
     {
     public:
         typedef std::shared_ptr<LogEvent> ptr;
-        LogEvent();
+        LogEvent(const char *file = nullptr, int line = 0, unsigned int elapse = 0,
+                 unsigned int thread_id = 0, unsigned int fiber_id = 0, time_t time = 0);
+
+        // Event for a new record. Reuses the calling thread's previous event (and the
+        // storage of its content) unless something, e.g. an async dispatcher, still holds it.
+        static LogEvent::ptr Create(const char *file, int line, unsigned int elapse,
+                                    unsigned int thread_id, unsigned int fiber_id, time_t time);
+
+        const char *getFile() const { return m_file; }
+        int getLine() const { return m_line; }
+        unsigned int getElapse() const { return m_elapse; }
+        unsigned int getThreadId() const { return m_threadId; }
+        unsigned int getFiberId() const { return m_fiberId; }
+        time_t getTime() const { return m_time; }
+        // Content is rendered from the format arguments on first use when the event was
+        // built with SetLogArgs (log_binary.h)
+        std::string_view getContent() const
+        {
+            if (m_format && m_content.empty())
+            {
+                renderContent();
+            }
+            return m_content.view();
+        }
+        LogBuffer &getContentBuffer() { return m_content; }
+        void setContent(std::string_view val) { m_content.assign(val.data(), val.size()); }
+        void setContent(const char *str, size_t len) { m_content.assign(str, len); }
+        // printf-style format (static storage) and its arguments, encoded by EncodeLogArgs
+        const char *getFormat() const { return m_format; }
+        void setFormat(const char *fmt) { m_format = fmt; }
+        const std::string &getArgs() const { return m_args; }
+        std::string &getArgs() { return m_args; }
+        // Refill every field so one event can be reused across records without reallocating
+        void reset(const char *file, int line, unsigned int elapse,
+                   unsigned int thread_id, unsigned int fiber_id, time_t time)
+        {
+            m_file = file;
+            m_line = line;
+            m_elapse = elapse;
+            m_threadId = thread_id;
+            m_fiberId = fiber_id;
+            m_time = time;
+            m_content.clear();
+            m_format = nullptr;
+            m_args.clear();
+        }
 
     private:
         const char *m_file = nullptr; // filename
@@ -36,39 +211,11 @@ namespace cppserver
         unsigned int m_threadId = 0;  // thread no.
         unsigned int m_fiberId = 0;   // fiber no.
         time_t m_time = 0;            // timestamp
-        std::string m_content;        //
-    };
-
-    // 日志器
-    class Logger
-    {
-    public:
-        typedef Spinlock MutexType;
-        typedef std::shared_ptr<Logger> ptr;
-        Logger(const std::string &name = "root");
-        void log(LogLevel level, const LogEvent::ptr event);
-        void info(LogEvent::ptr event);
-        void debug(LogEvent::ptr event);
-        void warn(LogEvent::ptr event);
-        void fatal(LogEvent::ptr event);
-        void addAppender(LogAppender::ptr appender);
-        void delAppender(LogAppender::ptr appender);
-        void clearAppenders(); // remove all appenders
-        LogLevel getLevel() const { return m_level; }
-        void setLevel(LogLevel val) { m_level = val; }
-        const std::string& getName() const { return m_name; }
-        void setFormatter(LogFormatter::ptr val);
-        void setFormatter(const std::string& val);
-        LogFormatter::ptr getFormatter();
-        std::string toYamlString();
+        mutable LogBuffer m_content;    //
+        const char *m_format = nullptr; // format of a structured event, nullptr => m_content only
+        std::string m_args;             // encoded format arguments
 
-    private:
-        std::string m_name;                      // name of logger
-        LogLevel m_level;                        // NOTE: logs will be filtered based on logger m_level
-        MutexType m_mutex;
-        std::list<LogAppender::ptr> m_appenders; // collection of log output destinations, single log can be outputted to multiple destinations
-        LogFormatter::ptr m_formatter;
-        Logger::ptr m_root;
+        void renderContent() const;
     };
 
     class LogFormatter
@@ -76,7 +223,12 @@ namespace cppserver
     public:
         typedef std::shared_ptr<LogFormatter> ptr;
         LogFormatter(const std::string &pattern);
-        std::string format(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event);
+        virtual ~LogFormatter() {}
+        // Overridden by StaticLogFormatter (log_pattern.h) for patterns known at compile time
+        virtual std::string format(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event);
+        virtual std::ostream &format(std::ostream &ofs, std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event);
+        // Append the record to `out`, no allocation once `out` has grown to the record size
+        virtual void format(LogBuffer &out, std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event);
 
     public:
         // submodule for log formats
@@ -95,6 +247,14 @@ namespace cppserver
 
         const std::string getPattern() const { return m_pattern; }
 
+    protected:
+        struct Unparsed
+        {
+        };
+        // Keep the pattern for getPattern() without building m_items, for subclasses that
+        // override every format()
+        LogFormatter(const std::string &pattern, Unparsed) : m_pattern(pattern) {}
+
     private:
         std::string m_pattern;
         std::vector<FormatItem::ptr> m_items; // FormatItem parsed from m_pattern
@@ -106,12 +266,18 @@ namespace cppserver
     {
     public:
         typedef std::shared_ptr<LogAppender> ptr;
+        typedef Spinlock MutexType;
         // Deleting a derived class object using a pointer of base class type that has a non-virtual destructor
         // results in undefined behavior. To correct this situation,
         // the base class should be defined with a virtual destructor.
         // https://www.geeksforgeeks.org/virtual-destructor/#
         virtual ~LogAppender();
         virtual void log(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event) = 0;
+        // Write already formatted records, one per iovec entry. Text appenders implement
+        // log() as formatRecord() + write().
+        virtual void write(const struct iovec *iov, int iovcnt) {}
+        // Push buffered output to the destination. Called once per batch by AsyncLogDispatcher.
+        virtual void flush() {}
         virtual std::string toYamlString() = 0;
         void setFormatter(LogFormatter::ptr val);
         LogFormatter::ptr getFormatter();
@@ -119,37 +285,535 @@ namespace cppserver
         void setLevel(LogLevel val) { m_level = val; }
 
     protected:
-        LogLevel m_level;
+        // Format into the calling thread's LogBuffer, valid until the next formatRecord() on this thread
+        std::string_view formatRecord(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event);
+
+    protected:
+        LogLevel m_level = LogLevel::DEBUG;
+        MutexType m_mutex;
+        LogFormatter::ptr m_formatter;
+    };
+
+    // Transport between a Logger and its appenders when logging asynchronously, see Logger::setAsync.
+    // Implementations: AsyncLogDispatcher (below), RingLogDispatcher (log_ring.h)
+    class LogDispatcher : Noncopyable
+    {
+    public:
+        typedef std::shared_ptr<LogDispatcher> ptr;
+
+        // What push() does when the dispatcher is full
+        enum OverflowPolicy
+        {
+            BLOCK = 0,      // wait for the consumer to drain
+            DROP = 1,       // discard the record silently
+            DROP_REPORT = 2 // discard the record, consumer logs a WARN with the number of drops
+        };
+
+        virtual ~LogDispatcher() {}
+        virtual void start() = 0;
+        // Stop the consumer after writing out pending records
+        virtual void stop() = 0;
+        // Queue a record. Returns false if it was dropped due to overflow.
+        // FATAL records are always waited for, i.e. they are flushed when push() returns.
+        virtual bool push(Logger &logger, LogLevel level, LogEvent::ptr event) = 0;
+        // Block until every record pushed before this call has been written and flushed
+        virtual void flush() = 0;
+    };
+
+    // 日志器
+    class Logger : public std::enable_shared_from_this<Logger>
+    {
+    public:
+        typedef Spinlock MutexType;
+        typedef std::shared_ptr<Logger> ptr;
+        Logger(const std::string &name = "root");
+        void log(LogLevel level, const LogEvent::ptr event);
+        void info(LogEvent::ptr event);
+        void debug(LogEvent::ptr event);
+        void warn(LogEvent::ptr event);
+        void fatal(LogEvent::ptr event);
+        void addAppender(LogAppender::ptr appender);
+        void delAppender(LogAppender::ptr appender);
+        void clearAppenders(); // remove all appenders
+        // Relaxed: the level is a filter, readers only need to see a change eventually
+        LogLevel getLevel() const { return m_level.load(std::memory_order_relaxed); }
+        // Set an explicit level, passed down to descendants that have none of their own
+        void setLevel(LogLevel val);
+        // Drop the explicit level and follow the parent's again
+        void resetLevel();
+        const std::string& getName() const { return m_name; }
+        // Logger this one inherits its level from and hands events to while it has no
+        // appenders of its own; null for root. Set by LoggerManager, fixed afterwards.
+        Logger::ptr getParent() const { return m_root; }
+        void setFormatter(LogFormatter::ptr val);
+        void setFormatter(const std::string& val);
+        LogFormatter::ptr getFormatter();
+        std::string toYamlString();
+
+        // Route events through an async dispatcher instead of writing on the caller's thread.
+        // Pass nullptr to go back to synchronous logging. Returns once no thread is pushing
+        // into the replaced dispatcher any more; if the logger held its last reference, it is
+        // stopped (writing out what it still has queued) and freed before returning. Must not
+        // be called from an appender, which may be running inside that dispatcher's push().
+        void setAsync(LogDispatcher::ptr val);
+        LogDispatcher::ptr getAsync();
+        // Write one event to every appender on the current thread, bypassing the level check
+        void dispatch(LogLevel level, const LogEvent::ptr event);
+        // Flush every appender
+        void flushAppenders();
+
+    private:
+        friend class LoggerManager;
+        void dispatchFrom(const Logger::ptr &origin, LogLevel level, const LogEvent::ptr &event);
+        void inheritLevel(LogLevel val);
+        void addChild(Logger *child);
+
+    private:
+        std::string m_name;                      // name of logger
+        std::atomic<LogLevel> m_level{LogLevel::DEBUG}; // NOTE: logs will be filtered based on logger m_level
+        MutexType m_mutex;
+        // Log output destinations, a single log can go to several. Copied on every change so
+        // dispatch takes a snapshot under m_mutex and calls the appenders without holding it.
+        std::shared_ptr<const std::vector<LogAppender::ptr>> m_appenders;
         LogFormatter::ptr m_formatter;
+        Logger::ptr m_root;                      // parent
+        std::vector<Logger *> m_children;        // kept alive by LoggerManager
+        bool m_levelSet = false;                 // m_level was set explicitly, not inherited
+        LogDispatcher::ptr m_async;                  // null => synchronous
+        std::atomic<LogDispatcher *> m_asyncFast{nullptr}; // m_async read by log() without taking m_mutex, see AsyncHazards
+    };
+
+    // Appender writing to a file descriptor. Records are collected in a buffer and written
+    // with one writev() once `flush_size` bytes are pending, on flush(), which the dispatchers
+    // call once per batch, or when a record arrives and the oldest pending one is older than
+    // `max_age_ms`. The age is only checked on that next write; nothing flushes a quiet
+    // appender on a timer, so without a dispatcher or explicit flush() the tail of a burst
+    // stays buffered until more traffic comes. flush_size 0 writes every record through.
+    class BufferedLogAppender : public LogAppender
+    {
+    public:
+        typedef std::shared_ptr<BufferedLogAppender> ptr;
+        ~BufferedLogAppender();
+        void log(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event) override;
+        void write(const struct iovec *iov, int iovcnt) override;
+        void flush() override;
+
+        void setFlushPolicy(size_t flush_size, uint32_t max_age_ms);
+        size_t getFlushSize() const { return m_flushSize; }
+        uint32_t getMaxAge() const { return m_maxAge; }
+        // writev() calls made so far
+        uint64_t getWrites() const { return m_writes.load(std::memory_order_relaxed); }
+
+    protected:
+        // Write out the pending bytes followed by iov. m_writeMutex must be held, m_mutex must not:
+        // the spinlock only guards m_pending, the syscall runs under the blocking mutex.
+        void writeOut(const struct iovec *iov, int iovcnt);
+        // level, formatter and flush policy lines shared by the toYamlString() overrides, m_mutex must be held
+        void appendYaml(std::ostream &os);
+
+    protected:
+        Mutex m_writeMutex; // serializes writeOut() and changes of m_fd, so batches go out in order
+        int m_fd = -1;
+
+    private:
+        LogBuffer m_pending;
+        LogBuffer m_writing; // batch taken from m_pending, under m_writeMutex
+        size_t m_flushSize = 0;
+        uint32_t m_maxAge = 1000;
+        uint64_t m_pendingSince = 0; // GetElapsedMS() when the oldest pending record arrived
+        std::atomic<uint64_t> m_writes{0};
     };
 
     // Output to console
-    class StdoutLogAppender : public LogAppender
+    class StdoutLogAppender : public BufferedLogAppender
     {
     public:
         typedef std::shared_ptr<StdoutLogAppender> ptr;
-        void log(Logger::ptr logger, LogLevel level, LogEvent::ptr event) override; // https://en.cppreference.com/w/cpp/language/override
+        StdoutLogAppender();
         std::string toYamlString() override;
-
-    private:
     };
 
     // Output to single file
-    class FileLogAppender : public LogAppender
+    class FileLogAppender : public BufferedLogAppender
     {
     public:
-        typedef std::shared_ptr<StdoutLogAppender> ptr;
+        typedef std::shared_ptr<FileLogAppender> ptr;
         FileLogAppender(const std::string &filename);
-        void log(Logger::ptr logger, LogLevel level, LogEvent::ptr event) override; // https://en.cppreference.com/w/cpp/language/override
-        bool reopen();                                          // reopen the file, return true if open success, false otherwise
+        ~FileLogAppender();
+        bool reopen(); // reopen the file, return true if open success, false otherwise
         std::string toYamlString() override;
 
     private:
         std::string m_filename;
-        std::ofstream m_filestream;
-        uint64_t m_lastTime = 0;
+    };
+
+    // Output to memory-mapped, pre-allocated segment files that rotate by size and/or time.
+    // log() only formats and memcpys into the mapping (no syscall), so a crashed process
+    // still leaves its records in the page cache. A background thread msyncs and trims written
+    // pages, rotates by time, pre-creates the next segment and closes retired ones.
+    class MmapFileLogAppender : public LogAppender
+    {
+    public:
+        typedef std::shared_ptr<MmapFileLogAppender> ptr;
+        // Segment files are named <basename>.<YYYYmmdd-HHMMSS>.<seq>
+        // rotate_interval_sec: 0 => rotate by size only
+        MmapFileLogAppender(const std::string &basename, size_t segment_size = 64 * 1024 * 1024,
+                            uint32_t rotate_interval_sec = 0, uint32_t sync_interval_ms = 1000);
+        ~MmapFileLogAppender();
+        void log(Logger::ptr logger, LogLevel level, LogEvent::ptr event) override;
+        void write(const struct iovec *iov, int iovcnt) override;
+        void flush() override; // msync(MS_ASYNC) the written part of the current segment
+        std::string toYamlString() override;
+        // Write one already formatted record
+        void write(const char *data, size_t len);
+
+    private:
+        struct Segment
+        {
+            std::string filename;
+            int fd = -1;
+            char *base = nullptr;
+            size_t size = 0;
+            time_t deadline = 0;             // time based rotation, 0 => none
+            std::atomic<size_t> offset{0};   // next byte to reserve, may run past size
+            std::atomic<size_t> limit;       // end of the last record that fit
+            size_t synced = 0;               // background thread only
+        };
+
+        Segment *openSegment();
+        void closeSegment(Segment *seg);
+        // Pin the current segment, nullptr if there is none. Until release(epoch) the segment
+        // is neither unmapped nor freed, even if it is rotated out in the meantime.
+        Segment *acquire(uint64_t &epoch);
+        void release(uint64_t epoch);
+        // Wait until every acquire() that may still see a segment retired before now has released
+        void waitForReaders();
+        void rotate(Segment *full);
+        void run();
+
+    private:
+        std::string m_basename;
+        size_t m_segmentSize;
+        uint32_t m_rotateInterval;
+        uint32_t m_syncInterval;
+        std::string m_startTime; // part of every segment name
+        uint64_t m_seq = 0;      // guarded by m_rotateMutex
+
+        std::atomic<Segment *> m_current{nullptr};
+        Mutex m_rotateMutex;
+        Segment *m_next = nullptr;        // pre-created segment, guarded by m_rotateMutex
+        std::vector<Segment *> m_retired; // waiting for writers to leave, guarded by m_rotateMutex
+        // Epoch based reclamation: writers count themselves in the slot of the epoch they entered,
+        // retired segments are freed once the epoch was advanced and its old slot drained
+        std::atomic<uint64_t> m_epoch{0};
+        std::atomic<int> m_readers[2] = {0, 0};
+
+        std::mutex m_threadMutex;
+        std::condition_variable m_wakeThread;
+        bool m_stopping = false;
+        std::thread m_thread;
+    };
+
+    // Double-buffered async backend for Logger.
+    // Producers append records to the front buffer under a short lock; a dedicated flusher
+    // thread swaps it with the back buffer and writes the whole batch to the appenders,
+    // flushing each appender once per batch. Disk stalls only ever block the flusher.
+    // A batch may hold the last reference to a logger and through it to the dispatcher; the
+    // flusher then destroys the dispatcher itself once the batch is out, and the thread exits.
+    class AsyncLogDispatcher : public LogDispatcher, public std::enable_shared_from_this<AsyncLogDispatcher>
+    {
+    public:
+        typedef std::shared_ptr<AsyncLogDispatcher> ptr;
+
+        struct Record
+        {
+            Logger::ptr logger;
+            LogLevel level;
+            LogEvent::ptr event;
+        };
+
+        // capacity: max records buffered before the overflow policy applies
+        // flush_interval_ms: max time a record stays buffered when traffic is light
+        AsyncLogDispatcher(size_t capacity = 8192, uint64_t flush_interval_ms = 1000, OverflowPolicy policy = BLOCK);
+        ~AsyncLogDispatcher(); // stop(), writes out pending records
+
+        void start() override;
+        void stop() override;
+        bool push(Logger &logger, LogLevel level, LogEvent::ptr event) override;
+        void flush() override;
+
+        uint64_t getDropped() const;
+        size_t getCapacity() const { return m_capacity; }
+        uint64_t getFlushInterval() const { return m_flushInterval; }
+        OverflowPolicy getPolicy() const { return m_policy; }
+        bool isRunning() const;
+
+    private:
+        void run();
+        void writeBatch(std::vector<Record> &batch, uint64_t dropped);
+
+    private:
+        size_t m_capacity;
+        uint64_t m_flushInterval;
+        OverflowPolicy m_policy;
+
+        mutable std::mutex m_mutex;
+        std::condition_variable m_wakeFlusher; // signalled when front buffer is half full or on flush()/stop()
+        std::condition_variable m_notFull;     // signalled after the flusher takes the front buffer
+        std::condition_variable m_flushed;     // signalled after every written batch
+
+        std::vector<Record> m_front; // buffer producers write into
+        std::vector<Record> m_back;  // buffer being written by the flusher
+        uint64_t m_pushed = 0;       // sequence of the last record accepted
+        uint64_t m_written = 0;      // sequence of the last record written and flushed
+        uint64_t m_flushRequested = 0;
+        uint64_t m_dropped = 0;         // total records dropped
+        uint64_t m_droppedReported = 0; // drops already covered by a DROP_REPORT warning
+        bool m_running = false;
+        std::thread m_thread;
+    };
+
+    // Registry of named loggers. Names are dot separated: "net.http" inherits from "net",
+    // which inherits from root; missing ancestors are created on the way. Loggers are never
+    // removed, so a returned Logger::ptr stays valid and can be cached.
+    // Lookups take no lock: names live in an open-addressing table of atomic entry pointers that
+    // is only appended to under m_mutex. When it fills up, a copy twice the size is published and
+    // the old one is retired (not freed, a reader may still be probing it); the retired tables add
+    // up to less than the live one.
+    class LoggerManager : Noncopyable
+    {
+    public:
+        typedef Mutex MutexType;
+        LoggerManager();
+
+        // Logger called `name`, created if it does not exist yet
+        Logger::ptr getLogger(std::string_view name);
+        // Logger called `name` or nullptr, never takes a lock or allocates
+        Logger::ptr lookup(std::string_view name) const;
+        Logger::ptr getRoot() const { return m_root; }
+
+    private:
+        struct Entry
+        {
+            std::string name;
+            Logger::ptr logger;
+        };
+        struct Table
+        {
+            Table(size_t size) : mask(size - 1), slots(new std::atomic<Entry *>[size]()) {}
+            size_t mask;
+            std::unique_ptr<std::atomic<Entry *>[]> slots;
+        };
+
+        // m_mutex must be held
+        Logger::ptr create(std::string_view name);
+        static void Place(Table *table, Entry *entry);
+
+    private:
+        MutexType m_mutex;                             // serializes writers
+        std::atomic<Table *> m_table{nullptr};         // current table, read without the lock
+        size_t m_count = 0;                            // entries in the current table
+        std::vector<std::unique_ptr<Table>> m_tables;  // current and retired tables
+        std::vector<std::unique_ptr<Entry>> m_entries; // owns every entry
+        Logger::ptr m_root;
+    };
+
+    typedef Singleton<LoggerManager> LoggerMgr;
+
+    // Per call site sampling and rate limiting, see CPPSERVER_LOG_EVERY_N / CPPSERVER_LOG_RATE.
+    // Records are first sampled 1 in `every_n`, then pass a token bucket of `rate` records per
+    // second holding at most `burst` (GCRA, one CAS per admitted record). What is dropped is
+    // counted and reported as one line from the same call site at most every
+    // `summary_interval_ms`, on the next call after the interval has passed.
+    class LogLimiter : Noncopyable
+    {
+    public:
+        // every_n <= 1 => no sampling, rate == 0 => no rate limit
+        LogLimiter(const char *file, int line, uint32_t every_n, double rate = 0, uint32_t burst = 1,
+                   uint32_t summary_interval_ms = 10000);
+
+        // true if the record should be written; may write the summary line to `logger` first
+        bool allow(const std::shared_ptr<Logger> &logger, LogLevel level)
+        {
+            if (m_everyN > 1 && m_calls.fetch_add(1, std::memory_order_relaxed) % m_everyN)
+            {
+                return suppress(logger, level);
+            }
+            if (m_interval && !take())
+            {
+                return suppress(logger, level);
+            }
+            if (m_pending.load(std::memory_order_relaxed))
+            {
+                report(logger, level, false);
+            }
+            return true;
+        }
+
+        // Suppressed records not reported yet
+        uint64_t getPending() const { return m_pending.load(std::memory_order_relaxed); }
+        // Suppressed records since start
+        uint64_t getSuppressed() const { return m_suppressed.load(std::memory_order_relaxed); }
+        // Write the summary of every call site with pending suppressed records to `logger`,
+        // e.g. from a timer or at shutdown, so quiet sites do not keep their count forever
+        static void ReportAll(const std::shared_ptr<Logger> &logger, LogLevel level = LogLevel::WARN);
+
+    private:
+        bool take();
+        bool suppress(const std::shared_ptr<Logger> &logger, LogLevel level)
+        {
+            m_suppressed.fetch_add(1, std::memory_order_relaxed);
+            m_pending.fetch_add(1, std::memory_order_relaxed);
+            report(logger, level, false);
+            return false;
+        }
+        // force: ignore the summary interval
+        void report(const std::shared_ptr<Logger> &logger, LogLevel level, bool force);
+
+    private:
+        const char *m_file;
+        int m_line;
+        uint32_t m_everyN;
+        uint64_t m_interval;  // microseconds between tokens, 0 => no rate limit
+        uint64_t m_tolerance; // how far ahead of now the bucket may run, (burst - 1) * m_interval
+        uint64_t m_summaryInterval;
+        std::atomic<uint64_t> m_calls{0};
+        std::atomic<uint64_t> m_tat{0}; // GCRA theoretical arrival time of the next record
+        std::atomic<uint64_t> m_pending{0};
+        std::atomic<uint64_t> m_suppressed{0};
+        std::atomic<uint64_t> m_lastReport{0};
+        LogLimiter *m_next = nullptr; // every limiter, for ReportAll
+    };
+
+    template <class... Args>
+    void SetLogArgs(LogEvent &event, const char *fmt, const Args &...args); // log_binary.h
+
+    // Builds the content of one event and hands it to the logger when it goes out of scope,
+    // i.e. at the end of the full expression of a CPPSERVER_LOG_* macro.
+    // The logger is only referenced, a macro call does not touch its refcount.
+    class LogEventWrap
+    {
+    public:
+        LogEventWrap(const Logger::ptr &logger, LogLevel level, LogEvent::ptr event)
+            : m_logger(logger.get()), m_level(level), m_event(event) {}
+        ~LogEventWrap()
+        {
+            if (m_stream)
+            {
+                LogStream::Release(m_stream);
+            }
+            m_logger->log(m_level, m_event);
+        }
+
+        LogEvent::ptr getEvent() const { return m_event; }
+        // Streams straight into the event's content buffer
+        std::ostream &getSS()
+        {
+            if (!m_stream)
+            {
+                m_stream = LogStream::Acquire(m_event->getContentBuffer());
+            }
+            return *m_stream;
+        }
+
+        // printf-style content, arguments are encoded rather than rendered (see SetLogArgs)
+        template <class... Args>
+        void format(const char *fmt, const Args &...args)
+        {
+            SetLogArgs(*m_event, fmt, args...);
+        }
+
+    private:
+        Logger *m_logger;
+        LogLevel m_level;
+        LogEvent::ptr m_event;
+        LogStream *m_stream = nullptr;
     };
 
 } // namespace cppserver
 
+#include "log_binary.h" // defines SetLogArgs used by CPPSERVER_LOG_FMT_*
+#include "util.h"
+
+// Levels below this are compiled out of every CPPSERVER_LOG_* call site,
+// e.g. -DCPPSERVER_LOG_MIN_LEVEL=cppserver::LogLevel::INFO for release builds
+#ifndef CPPSERVER_LOG_MIN_LEVEL
+#define CPPSERVER_LOG_MIN_LEVEL cppserver::LogLevel::DEBUG
+#endif
+
+// Logger by name from LoggerMgr, lock-free once the logger exists
+#define CPPSERVER_LOG_ROOT() cppserver::LoggerMgr::GetInstance()->getRoot()
+#define CPPSERVER_LOG_NAME(name) cppserver::LoggerMgr::GetInstance()->getLogger(name)
+
+// One relaxed load and one well-predicted branch when the level is disabled;
+// no event, stream or argument is evaluated in that case
+#define CPPSERVER_LOG_ENABLED(logger, level) \
+    __builtin_expect((level) >= CPPSERVER_LOG_MIN_LEVEL && (logger)->getLevel() <= (level), 0)
+
+#define CPPSERVER_LOG_EVENT_WRAP(logger, level)                                                  \
+    cppserver::LogEventWrap(logger, level,                                                       \
+                            cppserver::LogEvent::Create(                                         \
+                                __FILE__, __LINE__, cppserver::GetElapsedMS(),                   \
+                                cppserver::GetThreadId(), cppserver::GetFiberId(), time(0)))
+
+// CPPSERVER_LOG_INFO(logger) << "accepted " << fd;
+#define CPPSERVER_LOG_LEVEL(logger, level)        \
+    if (!CPPSERVER_LOG_ENABLED(logger, level)) \
+    {                                             \
+    }                                             \
+    else                                          \
+        CPPSERVER_LOG_EVENT_WRAP(logger, level).getSS()
+
+#define CPPSERVER_LOG_DEBUG(logger) CPPSERVER_LOG_LEVEL(logger, cppserver::LogLevel::DEBUG)
+#define CPPSERVER_LOG_INFO(logger) CPPSERVER_LOG_LEVEL(logger, cppserver::LogLevel::INFO)
+#define CPPSERVER_LOG_WARN(logger) CPPSERVER_LOG_LEVEL(logger, cppserver::LogLevel::WARN)
+#define CPPSERVER_LOG_ERROR(logger) CPPSERVER_LOG_LEVEL(logger, cppserver::LogLevel::ERROR)
+#define CPPSERVER_LOG_FATAL(logger) CPPSERVER_LOG_LEVEL(logger, cppserver::LogLevel::FATAL)
+
+// CPPSERVER_LOG_FMT_INFO(logger, "accepted fd=%d from %s", fd, ip);
+// fmt must be a string literal, it is kept by pointer
+#define CPPSERVER_LOG_FMT_LEVEL(logger, level, fmt, ...) \
+    if (!CPPSERVER_LOG_ENABLED(logger, level))        \
+    {                                                    \
+    }                                                    \
+    else                                                 \
+        CPPSERVER_LOG_EVENT_WRAP(logger, level).format(fmt, ##__VA_ARGS__)
+
+#define CPPSERVER_LOG_FMT_DEBUG(logger, fmt, ...) CPPSERVER_LOG_FMT_LEVEL(logger, cppserver::LogLevel::DEBUG, fmt, ##__VA_ARGS__)
+#define CPPSERVER_LOG_FMT_INFO(logger, fmt, ...) CPPSERVER_LOG_FMT_LEVEL(logger, cppserver::LogLevel::INFO, fmt, ##__VA_ARGS__)
+#define CPPSERVER_LOG_FMT_WARN(logger, fmt, ...) CPPSERVER_LOG_FMT_LEVEL(logger, cppserver::LogLevel::WARN, fmt, ##__VA_ARGS__)
+#define CPPSERVER_LOG_FMT_ERROR(logger, fmt, ...) CPPSERVER_LOG_FMT_LEVEL(logger, cppserver::LogLevel::ERROR, fmt, ##__VA_ARGS__)
+#define CPPSERVER_LOG_FMT_FATAL(logger, fmt, ...) CPPSERVER_LOG_FMT_LEVEL(logger, cppserver::LogLevel::FATAL, fmt, ##__VA_ARGS__)
+
+// Call site with its own LogLimiter; the level check still comes first
+#define CPPSERVER_LOG_LIMITED_IF(logger, level, ...)                                          \
+    if (!CPPSERVER_LOG_ENABLED(logger, level))                                                \
+    {                                                                                         \
+    }                                                                                         \
+    else if (static cppserver::LogLimiter cppserver_log_limiter(__FILE__, __LINE__, __VA_ARGS__); \
+             !cppserver_log_limiter.allow(logger, level))                                     \
+    {                                                                                         \
+    }                                                                                         \
+    else
+
+// CPPSERVER_LOG_EVERY_N(logger, cppserver::LogLevel::WARN, 100) << "bad packet from " << ip;
+// writes one record in 100
+#define CPPSERVER_LOG_EVERY_N(logger, level, n) \
+    CPPSERVER_LOG_LIMITED_IF(logger, level, n)  \
+    CPPSERVER_LOG_EVENT_WRAP(logger, level).getSS()
+
+// CPPSERVER_LOG_RATE(logger, cppserver::LogLevel::WARN, 10, 20) << "rejected " << id;
+// at most 10 records per second on average, bursts of up to 20
+#define CPPSERVER_LOG_RATE(logger, level, per_sec, burst)   \
+    CPPSERVER_LOG_LIMITED_IF(logger, level, 0, per_sec, burst) \
+    CPPSERVER_LOG_EVENT_WRAP(logger, level).getSS()
+
+#define CPPSERVER_LOG_FMT_EVERY_N(logger, level, n, fmt, ...) \
+    CPPSERVER_LOG_LIMITED_IF(logger, level, n)                \
+    CPPSERVER_LOG_EVENT_WRAP(logger, level).format(fmt, ##__VA_ARGS__)
+
+#define CPPSERVER_LOG_FMT_RATE(logger, level, per_sec, burst, fmt, ...) \
+    CPPSERVER_LOG_LIMITED_IF(logger, level, 0, per_sec, burst)          \
+    CPPSERVER_LOG_EVENT_WRAP(logger, level).format(fmt, ##__VA_ARGS__)
+
 #endif
@@ -0,0 +1,421 @@
+#include "log_binary.h"
+#include <stdio.h>
+#include <algorithm>
+
+namespace cppserver
+{
+
+    void PutVarint(std::string &out, uint64_t val)
+    {
+        while (val >= 0x80)
+        {
+            out.push_back((char)(val | 0x80));
+            val >>= 7;
+        }
+        out.push_back((char)val);
+    }
+
+    bool GetVarint(const char *&p, const char *end, uint64_t &val)
+    {
+        val = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7)
+        {
+            uint8_t b = (uint8_t)*p++;
+            val |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Render one conversion. `spec` holds flags/width/precision without the '%',
+    // `conv` is the conversion character.
+    static void RenderOneArg(LogBuffer &out, const std::string &spec, char conv, const char *&p, const char *end)
+    {
+        if (p >= end)
+        {
+            out.append("<missing>");
+            return;
+        }
+        uint8_t tag = (uint8_t)*p++;
+        std::string f = "%" + spec;
+        char buf[128];
+        int n = -1;
+        switch (tag)
+        {
+        case LOG_ARG_INT:
+        case LOG_ARG_UINT:
+        {
+            uint64_t raw = 0;
+            if (!GetVarint(p, end, raw))
+            {
+                out.append("<corrupt>");
+                p = end;
+                return;
+            }
+            int64_t sval = tag == LOG_ARG_INT ? (int64_t)((raw >> 1) ^ (~(raw & 1) + 1)) : (int64_t)raw;
+            uint64_t uval = tag == LOG_ARG_INT ? (uint64_t)sval : raw;
+            switch (conv)
+            {
+            case 'd':
+            case 'i':
+                n = snprintf(buf, sizeof(buf), (f + "lld").c_str(), (long long)sval);
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                n = snprintf(buf, sizeof(buf), (f + "ll" + conv).c_str(), (unsigned long long)uval);
+                break;
+            case 'c':
+                n = snprintf(buf, sizeof(buf), (f + "c").c_str(), (int)sval);
+                break;
+            case 'p':
+                n = snprintf(buf, sizeof(buf), (f + "p").c_str(), (void *)(uintptr_t)uval);
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                n = snprintf(buf, sizeof(buf), (f + conv).c_str(), tag == LOG_ARG_INT ? (double)sval : (double)uval);
+                break;
+            default:
+                n = snprintf(buf, sizeof(buf), tag == LOG_ARG_INT ? "%lld" : "%llu", tag == LOG_ARG_INT ? (long long)sval : (unsigned long long)uval);
+            }
+            break;
+        }
+        case LOG_ARG_DOUBLE:
+        {
+            double d = 0;
+            if (end - p < (ptrdiff_t)sizeof(d))
+            {
+                out.append("<corrupt>");
+                p = end;
+                return;
+            }
+            memcpy(&d, p, sizeof(d));
+            p += sizeof(d);
+            if (strchr("fFeEgGaA", conv))
+            {
+                n = snprintf(buf, sizeof(buf), (f + conv).c_str(), d);
+            }
+            else if (strchr("diuxXoc", conv))
+            {
+                n = snprintf(buf, sizeof(buf), (f + "lld").c_str(), (long long)d);
+            }
+            else
+            {
+                n = snprintf(buf, sizeof(buf), "%g", d);
+            }
+            break;
+        }
+        case LOG_ARG_STRING:
+        {
+            uint64_t len = 0;
+            if (!GetVarint(p, end, len) || (uint64_t)(end - p) < len)
+            {
+                out.append("<corrupt>");
+                p = end;
+                return;
+            }
+            if (spec.empty())
+            {
+                out.append(p, len); // common case, no width/precision
+                p += len;
+                return;
+            }
+            std::string str(p, len);
+            p += len;
+            int need = snprintf(nullptr, 0, (f + "s").c_str(), str.c_str());
+            if (need > 0)
+            {
+                snprintf(out.reserveTail(need + 1), need + 1, (f + "s").c_str(), str.c_str());
+                out.commit(need);
+            }
+            return;
+        }
+        default:
+            out.append("<corrupt>");
+            p = end;
+            return;
+        }
+        if (n > 0)
+        {
+            out.append(buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+        }
+    }
+
+    std::string RenderLogArgs(const char *fmt, const char *args, size_t len)
+    {
+        LogBuffer out;
+        RenderLogArgs(out, fmt, args, len);
+        return std::string(out.data(), out.size());
+    }
+
+    void RenderLogArgs(LogBuffer &out, const char *fmt, const char *args, size_t len)
+    {
+        const char *p = args;
+        const char *end = args + len;
+        for (const char *f = fmt; *f; ++f)
+        {
+            if (*f != '%')
+            {
+                out.append(*f);
+                continue;
+            }
+            if (f[1] == '%')
+            {
+                out.append('%');
+                ++f;
+                continue;
+            }
+            // %[flags][width][.precision][length]conv
+            const char *s = f + 1;
+            std::string spec;
+            while (*s && strchr("-+ #0", *s))
+            {
+                spec.push_back(*s++);
+            }
+            while (*s && ((*s >= '0' && *s <= '9') || *s == '.'))
+            {
+                spec.push_back(*s++);
+            }
+            while (*s && strchr("hlLqjzt", *s))
+            {
+                ++s; // every integer is 64 bits on the wire
+            }
+            if (!*s)
+            {
+                out.append(f); // dangling spec, print as is
+                break;
+            }
+            RenderOneArg(out, spec, *s, p, end);
+            f = s;
+        }
+    }
+
+    void LogEvent::renderContent() const
+    {
+        RenderLogArgs(m_content, m_format, m_args.data(), m_args.size());
+    }
+
+    BinaryLogAppender::BinaryLogAppender(const std::string &filename) : m_filename(filename)
+    {
+        reopen();
+    }
+
+    bool BinaryLogAppender::reopen()
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_filestream)
+        {
+            m_filestream.close();
+        }
+        // a binary file cannot be appended to, the string ids would collide
+        m_filestream.open(m_filename, std::ios::out | std::ios::trunc | std::ios::binary);
+        m_nextId = 0;
+        m_ptrIds.clear();
+        m_nameIds.clear();
+        m_filestream.write(BINARY_LOG_MAGIC, sizeof(BINARY_LOG_MAGIC) - 1);
+        return !!m_filestream;
+    }
+
+    void BinaryLogAppender::defineString(uint32_t id, const char *str, size_t len)
+    {
+        m_buf.clear();
+        m_buf.push_back('S');
+        PutVarint(m_buf, id);
+        PutVarint(m_buf, len);
+        m_buf.append(str, len);
+        m_filestream.write(m_buf.data(), m_buf.size());
+    }
+
+    uint32_t BinaryLogAppender::internPtr(const char *str)
+    {
+        if (!str)
+        {
+            return 0;
+        }
+        auto it = m_ptrIds.find(str);
+        if (it != m_ptrIds.end())
+        {
+            return it->second;
+        }
+        uint32_t id = ++m_nextId;
+        defineString(id, str, strlen(str));
+        m_ptrIds[str] = id;
+        return id;
+    }
+
+    uint32_t BinaryLogAppender::internName(const std::string &str)
+    {
+        auto it = m_nameIds.find(str);
+        if (it != m_nameIds.end())
+        {
+            return it->second;
+        }
+        uint32_t id = ++m_nextId;
+        defineString(id, str.data(), str.size());
+        m_nameIds[str] = id;
+        return id;
+    }
+
+    void BinaryLogAppender::log(Logger::ptr logger, LogLevel level, LogEvent::ptr event)
+    {
+        if (level < m_level)
+        {
+            return;
+        }
+        MutexType::Lock lock(m_mutex);
+        // define strings first, they share m_buf
+        uint32_t file_id = internPtr(event->getFile());
+        uint32_t name_id = internName(logger->getName());
+        uint32_t fmt_id = internPtr(event->getFormat());
+
+        m_buf.clear();
+        m_buf.push_back('E');
+        m_buf.push_back((char)level);
+        PutVarint(m_buf, (uint64_t)event->getTime());
+        PutVarint(m_buf, event->getElapse());
+        PutVarint(m_buf, event->getThreadId());
+        PutVarint(m_buf, event->getFiberId());
+        PutVarint(m_buf, file_id);
+        PutVarint(m_buf, (uint32_t)event->getLine());
+        PutVarint(m_buf, name_id);
+        PutVarint(m_buf, fmt_id);
+        std::string_view payload = fmt_id ? std::string_view(event->getArgs()) : event->getContent();
+        PutVarint(m_buf, payload.size());
+        m_buf.append(payload.data(), payload.size());
+        m_filestream.write(m_buf.data(), m_buf.size());
+    }
+
+    void BinaryLogAppender::flush()
+    {
+        MutexType::Lock lock(m_mutex);
+        m_filestream.flush();
+    }
+
+    std::string BinaryLogAppender::toYamlString()
+    {
+        MutexType::Lock lock(m_mutex);
+        std::stringstream ss;
+        ss << "type: BinaryLogAppender\n"
+           << "file: " << m_filename << "\n"
+           << "level: " << LogLevelToString(m_level) << "\n";
+        return ss.str();
+    }
+
+    BinaryLogReader::BinaryLogReader(std::istream &is) : m_is(is)
+    {
+        char magic[sizeof(BINARY_LOG_MAGIC) - 1];
+        m_is.read(magic, sizeof(magic));
+        m_valid = m_is.gcount() == (std::streamsize)sizeof(magic) && memcmp(magic, BINARY_LOG_MAGIC, sizeof(magic)) == 0;
+    }
+
+    bool BinaryLogReader::readVarint(uint64_t &val)
+    {
+        val = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            int c = m_is.get();
+            if (c == EOF)
+            {
+                return false;
+            }
+            val |= (uint64_t)(c & 0x7f) << shift;
+            if (!(c & 0x80))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool BinaryLogReader::readBytes(std::string &out, uint64_t len)
+    {
+        out.clear();
+        if (len > BINARY_LOG_MAX_RECORD)
+        {
+            return false;
+        }
+        // grow with the data actually read, a corrupt length must not allocate up front
+        static const size_t CHUNK = 64 * 1024;
+        while (out.size() < len)
+        {
+            size_t old = out.size();
+            size_t n = std::min<uint64_t>(CHUNK, len - old);
+            out.resize(old + n);
+            m_is.read(&out[old], n);
+            if ((size_t)m_is.gcount() != n)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool BinaryLogReader::next(Entry &entry)
+    {
+        if (!m_valid)
+        {
+            return false;
+        }
+        while (true)
+        {
+            int type = m_is.get();
+            if (type == 'S')
+            {
+                uint64_t id = 0, len = 0;
+                std::string str;
+                if (!readVarint(id) || !readVarint(len) || !readBytes(str, len))
+                {
+                    m_corrupt = true;
+                    return false;
+                }
+                m_strings[id] = std::move(str);
+                continue;
+            }
+            if (type == EOF)
+            {
+                return false;
+            }
+            if (type != 'E')
+            {
+                m_corrupt = true;
+                return false;
+            }
+
+            int level = m_is.get();
+            uint64_t time = 0, elapse = 0, tid = 0, fid = 0, file_id = 0, line = 0, name_id = 0, fmt_id = 0, len = 0;
+            std::string payload;
+            if (level == EOF || !readVarint(time) || !readVarint(elapse) || !readVarint(tid) || !readVarint(fid) || !readVarint(file_id) || !readVarint(line) || !readVarint(name_id) || !readVarint(fmt_id) || !readVarint(len) || !readBytes(payload, len))
+            {
+                m_corrupt = true;
+                return false;
+            }
+
+            // m_strings nodes are stable, so the event can point into them
+            const char *file = file_id ? m_strings[file_id].c_str() : nullptr;
+            entry.loggerName = m_strings[name_id];
+            entry.level = (LogLevel)level;
+            entry.event.reset(new LogEvent(file, (int)line, (unsigned int)elapse, (unsigned int)tid, (unsigned int)fid, (time_t)time));
+            if (fmt_id)
+            {
+                const std::string &fmt = m_strings[fmt_id];
+                RenderLogArgs(entry.event->getContentBuffer(), fmt.c_str(), payload.data(), payload.size());
+            }
+            else
+            {
+                entry.event->setContent(payload);
+            }
+            return true;
+        }
+    }
+
+} // namespace cppserver
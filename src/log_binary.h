@@ -0,0 +1,169 @@
+#ifndef __CPPSERVER_LOG_BINARY_H__
+#define __CPPSERVER_LOG_BINARY_H__
+#include <stdint.h>
+#include <string.h>
+#include <istream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+
+#include "log.h"
+
+namespace cppserver
+{
+    // Type tag written before every encoded format argument
+    enum LogArgTag
+    {
+        LOG_ARG_INT = 1,    // zigzag varint
+        LOG_ARG_UINT = 2,   // varint
+        LOG_ARG_DOUBLE = 3, // 8 bytes, host byte order
+        LOG_ARG_STRING = 4  // varint length + bytes
+    };
+
+    // LEB128 varint helpers shared by the encoder, the appender and the reader
+    void PutVarint(std::string &out, uint64_t val);
+    bool GetVarint(const char *&p, const char *end, uint64_t &val);
+
+    inline void EncodeLogArg(std::string &out, const char *val)
+    {
+        if (!val)
+        {
+            val = "(null)";
+        }
+        size_t len = strlen(val);
+        out.push_back((char)LOG_ARG_STRING);
+        PutVarint(out, len);
+        out.append(val, len);
+    }
+
+    inline void EncodeLogArg(std::string &out, const std::string &val)
+    {
+        out.push_back((char)LOG_ARG_STRING);
+        PutVarint(out, val.size());
+        out.append(val);
+    }
+
+    inline void EncodeLogArg(std::string &out, const void *val)
+    {
+        out.push_back((char)LOG_ARG_UINT);
+        PutVarint(out, (uint64_t)(uintptr_t)val);
+    }
+
+    template <class T>
+    inline typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value>::type
+    EncodeLogArg(std::string &out, T val)
+    {
+        if constexpr (std::is_floating_point<T>::value)
+        {
+            double d = val;
+            out.push_back((char)LOG_ARG_DOUBLE);
+            out.append((const char *)&d, sizeof(d));
+        }
+        else if constexpr (std::is_enum<T>::value || std::is_signed<T>::value)
+        {
+            int64_t v = (int64_t)val;
+            out.push_back((char)LOG_ARG_INT);
+            PutVarint(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+        }
+        else
+        {
+            out.push_back((char)LOG_ARG_UINT);
+            PutVarint(out, (uint64_t)val);
+        }
+    }
+
+    template <class... Args>
+    void EncodeLogArgs(std::string &out, const Args &...args)
+    {
+        (EncodeLogArg(out, args), ...);
+    }
+
+    // printf-style rendering of encoded arguments; length modifiers in `fmt` are
+    // ignored since every integer is carried as 64 bits
+    std::string RenderLogArgs(const char *fmt, const char *args, size_t len);
+    // Same, appending to `out`
+    void RenderLogArgs(LogBuffer &out, const char *fmt, const char *args, size_t len);
+
+    // Build a structured event: the format is kept by pointer (must be static storage,
+    // normally a literal) and the arguments are encoded instead of rendered.
+    // Text appenders render it lazily through LogEvent::getContent().
+    template <class... Args>
+    void SetLogArgs(LogEvent &event, const char *fmt, const Args &...args)
+    {
+        event.setFormat(fmt);
+        event.getArgs().clear();
+        EncodeLogArgs(event.getArgs(), args...);
+    }
+
+    // Binary log file layout (all integers are varints unless noted):
+    //   header  "CSBLOG1\n"
+    //   string  u8 'S', id, length, bytes            -- defines id once, before first use
+    //   event   u8 'E', u8 level, time, elapse, thread id, fiber id,
+    //           file id, line, logger name id, format id, args length, args
+    // Format id 0 means the event had no format and args holds the plain content.
+    // Id 0 for file means no file.
+    static const char BINARY_LOG_MAGIC[] = "CSBLOG1\n";
+    // Longest string or args accepted by BinaryLogReader, anything longer is taken as corruption
+    static const uint64_t BINARY_LOG_MAX_RECORD = 64 << 20;
+
+    // Output to a single file in the binary format above. Events built with SetLogArgs are
+    // written without converting any argument to text; formats, file names and logger
+    // names are written once per file and referenced by id afterwards.
+    class BinaryLogAppender : public LogAppender
+    {
+    public:
+        typedef std::shared_ptr<BinaryLogAppender> ptr;
+        BinaryLogAppender(const std::string &filename);
+        void log(Logger::ptr logger, LogLevel level, LogEvent::ptr event) override;
+        void flush() override;
+        bool reopen(); // start a new file, string ids are defined again
+        std::string toYamlString() override;
+
+    private:
+        uint32_t internPtr(const char *str);
+        uint32_t internName(const std::string &str);
+        void defineString(uint32_t id, const char *str, size_t len);
+
+    private:
+        std::string m_filename;
+        std::ofstream m_filestream;
+        std::string m_buf; // record being encoded, reused
+        uint32_t m_nextId = 0;
+        std::unordered_map<const char *, uint32_t> m_ptrIds;  // formats and file names, keyed by address
+        std::unordered_map<std::string, uint32_t> m_nameIds; // logger names
+    };
+
+    // Reads back a file written by BinaryLogAppender
+    class BinaryLogReader
+    {
+    public:
+        struct Entry
+        {
+            std::string loggerName;
+            LogLevel level;
+            LogEvent::ptr event; // content already rendered
+        };
+
+        BinaryLogReader(std::istream &is);
+        // false when the header was not recognised
+        bool isValid() const { return m_valid; }
+        // Next event, false at end of file or on a truncated/corrupt record
+        bool next(Entry &entry);
+        // true if next() stopped on a truncated/corrupt record rather than end of file
+        bool isCorrupt() const { return m_corrupt; }
+
+    private:
+        bool readVarint(uint64_t &val);
+        // Read `len` bytes into `out`, false on a short read or a length over BINARY_LOG_MAX_RECORD
+        bool readBytes(std::string &out, uint64_t len);
+
+    private:
+        std::istream &m_is;
+        bool m_valid = false;
+        bool m_corrupt = false;
+        std::unordered_map<uint64_t, std::string> m_strings;
+    };
+
+} // namespace cppserver
+
+#endif
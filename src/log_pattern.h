@@ -0,0 +1,373 @@
+#ifndef __CPPSERVER_LOG_PATTERN_H__
+#define __CPPSERVER_LOG_PATTERN_H__
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <array>
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+#include "log.h"
+
+namespace cppserver
+{
+    // String literal usable as a template argument: StaticLogFormatter<"%d%T%m%n">
+    template <size_t N>
+    struct FixedString
+    {
+        char data[N]{};
+        constexpr FixedString(const char (&str)[N])
+        {
+            for (size_t i = 0; i < N; ++i)
+            {
+                data[i] = str[i];
+            }
+        }
+        constexpr size_t size() const { return N - 1; }
+        constexpr char operator[](size_t i) const { return data[i]; }
+    };
+
+    // Writes into a caller-provided buffer; keeps counting once the buffer is full
+    // so the caller learns how large the record actually is.
+    class LogBufferWriter
+    {
+    public:
+        LogBufferWriter(char *buf, size_t len) : m_cur(buf), m_end(buf + len) {}
+
+        void append(const char *str, size_t len)
+        {
+            size_t room = m_end - m_cur;
+            size_t n = len < room ? len : room;
+            memcpy(m_cur, str, n);
+            m_cur += n;
+            m_needed += len;
+        }
+        void append(std::string_view str) { append(str.data(), str.size()); }
+        void append(char c) { append(&c, 1); }
+        void append(const char *str)
+        {
+            if (str)
+            {
+                append(str, strlen(str));
+            }
+        }
+        template <class T>
+        void appendInt(T val)
+        {
+            char buf[24];
+            auto res = std::to_chars(buf, buf + sizeof(buf), val);
+            append(buf, res.ptr - buf);
+        }
+
+        size_t getNeeded() const { return m_needed; }
+
+    private:
+        char *m_cur;
+        char *m_end;
+        size_t m_needed = 0;
+    };
+
+    namespace pattern
+    {
+        // spec == 0 => literal text pattern[begin, begin + len)
+        // otherwise => %spec, with optional {fmt} at pattern[begin, begin + len)
+        struct Token
+        {
+            char spec = 0;
+            size_t begin = 0;
+            size_t len = 0;
+        };
+
+        // Same specifiers as LogFormatter::init()
+        constexpr bool IsSpec(char c)
+        {
+            for (char s : "mprctndflTF")
+            {
+                if (s && s == c)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Parse `str` into `out` (may be nullptr to only count). Errors throw, which turns
+        // into a compile error since the parse always runs in a constant expression.
+        constexpr size_t Parse(const char *str, size_t size, Token *out)
+        {
+            size_t count = 0;
+            size_t lit_begin = 0;
+            size_t lit_len = 0;
+            auto emit = [&](Token tok)
+            {
+                if (out)
+                {
+                    out[count] = tok;
+                }
+                ++count;
+            };
+            auto flush_literal = [&]()
+            {
+                if (lit_len)
+                {
+                    emit(Token{0, lit_begin, lit_len});
+                    lit_len = 0;
+                }
+            };
+            for (size_t i = 0; i < size; ++i)
+            {
+                if (str[i] != '%')
+                {
+                    if (!lit_len)
+                    {
+                        lit_begin = i;
+                    }
+                    ++lit_len;
+                    continue;
+                }
+                flush_literal();
+                if (i + 1 >= size)
+                {
+                    throw "log pattern: dangling '%'";
+                }
+                char spec = str[i + 1];
+                if (spec == '%')
+                {
+                    emit(Token{0, i + 1, 1});
+                    ++i;
+                    continue;
+                }
+                if (!IsSpec(spec))
+                {
+                    throw "log pattern: unknown specifier";
+                }
+                size_t n = i + 2;
+                Token tok{spec, 0, 0};
+                if (n < size && str[n] == '{')
+                {
+                    size_t end = n + 1;
+                    while (end < size && str[end] != '}')
+                    {
+                        ++end;
+                    }
+                    if (end >= size)
+                    {
+                        throw "log pattern: unterminated '{'";
+                    }
+                    tok.begin = n + 1;
+                    tok.len = end - n - 1;
+                    n = end + 1;
+                }
+                emit(tok);
+                i = n - 1;
+            }
+            flush_literal();
+            return count;
+        }
+
+        template <FixedString P>
+        struct Parsed
+        {
+            static constexpr size_t count = Parse(P.data, P.size(), nullptr);
+            static constexpr std::array<Token, count> tokens = []()
+            {
+                std::array<Token, count> toks{};
+                Parse(P.data, P.size(), toks.data());
+                return toks;
+            }();
+        };
+
+        // Formatting items. All static, no virtual dispatch.
+        template <FixedString P, size_t B, size_t L>
+        struct LiteralItem
+        {
+            static void write(LogBufferWriter &w, const Logger &, LogLevel, const LogEvent &) { w.append(P.data + B, L); }
+        };
+
+        struct MessageItem
+        {
+            static void write(LogBufferWriter &w, const Logger &, LogLevel, const LogEvent &event) { w.append(event.getContent()); }
+        };
+
+        struct LevelItem
+        {
+            static void write(LogBufferWriter &w, const Logger &, LogLevel level, const LogEvent &) { w.append(LogLevelToString(level)); }
+        };
+
+        struct ElapseItem
+        {
+            static void write(LogBufferWriter &w, const Logger &, LogLevel, const LogEvent &event) { w.appendInt(event.getElapse()); }
+        };
+
+        struct NameItem
+        {
+            static void write(LogBufferWriter &w, const Logger &logger, LogLevel, const LogEvent &) { w.append(logger.getName()); }
+        };
+
+        struct ThreadIdItem
+        {
+            static void write(LogBufferWriter &w, const Logger &, LogLevel, const LogEvent &event) { w.appendInt(event.getThreadId()); }
+        };
+
+        struct FiberIdItem
+        {
+            static void write(LogBufferWriter &w, const Logger &, LogLevel, const LogEvent &event) { w.appendInt(event.getFiberId()); }
+        };
+
+        struct NewLineItem
+        {
+            static void write(LogBufferWriter &w, const Logger &, LogLevel, const LogEvent &) { w.append('\n'); }
+        };
+
+        struct TabItem
+        {
+            static void write(LogBufferWriter &w, const Logger &, LogLevel, const LogEvent &) { w.append('\t'); }
+        };
+
+        struct FilenameItem
+        {
+            static void write(LogBufferWriter &w, const Logger &, LogLevel, const LogEvent &event) { w.append(event.getFile()); }
+        };
+
+        struct LineItem
+        {
+            static void write(LogBufferWriter &w, const Logger &, LogLevel, const LogEvent &event) { w.appendInt(event.getLine()); }
+        };
+
+        // %d{fmt}; the strftime format is copied out of the pattern into its own
+        // null-terminated array at compile time
+        template <FixedString P, size_t B, size_t L>
+        struct DateTimeItem
+        {
+            static constexpr auto fmt = []()
+            {
+                constexpr const char deflt[] = "%Y-%m-%d %H:%M:%S";
+                constexpr size_t n = L ? L : sizeof(deflt) - 1;
+                std::array<char, n + 1> arr{};
+                for (size_t i = 0; i < n; ++i)
+                {
+                    arr[i] = L ? P.data[B + i] : deflt[i];
+                }
+                return arr;
+            }();
+
+            static void write(LogBufferWriter &w, const Logger &, LogLevel, const LogEvent &event)
+            {
+                struct tm tm;
+                time_t time = event.getTime();
+                localtime_r(&time, &tm);
+                char buf[64];
+                size_t n = strftime(buf, sizeof(buf), fmt.data(), &tm);
+                w.append(buf, n);
+            }
+        };
+
+        template <FixedString P, char Spec, size_t B, size_t L>
+        struct ItemFor
+        {
+            typedef LiteralItem<P, B, L> type;
+        };
+#define XX(c, ...)                                 \
+    template <FixedString P, size_t B, size_t L>   \
+    struct ItemFor<P, c, B, L>                     \
+    {                                              \
+        typedef __VA_ARGS__ type;                  \
+    };
+        XX('m', MessageItem)
+        XX('p', LevelItem)
+        XX('r', ElapseItem)
+        XX('c', NameItem)
+        XX('t', ThreadIdItem)
+        XX('n', NewLineItem)
+        XX('d', DateTimeItem<P, B, L>)
+        XX('f', FilenameItem)
+        XX('l', LineItem)
+        XX('T', TabItem)
+        XX('F', FiberIdItem)
+#undef XX
+
+        template <FixedString P, size_t I>
+        using ItemAt = typename ItemFor<P, Parsed<P>::tokens[I].spec, Parsed<P>::tokens[I].begin, Parsed<P>::tokens[I].len>::type;
+
+        template <FixedString P, class Seq>
+        struct ItemTuple;
+
+        template <FixedString P, size_t... I>
+        struct ItemTuple<P, std::index_sequence<I...>>
+        {
+            typedef std::tuple<ItemAt<P, I>...> type;
+        };
+    } // namespace pattern
+
+    // LogFormatter whose pattern is parsed at compile time into a fixed tuple of
+    // non-virtual items. An invalid pattern is a compile error.
+    //   appender->setFormatter(std::make_shared<StaticLogFormatter<"%d%T[%p]%T%m%n">>());
+    // Use formatTo() on hot paths to render straight into a caller-provided buffer.
+    template <FixedString Pattern>
+    class StaticLogFormatter : public LogFormatter
+    {
+    public:
+        typedef std::shared_ptr<StaticLogFormatter> ptr;
+        typedef typename pattern::ItemTuple<Pattern, std::make_index_sequence<pattern::Parsed<Pattern>::count>>::type Items;
+
+        StaticLogFormatter() : LogFormatter(Pattern.data, Unparsed()) {}
+
+        // Render into buf[0, len). Returns the size of the whole record; if it is larger
+        // than len the output was truncated. No terminating null is written.
+        static size_t formatTo(char *buf, size_t len, const Logger &logger, LogLevel level, const LogEvent &event)
+        {
+            LogBufferWriter w(buf, len);
+            writeItems(w, logger, level, event, std::make_index_sequence<std::tuple_size<Items>::value>());
+            return w.getNeeded();
+        }
+
+        std::string format(std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event) override
+        {
+            char buf[512];
+            size_t n = formatTo(buf, sizeof(buf), *logger, level, *event);
+            if (n <= sizeof(buf))
+            {
+                return std::string(buf, n);
+            }
+            std::string str(n, '\0');
+            formatTo(&str[0], n, *logger, level, *event);
+            return str;
+        }
+
+        std::ostream &format(std::ostream &ofs, std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event) override
+        {
+            char buf[512];
+            size_t n = formatTo(buf, sizeof(buf), *logger, level, *event);
+            if (n <= sizeof(buf))
+            {
+                return ofs.write(buf, n);
+            }
+            return ofs << format(logger, level, event);
+        }
+
+        void format(LogBuffer &out, std::shared_ptr<Logger> logger, LogLevel level, LogEvent::ptr event) override
+        {
+            // render straight into the buffer's free space, grow and redo once if it did not fit
+            size_t room = out.capacity() - out.size();
+            size_t n = formatTo(out.reserveTail(0), room, *logger, level, *event);
+            if (n > room)
+            {
+                n = formatTo(out.reserveTail(n), n, *logger, level, *event);
+            }
+            out.commit(n);
+        }
+
+    private:
+        template <size_t... I>
+        static void writeItems(LogBufferWriter &w, const Logger &logger, LogLevel level, const LogEvent &event, std::index_sequence<I...>)
+        {
+            (std::tuple_element<I, Items>::type::write(w, logger, level, event), ...);
+        }
+    };
+
+} // namespace cppserver
+
+#endif
@@ -0,0 +1,253 @@
+#include "log_ring.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace cppserver
+{
+
+    LogRingBuffer::LogRingBuffer(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        m_mask = size - 1;
+        m_slots = new Slot[size];
+        for (size_t i = 0; i < size; ++i)
+        {
+            m_slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    LogRingBuffer::~LogRingBuffer()
+    {
+        delete[] m_slots;
+    }
+
+    LogRecord *LogRingBuffer::tryClaim(uint64_t &ticket)
+    {
+        uint64_t pos = m_tail.load(std::memory_order_relaxed);
+        while (true)
+        {
+            if (pos & CLOSED)
+            {
+                return nullptr;
+            }
+            Slot &slot = m_slots[pos & m_mask];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            int64_t diff = (int64_t)seq - (int64_t)pos;
+            if (diff == 0)
+            {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    ticket = pos;
+                    return &slot.record;
+                }
+                // pos was reloaded by the failed CAS
+            }
+            else if (diff < 0)
+            {
+                return nullptr; // slot still holds a record from the previous lap: full
+            }
+            else
+            {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void LogRingBuffer::publish(uint64_t ticket)
+    {
+        m_slots[ticket & m_mask].seq.store(ticket + 1, std::memory_order_release);
+    }
+
+    LogRecord *LogRingBuffer::peek()
+    {
+        Slot &slot = m_slots[m_head & m_mask];
+        if (slot.seq.load(std::memory_order_acquire) != m_head + 1)
+        {
+            return nullptr;
+        }
+        return &slot.record;
+    }
+
+    void LogRingBuffer::pop()
+    {
+        // hand the slot to the producer one lap ahead
+        m_slots[m_head & m_mask].seq.store(m_head + m_mask + 1, std::memory_order_release);
+        ++m_head;
+    }
+
+    RingLogDispatcher::RingLogDispatcher(size_t capacity, OverflowPolicy policy)
+        : m_ring(capacity), m_policy(policy)
+    {
+    }
+
+    RingLogDispatcher::~RingLogDispatcher()
+    {
+        stop();
+    }
+
+    void RingLogDispatcher::start()
+    {
+        if (m_running.exchange(true))
+        {
+            return;
+        }
+        m_ring.open();
+        m_thread = std::thread(&RingLogDispatcher::run, this);
+    }
+
+    void RingLogDispatcher::stop()
+    {
+        if (!m_running.exchange(false))
+        {
+            return;
+        }
+        // no claims from here on: the consumer waits for the slots already claimed to be
+        // published, writes them out and exits
+        m_ring.close();
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    }
+
+    bool RingLogDispatcher::push(Logger &logger, LogLevel level, LogEvent::ptr event)
+    {
+        std::string_view content = event->getContent();
+        return push(logger, level, event->getFile(), event->getLine(), event->getElapse(),
+                    event->getThreadId(), event->getFiberId(), event->getTime(), content.data(), content.size());
+    }
+
+    bool RingLogDispatcher::push(Logger &logger, LogLevel level, const char *file, int line, uint32_t elapse,
+                                 uint32_t thread_id, uint32_t fiber_id, time_t time, const char *msg, size_t len)
+    {
+        uint64_t ticket = 0;
+        LogRecord *rec = nullptr;
+        while (!(rec = m_ring.tryClaim(ticket)) && !m_ring.isClosed())
+        {
+            if (m_policy != BLOCK && level != LogLevel::FATAL)
+            {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        if (!rec)
+        {
+            // closed (not started or stopping): fall back to writing on the caller's thread
+            LogEvent::ptr event(new LogEvent(file, line, elapse, thread_id, fiber_id, time));
+            event->setContent(msg, len);
+            logger.dispatch(level, event);
+            if (level == LogLevel::FATAL)
+            {
+                logger.flushAppenders();
+            }
+            return true;
+        }
+
+        rec->logger = &logger;
+        rec->file = file;
+        rec->time = time;
+        rec->line = line;
+        rec->elapse = elapse;
+        rec->threadId = thread_id;
+        rec->fiberId = fiber_id;
+        rec->level = level;
+        rec->length = len < LogRecord::PAYLOAD_SIZE ? len : LogRecord::PAYLOAD_SIZE;
+        memcpy(rec->payload, msg, rec->length);
+        m_ring.publish(ticket);
+
+        if (level == LogLevel::FATAL)
+        {
+            flush();
+        }
+        return true;
+    }
+
+    void RingLogDispatcher::flush()
+    {
+        uint64_t target = m_ring.getTail();
+        while (m_written.load(std::memory_order_acquire) < target && m_running.load(std::memory_order_relaxed))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    size_t RingLogDispatcher::drain(LogEvent::ptr &event, size_t max)
+    {
+        m_batchLoggers.clear();
+        size_t n = 0;
+        LogRecord *rec = nullptr;
+        while (n < max && (rec = m_ring.peek()))
+        {
+            Logger *logger = rec->logger;
+            LogLevel level = (LogLevel)rec->level;
+            event->reset(rec->file, rec->line, rec->elapse, rec->threadId, rec->fiberId, rec->time);
+            event->setContent(rec->payload, rec->length);
+            m_ring.pop(); // everything is copied out, free the slot before the slow part
+            logger->dispatch(level, event);
+            if (std::find(m_batchLoggers.begin(), m_batchLoggers.end(), logger) == m_batchLoggers.end())
+            {
+                m_batchLoggers.push_back(logger);
+            }
+            m_lastLogger = logger;
+            ++n;
+        }
+
+        uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+        if (m_policy == DROP_REPORT && dropped > m_droppedReported && m_lastLogger)
+        {
+            event->reset(__FILE__, __LINE__, 0, 0, 0, time(0));
+            event->setContent("RingLogDispatcher dropped " + std::to_string(dropped - m_droppedReported) + " log records");
+            m_lastLogger->dispatch(LogLevel::WARN, event);
+            m_droppedReported = dropped;
+        }
+
+        if (n)
+        {
+            // one flush per appender per batch instead of one per record
+            for (auto l : m_batchLoggers)
+            {
+                l->flushAppenders();
+            }
+            m_written.store(m_ring.getHead(), std::memory_order_release);
+        }
+        return n;
+    }
+
+    void RingLogDispatcher::run()
+    {
+        static const size_t MAX_BATCH = 1024;
+        LogEvent::ptr event(new LogEvent); // reused for every record
+        int idle = 0;
+        while (true)
+        {
+            if (drain(event, MAX_BATCH))
+            {
+                idle = 0;
+                continue;
+            }
+            if (m_ring.isClosed() && m_ring.getHead() == m_ring.getTail())
+            {
+                break;
+            }
+            // back off: spin, then yield, then sleep so an idle logger costs nothing
+            if (++idle < 64)
+            {
+                continue;
+            }
+            if (idle < 128)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+} // namespace cppserver
@@ -0,0 +1,129 @@
+#ifndef __CPPSERVER_LOG_RING_H__
+#define __CPPSERVER_LOG_RING_H__
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+#include "noncopyable.h"
+
+namespace cppserver
+{
+    // One log record stored inline in a ring slot, no heap memory attached
+    struct LogRecord
+    {
+        static constexpr size_t PAYLOAD_SIZE = 204; // makes a ring slot exactly 4 cache lines
+
+        Logger *logger;   // not owned, see RingLogDispatcher about logger lifetime
+        const char *file; // must point to static storage, e.g. __FILE__
+        time_t time;
+        uint32_t line;
+        uint32_t elapse;
+        uint32_t threadId;
+        uint32_t fiberId;
+        uint16_t level;
+        uint16_t length; // bytes used in payload, longer messages are truncated
+        char payload[PAYLOAD_SIZE];
+    };
+
+    // Bounded multi-producer/single-consumer ring of LogRecord.
+    // Each slot carries a sequence number (Vyukov's bounded queue), so producers only
+    // contend on one CAS of the tail and never wait for each other to finish writing.
+    class LogRingBuffer : Noncopyable
+    {
+    public:
+        static constexpr size_t CACHE_LINE = 64;
+
+        // capacity is rounded up to a power of two
+        LogRingBuffer(size_t capacity = 65536);
+        ~LogRingBuffer();
+
+        // Producer: reserve the next slot, fill it, then publish(ticket).
+        // Returns nullptr when the ring is full or closed.
+        LogRecord *tryClaim(uint64_t &ticket);
+        void publish(uint64_t ticket);
+
+        // A closed ring accepts no claims; it starts closed. Once close() returns, every slot
+        // ever claimed has a ticket below getTail() and the consumer can drain up to it.
+        void open() { m_tail.fetch_and(~CLOSED); }
+        void close() { m_tail.fetch_or(CLOSED); }
+        bool isClosed() const { return m_tail.load(std::memory_order_acquire) & CLOSED; }
+
+        // Consumer: the next published record or nullptr, released with pop()
+        LogRecord *peek();
+        void pop();
+
+        // Records consumed so far, only meaningful on the consumer thread
+        uint64_t getHead() const { return m_head; }
+        // Slots claimed so far by producers
+        uint64_t getTail() const { return m_tail.load(std::memory_order_acquire) & ~CLOSED; }
+        size_t getCapacity() const { return m_mask + 1; }
+
+    private:
+        static constexpr uint64_t CLOSED = 1ull << 63; // flag in m_tail, tickets never get there
+
+        struct alignas(CACHE_LINE) Slot
+        {
+            std::atomic<uint64_t> seq; // == ticket: free, == ticket + 1: published
+            LogRecord record;
+        };
+        static_assert(sizeof(Slot) % CACHE_LINE == 0, "ring slot must be cache-line sized");
+
+        Slot *m_slots;
+        size_t m_mask;
+        alignas(CACHE_LINE) std::atomic<uint64_t> m_tail{CLOSED}; // shared by producers
+        alignas(CACHE_LINE) uint64_t m_head = 0;              // consumer only
+    };
+
+    // LogDispatcher that moves records through a LogRingBuffer to a single consumer thread.
+    // The producer path takes no lock and allocates nothing; the consumer reuses one
+    // LogEvent for every record and flushes the appenders whenever it has drained the ring.
+    // Records point to their logger without holding a reference (that would put a shared
+    // refcount on every push), so a logger must outlive what it pushed: loggers from
+    // LoggerManager are never destroyed, any other logger needs a flush() of the dispatcher
+    // before its last reference goes away.
+    class RingLogDispatcher : public LogDispatcher
+    {
+    public:
+        typedef std::shared_ptr<RingLogDispatcher> ptr;
+
+        RingLogDispatcher(size_t capacity = 65536, OverflowPolicy policy = BLOCK);
+        ~RingLogDispatcher();
+
+        void start() override;
+        void stop() override;
+        bool push(Logger &logger, LogLevel level, LogEvent::ptr event) override;
+        // Allocation-free path for callers that have not built a LogEvent.
+        // `file` must outlive the dispatcher, `msg` is copied.
+        bool push(Logger &logger, LogLevel level, const char *file, int line, uint32_t elapse,
+                  uint32_t thread_id, uint32_t fiber_id, time_t time, const char *msg, size_t len);
+        void flush() override;
+
+        uint64_t getDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+        size_t getCapacity() const { return m_ring.getCapacity(); }
+        OverflowPolicy getPolicy() const { return m_policy; }
+        bool isRunning() const { return m_running.load(std::memory_order_relaxed); }
+
+    private:
+        void run();
+        // Write out everything published, returns the number of records written
+        size_t drain(LogEvent::ptr &event, size_t max);
+
+    private:
+        LogRingBuffer m_ring;
+        OverflowPolicy m_policy;
+        std::atomic<bool> m_running{false};
+        std::thread m_thread;
+        Logger *m_lastLogger = nullptr;       // consumer only, target of the DROP_REPORT warning
+        std::vector<Logger *> m_batchLoggers; // consumer only, distinct loggers in the current batch
+        uint64_t m_droppedReported = 0;  // consumer only
+        alignas(LogRingBuffer::CACHE_LINE) std::atomic<uint64_t> m_dropped{0};
+        alignas(LogRingBuffer::CACHE_LINE) std::atomic<uint64_t> m_written{0}; // tickets below this are written and flushed
+    };
+
+} // namespace cppserver
+
+#endif
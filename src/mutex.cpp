@@ -0,0 +1,343 @@
+#include "mutex.h"
+#include <assert.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <vector>
+
+#include "scheduler.h"
+
+namespace cppserver {
+
+Semaphore::Semaphore(uint32_t count) {
+    if(sem_init(&m_semaphore, 0, count)) {
+        throw std::logic_error("sem_init error");
+    }
+}
+
+Semaphore::~Semaphore() {
+    sem_destroy(&m_semaphore);
+}
+
+void Semaphore::wait() {
+    while(sem_wait(&m_semaphore)) {
+        if(errno != EINTR) {
+            throw std::logic_error("sem_wait error");
+        }
+    }
+}
+
+void Semaphore::notify() {
+    if(sem_post(&m_semaphore)) {
+        throw std::logic_error("sem_post error");
+    }
+}
+
+/// pauses between two checks of a held FutexMutex start at 1 and double up to this
+static const uint32_t s_futex_max_backoff = 64;
+/// pauses spent spinning on a held FutexMutex before going to sleep
+static const uint32_t s_futex_spin_budget = 1000;
+
+static bool IsMultiCpu() {
+    static const bool multi = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    return multi;
+}
+
+static uint64_t MonotonicNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+FutexMutex::FutexMutex()
+    :m_state(0)
+    ,m_stats(nullptr) {
+}
+
+FutexMutex::~FutexMutex() {
+    delete m_stats.load(std::memory_order_relaxed);
+}
+
+void FutexMutex::lockSlow() {
+    StatCounters* st = m_stats.load(std::memory_order_acquire);
+    uint64_t start = 0;
+    if(st) {
+        start = MonotonicNS();
+        st->acquisitions.fetch_add(1, std::memory_order_relaxed);
+        st->contended.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if(IsMultiCpu()) {
+        uint32_t backoff = 1;
+        for(uint32_t spent = 0; spent < s_futex_spin_budget; spent += backoff) {
+            for(uint32_t i = 0; i < backoff; ++i) {
+                CpuRelax();
+            }
+            // read first, only try the CAS when it can succeed
+            int c = m_state.load(std::memory_order_relaxed);
+            if(c == 0 && m_state.compare_exchange_weak(c, 1, std::memory_order_acquire,
+                        std::memory_order_relaxed)) {
+                if(st) {
+                    st->spinAcquired.fetch_add(1, std::memory_order_relaxed);
+                    st->waitNs.fetch_add(MonotonicNS() - start, std::memory_order_relaxed);
+                }
+                return;
+            }
+            if(backoff < s_futex_max_backoff) {
+                backoff <<= 1;
+            }
+        }
+    }
+
+    // from here on the mutex is marked 2, whoever unlocks it wakes a sleeper;
+    // we may take it as 2 with nobody asleep, that costs one needless wake
+    while(m_state.exchange(2, std::memory_order_acquire) != 0) {
+        if(st) {
+            st->sleeps.fetch_add(1, std::memory_order_relaxed);
+        }
+        syscall(SYS_futex, (int*)&m_state, FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+    }
+    if(st) {
+        st->waitNs.fetch_add(MonotonicNS() - start, std::memory_order_relaxed);
+    }
+}
+
+void FutexMutex::wake() {
+    syscall(SYS_futex, (int*)&m_state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+void FutexMutex::enableStats() {
+    StatCounters* expected = nullptr;
+    StatCounters* st = new StatCounters;
+    if(!m_stats.compare_exchange_strong(expected, st, std::memory_order_acq_rel)) {
+        delete st;
+    }
+}
+
+FutexMutex::Stats FutexMutex::getStats() const {
+    Stats rt;
+    StatCounters* st = m_stats.load(std::memory_order_acquire);
+    if(st) {
+        rt.acquisitions = st->acquisitions.load(std::memory_order_relaxed);
+        rt.contended = st->contended.load(std::memory_order_relaxed);
+        rt.spinAcquired = st->spinAcquired.load(std::memory_order_relaxed);
+        rt.sleeps = st->sleeps.load(std::memory_order_relaxed);
+        rt.waitNs = st->waitNs.load(std::memory_order_relaxed);
+    }
+    return rt;
+}
+
+/**
+ * @brief Scheduler and fiber to park in a wait queue
+ */
+static std::pair<Scheduler*, Fiber::ptr> CurrentWaiter() {
+    Scheduler* scheduler = Scheduler::GetThis();
+    assert(scheduler);
+    return std::make_pair(scheduler, Fiber::GetThis());
+}
+
+FiberSemaphore::FiberSemaphore(size_t initial_concurrency)
+    :m_concurrency(initial_concurrency) {
+}
+
+FiberSemaphore::~FiberSemaphore() {
+    assert(m_waiters.empty());
+}
+
+bool FiberSemaphore::tryWait() {
+    MutexType::Lock lock(m_mutex);
+    if(m_concurrency > 0u) {
+        --m_concurrency;
+        return true;
+    }
+    return false;
+}
+
+void FiberSemaphore::wait() {
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_concurrency > 0u) {
+            --m_concurrency;
+            return;
+        }
+        m_waiters.push_back(CurrentWaiter());
+    }
+    // notify() has handed us its permit when we get here again
+    Fiber::YieldToHold();
+}
+
+void FiberSemaphore::notify() {
+    std::pair<Scheduler*, Fiber::ptr> next;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_waiters.empty()) {
+            ++m_concurrency;
+            return;
+        }
+        next = std::move(m_waiters.front());
+        m_waiters.pop_front();
+    }
+    next.first->schedule(std::move(next.second));
+}
+
+FiberMutex::FiberMutex()
+    :m_locked(false) {
+}
+
+FiberMutex::~FiberMutex() {
+    assert(!m_locked && m_waiters.empty());
+}
+
+void FiberMutex::lock() {
+    {
+        MutexType::Lock lock(m_mutex);
+        if(!m_locked) {
+            m_locked = true;
+            return;
+        }
+        m_waiters.push_back(CurrentWaiter());
+    }
+    // unlock() has handed the mutex to us when we get here again
+    Fiber::YieldToHold();
+}
+
+bool FiberMutex::tryLock() {
+    MutexType::Lock lock(m_mutex);
+    if(m_locked) {
+        return false;
+    }
+    m_locked = true;
+    return true;
+}
+
+void FiberMutex::unlock() {
+    std::pair<Scheduler*, Fiber::ptr> next;
+    {
+        MutexType::Lock lock(m_mutex);
+        assert(m_locked);
+        if(m_waiters.empty()) {
+            m_locked = false;
+            return;
+        }
+        // stays locked, owned by the next waiter
+        next = std::move(m_waiters.front());
+        m_waiters.pop_front();
+    }
+    next.first->schedule(std::move(next.second));
+}
+
+FiberCondition::FiberCondition() {
+}
+
+FiberCondition::~FiberCondition() {
+    assert(m_waiters.empty());
+}
+
+void FiberCondition::wait(FiberMutex& lock) {
+    {
+        MutexType::Lock l(m_mutex);
+        m_waiters.push_back(CurrentWaiter());
+    }
+    // queued before the mutex is released, so a notify() made under it cannot be missed
+    lock.unlock();
+    Fiber::YieldToHold();
+    lock.lock();
+}
+
+void FiberCondition::notify() {
+    std::pair<Scheduler*, Fiber::ptr> next;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_waiters.empty()) {
+            return;
+        }
+        next = std::move(m_waiters.front());
+        m_waiters.pop_front();
+    }
+    next.first->schedule(std::move(next.second));
+}
+
+void FiberCondition::notifyAll() {
+    std::list<std::pair<Scheduler*, Fiber::ptr> > waiters;
+    {
+        MutexType::Lock lock(m_mutex);
+        waiters.swap(m_waiters);
+    }
+    for(auto& i : waiters) {
+        i.first->schedule(std::move(i.second));
+    }
+}
+
+FiberRWMutex::FiberRWMutex()
+    :m_readers(0)
+    ,m_writer(false) {
+}
+
+FiberRWMutex::~FiberRWMutex() {
+    assert(!m_writer && !m_readers && m_waiters.empty());
+}
+
+void FiberRWMutex::rdlock() {
+    {
+        MutexType::Lock lock(m_mutex);
+        if(!m_writer && m_waiters.empty()) {
+            ++m_readers;
+            return;
+        }
+        auto w = CurrentWaiter();
+        m_waiters.push_back({w.first, std::move(w.second), false});
+    }
+    // counted in m_readers by unlock() when we get here again
+    Fiber::YieldToHold();
+}
+
+void FiberRWMutex::wrlock() {
+    {
+        MutexType::Lock lock(m_mutex);
+        if(!m_writer && !m_readers && m_waiters.empty()) {
+            m_writer = true;
+            return;
+        }
+        auto w = CurrentWaiter();
+        m_waiters.push_back({w.first, std::move(w.second), true});
+    }
+    // m_writer was set for us by unlock() when we get here again
+    Fiber::YieldToHold();
+}
+
+void FiberRWMutex::unlock() {
+    std::vector<Waiter> next;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_writer) {
+            m_writer = false;
+        } else {
+            assert(m_readers);
+            if(--m_readers) {
+                return;
+            }
+        }
+        if(m_waiters.empty()) {
+            return;
+        }
+        if(m_waiters.front().writer) {
+            m_writer = true;
+            next.push_back(std::move(m_waiters.front()));
+            m_waiters.pop_front();
+        } else {
+            while(!m_waiters.empty() && !m_waiters.front().writer) {
+                ++m_readers;
+                next.push_back(std::move(m_waiters.front()));
+                m_waiters.pop_front();
+            }
+        }
+    }
+    for(auto& i : next) {
+        i.scheduler->schedule(std::move(i.fiber));
+    }
+}
+
+}
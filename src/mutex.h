@@ -15,6 +15,17 @@
 
 namespace cppserver {
 
+/**
+ * @brief Hint to the CPU that the caller is busy-waiting
+ */
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
 class Semaphore : Noncopyable {
 public:
     /**
@@ -328,7 +339,13 @@ public:
     }
 
     void lock() {
-        while(std::atomic_flag_test_and_set_explicit(&m_mutex, std::memory_order_acquire));
+        // only retry the exchange once the flag is seen clear, so waiters spin on
+        // their cached copy instead of bouncing the line between cores
+        while(std::atomic_flag_test_and_set_explicit(&m_mutex, std::memory_order_acquire)) {
+            while(m_mutex.test(std::memory_order_relaxed)) {
+                CpuRelax();
+            }
+        }
     }
 
     void unlock() {
@@ -339,16 +356,123 @@ private:
     volatile std::atomic_flag m_mutex;
 };
 
+/**
+ * @brief Adaptive mutex on a futex
+ * @details Uncontended lock/unlock is one atomic each, with no syscall. A thread that
+ *          finds the mutex held spins for a short while, pausing between checks with
+ *          exponential backoff, since most critical sections are shorter than a sleep
+ *          and wakeup. If the mutex is still held, it sleeps in futex(FUTEX_WAIT). unlock()
+ *          only makes the FUTEX_WAKE syscall when somebody may be asleep. On a single CPU
+ *          the owner cannot run while we spin, so waiters go to sleep right away.
+ *
+ *          Contention statistics are off by default and cost one relaxed load per lock().
+ */
+class FutexMutex : Noncopyable {
+public:
+    typedef ScopedLockImpl<FutexMutex> Lock;
+
+    /**
+     * @brief Contention statistics
+     */
+    struct Stats {
+        /// lock() calls
+        uint64_t acquisitions = 0;
+        /// lock() calls that found the mutex held
+        uint64_t contended = 0;
+        /// contended lock() calls that got the mutex while spinning
+        uint64_t spinAcquired = 0;
+        /// FUTEX_WAIT calls
+        uint64_t sleeps = 0;
+        /// time spent in contended lock() calls, nanoseconds
+        uint64_t waitNs = 0;
+    };
+
+    FutexMutex();
+    ~FutexMutex();
+
+    void lock() {
+        int c = 0;
+        if(m_state.compare_exchange_strong(c, 1, std::memory_order_acquire,
+                    std::memory_order_relaxed)) {
+            if(StatCounters* st = m_stats.load(std::memory_order_acquire)) {
+                st->acquisitions.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+        lockSlow();
+    }
+
+    bool tryLock() {
+        int c = 0;
+        return m_state.compare_exchange_strong(c, 1, std::memory_order_acquire,
+                    std::memory_order_relaxed);
+    }
+
+    void unlock() {
+        if(m_state.exchange(0, std::memory_order_release) == 2) {
+            wake();
+        }
+    }
+
+    /**
+     * @brief Start collecting contention statistics, they stay on until destruction
+     */
+    void enableStats();
+
+    /**
+     * @brief Statistics collected so far, all zero if not enabled
+     */
+    Stats getStats() const;
+private:
+    struct StatCounters {
+        std::atomic<uint64_t> acquisitions {0};
+        std::atomic<uint64_t> contended {0};
+        std::atomic<uint64_t> spinAcquired {0};
+        std::atomic<uint64_t> sleeps {0};
+        std::atomic<uint64_t> waitNs {0};
+    };
+
+    void lockSlow();
+    void wake();
+private:
+    /// 0 unlocked, 1 locked, 2 locked and a thread may be asleep waiting for it
+    std::atomic<int> m_state;
+    std::atomic<StatCounters*> m_stats;
+};
+
 class Scheduler;
+
+/**
+ * @brief Counting semaphore for fibers
+ * @details wait() parks the calling fiber instead of blocking its thread. Waiters are
+ *          woken in FIFO order: notify() hands its permit straight to the oldest waiter,
+ *          so a later tryWait()/wait() cannot take it first.
+ * @attention wait() must be called from a fiber run by a Scheduler
+ */
 class FiberSemaphore : Noncopyable {
 public:
     typedef Spinlock MutexType;
 
+    /**
+     * @brief Constructor
+     * @param[in] initial_concurrency number of permits available initially
+     */
     FiberSemaphore(size_t initial_concurrency = 0);
     ~FiberSemaphore();
 
+    /**
+     * @brief Take a permit if one is available, never parks
+     */
     bool tryWait();
+
+    /**
+     * @brief Take a permit, parking the fiber until one is handed over
+     */
     void wait();
+
+    /**
+     * @brief Give a permit back, to the oldest waiter if any
+     */
     void notify();
 
     size_t getConcurrency() const { return m_concurrency;}
@@ -359,6 +483,115 @@ private:
     size_t m_concurrency;
 };
 
+/**
+ * @brief Mutex for fibers
+ * @details A fiber that finds the mutex held parks until unlock() hands the mutex
+ *          over to it, in FIFO order. Unlike Mutex it may be held across a yield,
+ *          a blocking hooked call or another FiberMutex.
+ * @attention lock() must be called from a fiber run by a Scheduler
+ */
+class FiberMutex : Noncopyable {
+public:
+    typedef ScopedLockImpl<FiberMutex> Lock;
+    typedef Spinlock MutexType;
+
+    FiberMutex();
+    ~FiberMutex();
+
+    void lock();
+
+    /**
+     * @brief Lock if free, never parks
+     */
+    bool tryLock();
+
+    void unlock();
+private:
+    MutexType m_mutex;
+    std::list<std::pair<Scheduler*, Fiber::ptr> > m_waiters;
+    bool m_locked;
+};
+
+/**
+ * @brief Condition variable for fibers, used together with a FiberMutex
+ */
+class FiberCondition : Noncopyable {
+public:
+    typedef Spinlock MutexType;
+
+    FiberCondition();
+    ~FiberCondition();
+
+    /**
+     * @brief Release lock, park until notified, then lock again
+     * @pre the calling fiber holds lock
+     */
+    void wait(FiberMutex& lock);
+
+    /**
+     * @brief wait() until pred() returns true
+     */
+    template<class Predicate>
+    void wait(FiberMutex& lock, Predicate pred) {
+        while(!pred()) {
+            wait(lock);
+        }
+    }
+
+    /**
+     * @brief Wake the oldest waiter
+     */
+    void notify();
+
+    /**
+     * @brief Wake every waiter
+     */
+    void notifyAll();
+private:
+    MutexType m_mutex;
+    std::list<std::pair<Scheduler*, Fiber::ptr> > m_waiters;
+};
+
+/**
+ * @brief Read-write mutex for fibers
+ * @details Waiters are served in FIFO order: a writer waits only for the holders ahead
+ *          of it, and readers arriving after a waiting writer queue behind it. When the
+ *          lock is handed over to readers, every reader at the head of the queue gets it.
+ * @attention rdlock() and wrlock() must be called from a fiber run by a Scheduler
+ */
+class FiberRWMutex : Noncopyable {
+public:
+    typedef ReadScopedLockImpl<FiberRWMutex> ReadLock;
+    typedef WriteScopedLockImpl<FiberRWMutex> WriteLock;
+    typedef Spinlock MutexType;
+
+    FiberRWMutex();
+    ~FiberRWMutex();
+
+    void rdlock();
+    void wrlock();
+
+    /**
+     * @brief Release a read or the write lock
+     */
+    void unlock();
+private:
+    /**
+     * @brief Parked fiber
+     */
+    struct Waiter {
+        Scheduler* scheduler;
+        Fiber::ptr fiber;
+        bool writer;
+    };
+
+    MutexType m_mutex;
+    std::list<Waiter> m_waiters;
+    /// number of readers holding the lock
+    uint32_t m_readers;
+    /// a writer holds the lock
+    bool m_writer;
+};
 
 
 }
@@ -0,0 +1,588 @@
+#include "scheduler.h"
+#include <assert.h>
+#include <pthread.h>
+#include <algorithm>
+#include <chrono>
+
+#include "hook.h"
+#include "log.h"
+#include "util.h"
+
+namespace cppserver {
+
+static Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+/// scheduler of this thread
+static thread_local Scheduler* t_scheduler = nullptr;
+/// fiber running the scheduling loop on this thread
+static thread_local Fiber* t_scheduler_fiber = nullptr;
+/// run queues of this thread while it runs Scheduler::run, owned by t_scheduler
+static thread_local void* t_worker = nullptr;
+
+/// the global queue is polled after this many local tasks, so it cannot starve
+static const uint32_t g_global_poll_interval = 61;
+/// tasks taken from the LIFO slot in a row before it yields to the deque
+static const uint32_t g_lifo_max_runs = 3;
+/// most tasks moved from the global queue or a victim's deque at once
+static const size_t g_max_batch = 32;
+
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
+    :m_name(name) {
+    assert(threads > 0);
+    for(size_t i = 0; i < threads; ++i) {
+        m_workers.emplace_back(new Worker);
+        // odd and distinct seeds for the xorshift victim picking
+        m_workers.back()->rand = 2 * i + 1;
+    }
+
+    if(use_caller) {
+        Fiber::GetThis();
+        --threads;
+
+        assert(GetThis() == nullptr);
+        t_scheduler = this;
+
+        m_rootFiber.reset(new Fiber(std::bind(&Scheduler::run, this), 0, true));
+        pthread_setname_np(pthread_self(), m_name.substr(0, 15).c_str());
+
+        t_scheduler_fiber = m_rootFiber.get();
+        m_rootThread = GetThreadId();
+        m_threadIds.push_back(m_rootThread);
+        m_workers[0]->thread = m_rootThread;
+    } else {
+        m_rootThread = -1;
+    }
+    m_threadCount = threads;
+}
+
+Scheduler::~Scheduler() {
+    assert(m_stopping);
+    if(GetThis() == this) {
+        t_scheduler = nullptr;
+    }
+    for(auto i : m_fibers) {
+        delete i;
+    }
+}
+
+Scheduler* Scheduler::GetThis() {
+    return t_scheduler;
+}
+
+Fiber* Scheduler::GetMainFiber() {
+    return t_scheduler_fiber;
+}
+
+void Scheduler::start() {
+    MutexType::Lock lock(m_mutex);
+    if(!m_stopping) {
+        return;
+    }
+    m_stopping = false;
+    assert(m_threads.empty());
+
+    // wait for each worker to report its thread id, so getThreadIds() is complete on return
+    std::mutex started_mutex;
+    std::condition_variable started_cond;
+    size_t started = 0;
+    m_threads.reserve(m_threadCount);
+    size_t first = m_rootFiber ? 1 : 0;
+    for(size_t i = 0; i < m_threadCount; ++i) {
+        std::string thread_name = (m_name + "_" + std::to_string(i)).substr(0, 15);
+        Worker* w = m_workers[first + i].get();
+        m_threads.emplace_back([this, w, thread_name, &started_mutex, &started_cond, &started]() {
+            pthread_setname_np(pthread_self(), thread_name.c_str());
+            {
+                // notify under the lock, start() may return and destroy these right after
+                std::unique_lock<std::mutex> lock(started_mutex);
+                w->thread = GetThreadId();
+                m_threadIds.push_back(GetThreadId());
+                ++started;
+                started_cond.notify_one();
+            }
+            run();
+        });
+    }
+    std::unique_lock<std::mutex> started_lock(started_mutex);
+    started_cond.wait(started_lock, [&]() { return started == m_threadCount; });
+}
+
+void Scheduler::stop() {
+    m_autoStop = true;
+    if(m_rootFiber
+            && m_threadCount == 0
+            && (m_rootFiber->getState() == Fiber::TERM
+                || m_rootFiber->getState() == Fiber::INIT)) {
+        CPPSERVER_LOG_INFO(g_logger) << this << " stopped";
+        m_stopping = true;
+
+        if(stopping()) {
+            return;
+        }
+    }
+
+    if(m_rootThread != -1) {
+        assert(GetThis() == this);
+    } else {
+        assert(GetThis() != this);
+    }
+
+    m_stopping = true;
+    for(size_t i = 0; i < m_threadCount; ++i) {
+        tickle();
+    }
+
+    if(m_rootFiber) {
+        tickle();
+    }
+
+    if(m_rootFiber) {
+        if(!stopping()) {
+            m_rootFiber->call();
+        }
+    }
+
+    std::vector<std::thread> thrs;
+    {
+        MutexType::Lock lock(m_mutex);
+        thrs.swap(m_threads);
+    }
+
+    for(auto& i : thrs) {
+        i.join();
+    }
+}
+
+void Scheduler::setThis() {
+    t_scheduler = this;
+}
+
+Scheduler::Worker* Scheduler::getWorker(int thread) {
+    for(auto& w : m_workers) {
+        if(w->thread.load(std::memory_order_relaxed) == thread) {
+            return w.get();
+        }
+    }
+    return nullptr;
+}
+
+void Scheduler::notifyIdle() {
+    // pairs with the fence in hasPendingTasks(): either the idle worker sees the task,
+    // or we see it idle and wake it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(hasIdleThreads()) {
+        tickle();
+    }
+}
+
+void Scheduler::enqueuePinned(FiberAndThread* ft) {
+    Worker* w = getWorker(ft->thread);
+    if(w) {
+        MutexType::Lock lock(w->inboxMutex);
+        w->inbox.push_back(ft);
+        ++w->inboxSize;
+    } else {
+        // not started yet, takeGlobal() hands it over once the thread is known
+        MutexType::Lock lock(m_mutex);
+        m_fibers.push_back(ft);
+        ++m_globalSize;
+    }
+    // tickle() may wake some other worker, run() passes it on
+    notifyIdle();
+}
+
+void Scheduler::requeue(Worker* w, FiberAndThread* ft) {
+    if(ft->fiber && ft->thread == -1 && ft->fiber->isSharedStack()) {
+        ft->thread = ft->fiber->getHomeThread();
+    }
+    if(ft->thread != -1 && ft->thread != w->thread.load(std::memory_order_relaxed)) {
+        enqueuePinned(ft);
+        return;
+    }
+    w->deque.push(ft);
+    notifyIdle();
+}
+
+void Scheduler::enqueue(FiberAndThread* ft) {
+    if(ft->fiber && ft->thread == -1 && ft->fiber->isSharedStack()) {
+        // its stack image only fits the shared stack of the thread that made it
+        ft->thread = ft->fiber->getHomeThread();
+    }
+    Worker* self = GetThis() == this ? (Worker*)t_worker : nullptr;
+    if(ft->thread != -1 && (!self || ft->thread != self->thread)) {
+        enqueuePinned(ft);
+        return;
+    }
+
+    if(self) {
+        if(self->lifo) {
+            self->deque.push(self->lifo);
+        }
+        self->lifo = ft;
+    } else {
+        MutexType::Lock lock(m_mutex);
+        m_fibers.push_back(ft);
+        ++m_globalSize;
+    }
+    notifyIdle();
+}
+
+void Scheduler::enqueue(std::vector<FiberAndThread*>& tasks) {
+    Worker* self = GetThis() == this ? (Worker*)t_worker : nullptr;
+    if(self) {
+        for(auto ft : tasks) {
+            enqueue(ft);
+        }
+        return;
+    }
+
+    std::vector<FiberAndThread*> pinned;
+    {
+        MutexType::Lock lock(m_mutex);
+        for(auto ft : tasks) {
+            if(ft->fiber && ft->fiber->isSharedStack()) {
+                pinned.push_back(ft);
+                continue;
+            }
+            m_fibers.push_back(ft);
+            ++m_globalSize;
+        }
+    }
+    for(auto ft : pinned) {
+        enqueue(ft);
+    }
+    if(pinned.size() < tasks.size()) {
+        notifyIdle();
+    }
+}
+
+Scheduler::FiberAndThread* Scheduler::takeGlobal(Worker* w) {
+    if(m_globalSize.load(std::memory_order_relaxed) == 0) {
+        return nullptr;
+    }
+    FiberAndThread* ret = nullptr;
+    std::vector<FiberAndThread*> handover;
+    {
+        MutexType::Lock lock(m_mutex);
+        // a fair share for this worker, the rest is left to the others
+        size_t n = std::min(m_fibers.size() / m_workers.size() + 1, g_max_batch);
+        auto it = m_fibers.begin();
+        while(it != m_fibers.end() && n) {
+            FiberAndThread* ft = *it;
+            if(ft->thread != -1 && ft->thread != w->thread) {
+                // queued before its worker had started
+                if(getWorker(ft->thread)) {
+                    handover.push_back(ft);
+                    m_fibers.erase(it++);
+                    --m_globalSize;
+                } else {
+                    ++it;
+                }
+                continue;
+            }
+            m_fibers.erase(it++);
+            --m_globalSize;
+            if(ft->thread != -1 && ft->thread != w->thread.load(std::memory_order_relaxed)) {
+                // only its own worker may run it
+                enqueuePinned(ft);
+                continue;
+            }
+            --n;
+            if(!ret) {
+                ret = ft;
+            } else {
+                w->deque.push(ft);
+            }
+        }
+    }
+    for(auto ft : handover) {
+        enqueuePinned(ft);
+    }
+    if(ret && !w->deque.empty()) {
+        notifyIdle();
+    }
+    return ret;
+}
+
+Scheduler::FiberAndThread* Scheduler::stealTask(Worker* w) {
+    size_t count = m_workers.size();
+    if(count < 2) {
+        return nullptr;
+    }
+    // xorshift32
+    w->rand ^= w->rand << 13;
+    w->rand ^= w->rand >> 17;
+    w->rand ^= w->rand << 5;
+    size_t start = w->rand % count;
+    for(size_t i = 0; i < count; ++i) {
+        Worker* victim = m_workers[(start + i) % count].get();
+        if(victim == w) {
+            continue;
+        }
+        FiberAndThread* ret = nullptr;
+        size_t n = std::min((victim->deque.size() + 1) / 2, g_max_batch);
+        while(n) {
+            FiberAndThread* ft = nullptr;
+            auto rt = victim->deque.steal(ft);
+            if(rt == WorkStealingDeque<FiberAndThread*>::EMPTY) {
+                break;
+            } else if(rt == WorkStealingDeque<FiberAndThread*>::ABORT) {
+                continue;
+            }
+            if(ft->thread != -1 && ft->thread != w->thread.load(std::memory_order_relaxed)) {
+                // only its own worker may run it
+                enqueuePinned(ft);
+                continue;
+            }
+            --n;
+            if(!ret) {
+                ret = ft;
+            } else {
+                w->deque.push(ft);
+            }
+        }
+        if(ret) {
+            return ret;
+        }
+    }
+    return nullptr;
+}
+
+Scheduler::FiberAndThread* Scheduler::nextTask(Worker* w) {
+    FiberAndThread* ft = nullptr;
+    if(w->inboxSize.load(std::memory_order_relaxed)) {
+        MutexType::Lock lock(w->inboxMutex);
+        if(!w->inbox.empty()) {
+            ft = w->inbox.front();
+            w->inbox.pop_front();
+            --w->inboxSize;
+            return ft;
+        }
+    }
+
+    if(++w->tick % g_global_poll_interval == 0) {
+        ft = takeGlobal(w);
+        if(ft) {
+            return ft;
+        }
+    }
+
+    if(w->lifo) {
+        ft = w->lifo;
+        w->lifo = nullptr;
+        if(++w->lifoRuns <= g_lifo_max_runs) {
+            return ft;
+        }
+        // two fibers waking each other would keep the deque waiting forever
+        w->deque.push(ft);
+    }
+    w->lifoRuns = 0;
+
+    while(true) {
+        auto rt = w->deque.steal(ft);
+        if(rt == WorkStealingDeque<FiberAndThread*>::SUCCESS) {
+            return ft;
+        } else if(rt == WorkStealingDeque<FiberAndThread*>::EMPTY) {
+            break;
+        }
+    }
+
+    ft = takeGlobal(w);
+    if(ft) {
+        return ft;
+    }
+    return stealTask(w);
+}
+
+void Scheduler::run() {
+    CPPSERVER_LOG_DEBUG(g_logger) << m_name << " run";
+    set_hook_enable(hookBlockingCalls());
+    setThis();
+    if(GetThreadId() != m_rootThread) {
+        t_scheduler_fiber = Fiber::GetThis().get();
+    }
+    Worker* w = getWorker(GetThreadId());
+    assert(w);
+    t_worker = w;
+    w->active = true;
+
+    Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
+    Fiber::ptr cb_fiber;
+
+    FiberAndThread ft;
+    while(true) {
+        ft.reset();
+        FiberAndThread* task = nextTask(w);
+        if(task) {
+            ft = std::move(*task);
+            delete task;
+        }
+
+        if(ft.fiber && ft.fiber->m_running.exchange(true, std::memory_order_acquire)) {
+            // woken before it finished switching out elsewhere, try again later
+            requeue(w, new FiberAndThread(ft));
+            continue;
+        }
+
+        if(ft.fiber && (ft.fiber->getState() != Fiber::TERM
+                        && ft.fiber->getState() != Fiber::EXCEPT)) {
+            ft.fiber->swapIn();
+
+            if(ft.fiber->getState() == Fiber::READY) {
+                ft.fiber->m_running.store(false, std::memory_order_release);
+                // behind everything already queued here
+                requeue(w, new FiberAndThread(ft.fiber, ft.thread));
+            } else {
+                if(ft.fiber->getState() != Fiber::TERM
+                        && ft.fiber->getState() != Fiber::EXCEPT) {
+                    ft.fiber->m_state = Fiber::HOLD;
+                }
+                ft.fiber->m_running.store(false, std::memory_order_release);
+            }
+            ft.reset();
+        } else if(ft.fiber) {
+            ft.fiber->m_running.store(false, std::memory_order_release);
+            ft.reset();
+        } else if(ft.cb) {
+            int cb_thread = ft.thread;
+            if(cb_fiber) {
+                cb_fiber->reset(ft.cb);
+            } else {
+                cb_fiber.reset(new Fiber(ft.cb));
+            }
+            ft.reset();
+            cb_fiber->m_running.store(true, std::memory_order_relaxed);
+            cb_fiber->swapIn();
+            if(cb_fiber->getState() == Fiber::READY) {
+                cb_fiber->m_running.store(false, std::memory_order_release);
+                requeue(w, new FiberAndThread(cb_fiber, cb_thread));
+                cb_fiber.reset();
+            } else if(cb_fiber->getState() == Fiber::EXCEPT
+                    || cb_fiber->getState() == Fiber::TERM) {
+                cb_fiber->m_running.store(false, std::memory_order_relaxed);
+                cb_fiber->reset(nullptr);
+            } else {
+                // parked somewhere else (e.g. waiting on IO), it is theirs now
+                cb_fiber->m_state = Fiber::HOLD;
+                cb_fiber->m_running.store(false, std::memory_order_release);
+                cb_fiber.reset();
+            }
+        } else if(!task) {
+            if(idle_fiber->getState() == Fiber::TERM) {
+                CPPSERVER_LOG_DEBUG(g_logger) << "idle fiber term";
+                // workers still asleep have not seen the stop yet
+                w->active = false;
+                tickle();
+                break;
+            }
+
+            for(auto& i : m_workers) {
+                if(i.get() != w && !i->active && i->inboxSize) {
+                    // the wake up for a pinned task reached the wrong worker, pass it on
+                    tickle();
+                    break;
+                }
+            }
+            w->active = false;
+            ++m_idleThreadCount;
+            idle_fiber->swapIn();
+            --m_idleThreadCount;
+            w->active = true;
+            if(idle_fiber->getState() != Fiber::TERM
+                    && idle_fiber->getState() != Fiber::EXCEPT) {
+                idle_fiber->m_state = Fiber::HOLD;
+            }
+        }
+    }
+    t_worker = nullptr;
+    set_hook_enable(false);
+}
+
+void Scheduler::tickle() {
+    // one task needs one worker; stop() tickles once per thread
+    std::lock_guard<std::mutex> lock(m_idleMutex);
+    m_idleCond.notify_one();
+}
+
+bool Scheduler::hasPendingTasks() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_globalSize.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    Worker* self = (Worker*)t_worker;
+    if(self && (self->inboxSize || self->lifo)) {
+        return true;
+    }
+    for(auto& w : m_workers) {
+        if(!w->deque.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Scheduler::stopping() {
+    if(!m_autoStop || !m_stopping) {
+        return false;
+    }
+    {
+        MutexType::Lock lock(m_mutex);
+        if(!m_fibers.empty()) {
+            return false;
+        }
+    }
+    // a worker that is not idle may still queue more, an idle one has emptied its LIFO slot
+    for(auto& w : m_workers) {
+        if(w->active || !w->deque.empty() || w->inboxSize) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Scheduler::idle() {
+    CPPSERVER_LOG_DEBUG(g_logger) << "idle";
+    while(!stopping()) {
+        {
+            // the timeout covers a tickle() aimed at a pinned task of another worker
+            std::unique_lock<std::mutex> lock(m_idleMutex);
+            if(!hasPendingTasks()) {
+                m_idleCond.wait_for(lock, std::chrono::milliseconds(10));
+            }
+        }
+        Fiber::YieldToHold();
+    }
+}
+
+void Scheduler::switchTo(int thread) {
+    assert(Scheduler::GetThis() != nullptr);
+    if(Scheduler::GetThis() == this) {
+        if(thread == -1 || thread == GetThreadId()) {
+            return;
+        }
+    }
+    schedule(Fiber::GetThis(), thread);
+    Fiber::YieldToHold();
+}
+
+std::ostream& Scheduler::dump(std::ostream& os) {
+    size_t active = 0;
+    for(auto& w : m_workers) {
+        active += w->active;
+    }
+    os << "[Scheduler name=" << m_name
+       << " size=" << m_threadCount
+       << " active_count=" << active
+       << " idle_count=" << m_idleThreadCount
+       << " stopping=" << m_stopping
+       << " ]" << std::endl << "    ";
+    for(size_t i = 0; i < m_threadIds.size(); ++i) {
+        if(i) {
+            os << ", ";
+        }
+        os << m_threadIds[i];
+    }
+    return os;
+}
+
+}
@@ -0,0 +1,288 @@
+#ifndef __CPPSERVER_SCHEDULER_H__
+#define __CPPSERVER_SCHEDULER_H__
+
+#include <memory>
+#include <vector>
+#include <list>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+#include "fiber.h"
+#include "mutex.h"
+#include "work_stealing_deque.h"
+
+namespace cppserver {
+
+/**
+ * @brief M:N fiber scheduler
+ * @details Runs fibers and plain callbacks on a pool of worker threads. With use_caller the
+ *          thread that constructs the scheduler is one of the workers: it runs the scheduling
+ *          loop in a root fiber (Fiber::CallerMainFunc) once stop() is called.
+ *          A task can be pinned to one worker by passing that worker's thread id.
+ *
+ *          Every worker owns a work-stealing deque and a LIFO slot. A task readied on a
+ *          worker goes to its LIFO slot and runs next, while its data is still in cache; the
+ *          task it displaces moves to the deque. Workers take from their own deque in FIFO
+ *          order, so a yielding fiber cannot starve the others, and steal from a random
+ *          victim when it is empty. Tasks submitted from other threads go to a global
+ *          injection queue, polled every few dozen tasks and whenever the local queues run dry.
+ */
+class Scheduler {
+public:
+    typedef std::shared_ptr<Scheduler> ptr;
+    typedef FutexMutex MutexType;
+
+    /**
+     * @brief Constructor
+     * @param[in] threads number of worker threads, including the caller with use_caller
+     * @param[in] use_caller run tasks on the constructing thread too
+     * @param[in] name scheduler name, also used to name the worker threads
+     */
+    Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = "");
+
+    virtual ~Scheduler();
+
+    const std::string& getName() const { return m_name;}
+
+    /**
+     * @brief Scheduler running on the calling thread, nullptr if none
+     */
+    static Scheduler* GetThis();
+
+    /**
+     * @brief Fiber of the calling thread that runs the scheduling loop
+     */
+    static Fiber* GetMainFiber();
+
+    /**
+     * @brief Start the worker threads
+     */
+    void start();
+
+    /**
+     * @brief Wait for every scheduled task to finish, then stop the workers
+     * @details With use_caller this runs the scheduling loop on the calling thread
+     *          until the scheduler is done, and must be called from that thread.
+     */
+    void stop();
+
+    /**
+     * @brief Schedule a fiber or a callback
+     * @details From a worker of this scheduler the task goes to that worker's LIFO slot,
+     *          from anywhere else to the global injection queue.
+     * @param[in] fc Fiber::ptr or std::function<void()>
+     * @param[in] thread thread id of the worker to run it on, -1 for any
+     */
+    template<class FiberOrCb>
+    void schedule(FiberOrCb fc, int thread = -1) {
+        FiberAndThread* ft = new FiberAndThread(fc, thread);
+        if(!ft->fiber && !ft->cb) {
+            delete ft;
+            return;
+        }
+        enqueue(ft);
+    }
+
+    /**
+     * @brief Schedule several fibers or callbacks, under one lock when submitted from outside
+     */
+    template<class InputIterator>
+    void schedule(InputIterator begin, InputIterator end) {
+        std::vector<FiberAndThread*> tasks;
+        while(begin != end) {
+            FiberAndThread* ft = new FiberAndThread(&*begin, -1);
+            if(ft->fiber || ft->cb) {
+                tasks.push_back(ft);
+            } else {
+                delete ft;
+            }
+            ++begin;
+        }
+        enqueue(tasks);
+    }
+
+    /**
+     * @brief Move the current fiber onto this scheduler (and thread, if given)
+     */
+    void switchTo(int thread = -1);
+
+    /**
+     * @brief Thread ids of the workers, usable for pinning
+     */
+    const std::vector<int>& getThreadIds() const { return m_threadIds;}
+
+    std::ostream& dump(std::ostream& os);
+protected:
+    /**
+     * @brief Wake up an idle worker
+     */
+    virtual void tickle();
+
+    /**
+     * @brief Scheduling loop of one worker
+     */
+    void run();
+
+    /**
+     * @brief true once stop() was called and nothing is left to run
+     */
+    virtual bool stopping();
+
+    /**
+     * @brief Body of the idle fiber, run when there is nothing to do
+     */
+    virtual void idle();
+
+    /**
+     * @brief Whether workers turn on the syscall hooks (hook.h). Only a scheduler that can
+     *        park a fiber until its fd is ready may do so, otherwise blocking calls on the
+     *        non-blocking sockets the hooks create would fail with EAGAIN.
+     */
+    virtual bool hookBlockingCalls() const { return false;}
+
+    /**
+     * @brief Make this the scheduler of the calling thread
+     */
+    void setThis();
+
+    bool hasIdleThreads() { return m_idleThreadCount > 0;}
+
+    /**
+     * @brief true if some queue holds a task the calling worker could take
+     * @details Called by idle() right before it sleeps; a task queued concurrently either
+     *          shows up here or its submitter sees this worker as idle and tickles.
+     */
+    bool hasPendingTasks();
+private:
+    struct FiberAndThread;
+    struct Worker;
+
+    void enqueue(FiberAndThread* ft);
+    void enqueue(std::vector<FiberAndThread*>& tasks);
+    /**
+     * @brief Queue a task pinned to a worker thread
+     */
+    void enqueuePinned(FiberAndThread* ft);
+    /**
+     * @brief Put a task that yielded READY on w back behind the tasks queued there
+     * @details Keeps its pin (a shared-stack fiber is pinned to its home thread), a task
+     *          pinned to another worker goes to that worker's inbox.
+     */
+    void requeue(Worker* w, FiberAndThread* ft);
+    /**
+     * @brief Worker of this scheduler with the given thread id, nullptr if none
+     */
+    Worker* getWorker(int thread);
+    /**
+     * @brief Next task for a worker: inbox, LIFO slot, own deque, global queue, steal
+     */
+    FiberAndThread* nextTask(Worker* w);
+    /**
+     * @brief Move a batch from the global queue to the worker, return one of them
+     */
+    FiberAndThread* takeGlobal(Worker* w);
+    /**
+     * @brief Steal from a random victim, moving up to half of its deque
+     * @details A stolen task pinned to another worker is passed on to that worker's inbox,
+     *          the deque holds pinned tasks of its owner.
+     */
+    FiberAndThread* stealTask(Worker* w);
+    /**
+     * @brief Wake idle workers if there are any; called after a task became visible
+     */
+    void notifyIdle();
+private:
+    /**
+     * @brief A queued task
+     */
+    struct FiberAndThread {
+        Fiber::ptr fiber;
+        std::function<void()> cb;
+        /// thread id to run on, -1 for any
+        int thread;
+
+        FiberAndThread(Fiber::ptr f, int thr)
+            :fiber(f), thread(thr) {
+        }
+
+        FiberAndThread(Fiber::ptr* f, int thr)
+            :thread(thr) {
+            fiber.swap(*f);
+        }
+
+        FiberAndThread(std::function<void()> f, int thr)
+            :cb(f), thread(thr) {
+        }
+
+        FiberAndThread(std::function<void()>* f, int thr)
+            :thread(thr) {
+            cb.swap(*f);
+        }
+
+        FiberAndThread()
+            :thread(-1) {
+        }
+
+        void reset() {
+            fiber = nullptr;
+            cb = nullptr;
+            thread = -1;
+        }
+    };
+
+    /**
+     * @brief Run queues of one worker thread
+     */
+    struct alignas(64) Worker {
+        /// readied on this worker, stolen by others
+        WorkStealingDeque<FiberAndThread*> deque;
+        /// task readied last, only this worker takes it
+        FiberAndThread* lifo = nullptr;
+        /// tasks taken from the LIFO slot in a row
+        uint32_t lifoRuns = 0;
+        /// tasks taken since the global queue was last polled
+        uint32_t tick = 0;
+        uint32_t rand = 0;
+        std::atomic<int> thread = {-1};
+        /// false while sleeping in idle()
+        std::atomic<bool> active = {false};
+
+        /// tasks pinned to this worker, submitted by any thread
+        MutexType inboxMutex;
+        std::list<FiberAndThread*> inbox;
+        std::atomic<size_t> inboxSize = {0};
+    };
+private:
+    MutexType m_mutex;
+    /// worker threads, not including the caller
+    std::vector<std::thread> m_threads;
+    /// run queues, the caller's first with use_caller
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    /// global injection queue, tasks submitted from outside the workers
+    std::list<FiberAndThread*> m_fibers;
+    /// m_fibers.size(), readable without the lock
+    std::atomic<size_t> m_globalSize = {0};
+    /// scheduling loop of the caller thread with use_caller
+    Fiber::ptr m_rootFiber;
+    std::string m_name;
+
+    /// wakes the default idle()
+    std::mutex m_idleMutex;
+    std::condition_variable m_idleCond;
+protected:
+    std::vector<int> m_threadIds;
+    size_t m_threadCount = 0;
+    std::atomic<size_t> m_idleThreadCount = {0};
+    std::atomic<bool> m_stopping = {true};
+    std::atomic<bool> m_autoStop = {false};
+    /// thread id of the caller with use_caller, -1 otherwise
+    int m_rootThread = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef __CPPSERVER_SINGLETON_H__
+#define __CPPSERVER_SINGLETON_H__
+
+#include <memory>
+
+namespace cppserver
+{
+
+    /**
+     * Process-wide instance of T, created on first use (thread-safe since C++11).
+     * X and N only tell apart several instances of the same T.
+     */
+    template <class T, class X = void, int N = 0>
+    class Singleton
+    {
+    public:
+        static T *GetInstance()
+        {
+            static T v;
+            return &v;
+        }
+    };
+
+    /**
+     * Same as Singleton, handed out as a shared_ptr
+     */
+    template <class T, class X = void, int N = 0>
+    class SingletonPtr
+    {
+    public:
+        static std::shared_ptr<T> GetInstance()
+        {
+            static std::shared_ptr<T> v(new T);
+            return v;
+        }
+    };
+
+}
+
+#endif
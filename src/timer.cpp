@@ -0,0 +1,362 @@
+#include "timer.h"
+#include <string.h>
+
+#include "util.h"
+
+namespace cppserver {
+
+/**
+ * @brief Bit shift of the slot index on level (1..LEVELS-1), i.e. log2 of its slot width
+ */
+static inline int LevelShift(int level) {
+    return 8 + 6 * (level - 1);
+}
+
+/**
+ * @brief First set bit at or after from in a 64 bit word, cyclically, -1 if none
+ */
+static inline int NextBit(uint64_t bits, int from) {
+    if(!bits) {
+        return -1;
+    }
+    uint64_t high = from < 64 ? bits & (~0ull << from) : 0;
+    return high ? __builtin_ctzll(high) : __builtin_ctzll(bits);
+}
+
+Timer::Timer(uint64_t ms, std::function<void()> cb,
+             bool recurring, TimerManager* manager)
+    :m_recurring(recurring)
+    ,m_ms(ms)
+    ,m_cb(cb)
+    ,m_manager(manager) {
+    m_next = GetElapsedMS() + m_ms;
+}
+
+bool Timer::cancel() {
+    TimerManager::MutexType::Lock lock(m_manager->m_mutex);
+    if(m_cb) {
+        m_cb = nullptr;
+        if(m_self) {
+            m_manager->unlink(this);
+        }
+        return true;
+    }
+    return false;
+}
+
+bool Timer::refresh() {
+    TimerManager::MutexType::Lock lock(m_manager->m_mutex);
+    if(!m_cb || !m_self) {
+        return false;
+    }
+    Timer::ptr self = m_self;
+    m_manager->unlink(this);
+    m_next = GetElapsedMS() + m_ms;
+    // later than before, can never become the front
+    m_manager->insert(self);
+    return true;
+}
+
+bool Timer::reset(uint64_t ms, bool from_now) {
+    if(ms == m_ms && !from_now) {
+        return true;
+    }
+    TimerManager::MutexType::Lock lock(m_manager->m_mutex);
+    if(!m_cb || !m_self) {
+        return false;
+    }
+    Timer::ptr self = m_self;
+    m_manager->unlink(this);
+    uint64_t start = 0;
+    if(from_now) {
+        start = GetElapsedMS();
+    } else {
+        start = m_next - m_ms;
+    }
+    m_ms = ms;
+    m_next = start + m_ms;
+    bool at_front = m_manager->insert(self);
+    lock.unlock();
+    if(at_front) {
+        m_manager->onTimerInsertedAtFront();
+    }
+    return true;
+}
+
+TimerManager::TimerManager() {
+    memset(m_root, 0, sizeof(m_root));
+    memset(m_levels, 0, sizeof(m_levels));
+    memset(m_rootBits, 0, sizeof(m_rootBits));
+    memset(m_levelBits, 0, sizeof(m_levelBits));
+    m_now = GetElapsedMS();
+}
+
+TimerManager::~TimerManager() {
+    // break the self references of the timers still armed
+    while(m_due) {
+        Timer* t = m_due;
+        m_due = t->m_succ;
+        t->m_self.reset();
+    }
+    for(size_t i = 0; i < ROOT_SIZE; ++i) {
+        while(m_root[i]) {
+            Timer* t = m_root[i];
+            m_root[i] = t->m_succ;
+            t->m_self.reset();
+        }
+    }
+    for(int l = 0; l < LEVELS - 1; ++l) {
+        for(size_t i = 0; i < LEVEL_SIZE; ++i) {
+            while(m_levels[l][i]) {
+                Timer* t = m_levels[l][i];
+                m_levels[l][i] = t->m_succ;
+                t->m_self.reset();
+            }
+        }
+    }
+}
+
+Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb
+                                  ,bool recurring) {
+    Timer::ptr timer(new Timer(ms, cb, recurring, this));
+    MutexType::Lock lock(m_mutex);
+    bool at_front = insert(timer);
+    lock.unlock();
+
+    if(at_front) {
+        onTimerInsertedAtFront();
+    }
+    return timer;
+}
+
+static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
+    std::shared_ptr<void> tmp = weak_cond.lock();
+    if(tmp) {
+        cb();
+    }
+}
+
+Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb
+                                    ,std::weak_ptr<void> weak_cond
+                                    ,bool recurring) {
+    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+}
+
+bool TimerManager::insert(Timer::ptr t) {
+    t->m_self = t;
+    link(t.get());
+    ++m_count;
+
+    bool at_front = t->m_next < m_nextHint && !m_tickled;
+    if(at_front) {
+        m_tickled = true;
+    }
+    return at_front;
+}
+
+void TimerManager::link(Timer* t) {
+    uint64_t expire = t->m_next;
+    uint64_t delta = expire - m_now;
+    Timer** head = nullptr;
+    if(expire < m_now) {
+        // its tick was processed already
+        t->m_level = DUE_LEVEL;
+        t->m_slot = 0;
+        head = &m_due;
+    } else if(delta < ROOT_SIZE) {
+        t->m_level = 0;
+        t->m_slot = expire & (ROOT_SIZE - 1);
+        head = &m_root[t->m_slot];
+        m_rootBits[t->m_slot / 64] |= 1ull << (t->m_slot % 64);
+    } else {
+        int level = 1;
+        while(level < LEVELS - 1 && delta >= (1ull << (LevelShift(level) + LEVEL_BITS))) {
+            ++level;
+        }
+        uint64_t max_delta = (1ull << (LevelShift(level) + LEVEL_BITS)) - 1;
+        if(delta > max_delta) {
+            // beyond the wheel: park in the farthest slot, placed again when it comes round
+            expire = m_now + max_delta;
+        }
+        t->m_level = level;
+        t->m_slot = (expire >> LevelShift(level)) & (LEVEL_SIZE - 1);
+        head = &m_levels[level - 1][t->m_slot];
+        m_levelBits[level - 1] |= 1ull << t->m_slot;
+    }
+
+    t->m_prev = nullptr;
+    t->m_succ = *head;
+    if(*head) {
+        (*head)->m_prev = t;
+    }
+    *head = t;
+}
+
+void TimerManager::unlink(Timer* t) {
+    Timer** head = t->m_level == DUE_LEVEL ? &m_due
+                 : t->m_level == 0 ? &m_root[t->m_slot]
+                                   : &m_levels[t->m_level - 1][t->m_slot];
+    if(t->m_prev) {
+        t->m_prev->m_succ = t->m_succ;
+    } else {
+        *head = t->m_succ;
+    }
+    if(t->m_succ) {
+        t->m_succ->m_prev = t->m_prev;
+    }
+    if(!*head && t->m_level != DUE_LEVEL) {
+        if(t->m_level == 0) {
+            m_rootBits[t->m_slot / 64] &= ~(1ull << (t->m_slot % 64));
+        } else {
+            m_levelBits[t->m_level - 1] &= ~(1ull << t->m_slot);
+        }
+    }
+    t->m_prev = t->m_succ = nullptr;
+    --m_count;
+    // may destroy t, callers hold their own reference if they still need it
+    t->m_self.reset();
+}
+
+void TimerManager::cascade(int level) {
+    size_t slot = (m_now >> LevelShift(level)) & (LEVEL_SIZE - 1);
+    Timer* t = m_levels[level - 1][slot];
+    m_levels[level - 1][slot] = nullptr;
+    m_levelBits[level - 1] &= ~(1ull << slot);
+    while(t) {
+        Timer* succ = t->m_succ;
+        link(t);
+        t = succ;
+    }
+}
+
+void TimerManager::advance(uint64_t now, std::vector<Timer::ptr>& expired) {
+    while(m_due) {
+        Timer* t = m_due;
+        m_due = t->m_succ;
+        t->m_prev = t->m_succ = nullptr;
+        --m_count;
+        expired.push_back(std::move(t->m_self));
+    }
+
+    while(m_now <= now) {
+        size_t idx = m_now & (ROOT_SIZE - 1);
+        if(idx == 0) {
+            // a level moves down whenever the one below it wraps around
+            for(int l = 1; l < LEVELS; ++l) {
+                cascade(l);
+                if((m_now >> LevelShift(l)) & (LEVEL_SIZE - 1)) {
+                    break;
+                }
+            }
+        }
+
+        Timer* t = m_root[idx];
+        m_root[idx] = nullptr;
+        m_rootBits[idx / 64] &= ~(1ull << (idx % 64));
+        while(t) {
+            Timer* succ = t->m_succ;
+            t->m_prev = t->m_succ = nullptr;
+            --m_count;
+            expired.push_back(std::move(t->m_self));
+            t = succ;
+        }
+
+        // jump to the next non-empty slot of this round, or to the next cascade
+        uint64_t base = m_now - idx;
+        uint64_t next = base + ROOT_SIZE;
+        for(size_t w = (idx + 1) / 64; w < ROOT_SIZE / 64; ++w) {
+            uint64_t bits = m_rootBits[w];
+            if(w == (idx + 1) / 64) {
+                bits &= ~0ull << ((idx + 1) % 64);
+            }
+            if(bits) {
+                next = base + w * 64 + __builtin_ctzll(bits);
+                break;
+            }
+        }
+        m_now = next > now + 1 ? now + 1 : next;
+    }
+}
+
+uint64_t TimerManager::getNextTimer() {
+    MutexType::Lock lock(m_mutex);
+    m_tickled = false;
+    if(!m_count) {
+        m_nextHint = ~0ull;
+        return ~0ull;
+    }
+
+    if(m_due) {
+        m_nextHint = 0;
+        return 0;
+    }
+
+    uint64_t next = ~0ull;
+    size_t idx = m_now & (ROOT_SIZE - 1);
+    uint64_t base = m_now - idx;
+    // level 0 slots before idx belong to the next round
+    for(size_t i = 0; i <= ROOT_SIZE / 64 && next == ~0ull; ++i) {
+        size_t w = (idx / 64 + i) % (ROOT_SIZE / 64);
+        uint64_t bits = m_rootBits[w];
+        if(i == 0) {
+            bits &= ~0ull << (idx % 64);
+        } else if(i == ROOT_SIZE / 64) {
+            bits &= ~(~0ull << (idx % 64));
+        }
+        if(bits) {
+            uint64_t slot = w * 64 + __builtin_ctzll(bits);
+            next = base + slot + (slot < idx ? ROOT_SIZE : 0);
+        }
+    }
+
+    for(int l = 1; l < LEVELS; ++l) {
+        int shift = LevelShift(l);
+        int cur = (m_now >> shift) & (LEVEL_SIZE - 1);
+        // the current slot moves down at the tick starting it; once that is processed,
+        // whatever is in it now is a full round away
+        bool pending = (m_now & ((1ull << shift) - 1)) == 0;
+        int first = pending ? cur : (cur + 1) % LEVEL_SIZE;
+        int bit = NextBit(m_levelBits[l - 1], first);
+        if(bit < 0) {
+            continue;
+        }
+        uint64_t steps = (bit - first + LEVEL_SIZE) % LEVEL_SIZE + (pending ? 0 : 1);
+        uint64_t at = ((m_now >> shift) + steps) << shift;
+        if(at < next) {
+            next = at;
+        }
+    }
+
+    m_nextHint = next;
+    uint64_t now_ms = GetElapsedMS();
+    return next > now_ms ? next - now_ms : 0;
+}
+
+void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
+    uint64_t now_ms = GetElapsedMS();
+    std::vector<Timer::ptr> expired;
+    {
+        MutexType::Lock lock(m_mutex);
+        if(!m_count || (m_now > now_ms && !m_due)) {
+            return;
+        }
+        advance(now_ms, expired);
+        cbs.reserve(cbs.size() + expired.size());
+        for(auto& timer : expired) {
+            cbs.push_back(timer->m_cb);
+            if(timer->m_recurring) {
+                timer->m_next = now_ms + timer->m_ms;
+                insert(timer);
+            } else {
+                timer->m_cb = nullptr;
+            }
+        }
+    }
+}
+
+bool TimerManager::hasTimer() {
+    MutexType::Lock lock(m_mutex);
+    return m_count != 0;
+}
+
+}
@@ -0,0 +1,176 @@
+#ifndef __CPPSERVER_TIMER_H__
+#define __CPPSERVER_TIMER_H__
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <functional>
+
+#include "mutex.h"
+
+namespace cppserver {
+
+class TimerManager;
+
+/**
+ * @brief Timer created by a TimerManager
+ */
+class Timer : public std::enable_shared_from_this<Timer> {
+friend class TimerManager;
+public:
+    typedef std::shared_ptr<Timer> ptr;
+
+    /**
+     * @brief Cancel the timer
+     * @return false if it already fired (and is not recurring) or was cancelled
+     */
+    bool cancel();
+
+    /**
+     * @brief Restart the countdown from now with the same period
+     */
+    bool refresh();
+
+    /**
+     * @brief Change the period
+     * @param[in] ms new period in milliseconds
+     * @param[in] from_now count from now, otherwise from when the current period started
+     */
+    bool reset(uint64_t ms, bool from_now);
+private:
+    Timer(uint64_t ms, std::function<void()> cb,
+          bool recurring, TimerManager* manager);
+private:
+    bool m_recurring = false;
+    /// period in milliseconds
+    uint64_t m_ms = 0;
+    /// expiry, in GetElapsedMS() time
+    uint64_t m_next = 0;
+    std::function<void()> m_cb;
+    TimerManager* m_manager = nullptr;
+
+    /// wheel slot list links, valid while m_self is set
+    Timer* m_prev = nullptr;
+    Timer* m_succ = nullptr;
+    uint8_t m_level = 0;
+    uint8_t m_slot = 0;
+    /// keeps the timer alive while it is in the wheel, fire-and-forget timers have no other owner
+    Timer::ptr m_self;
+};
+
+/**
+ * @brief Hierarchical timing wheel
+ * @details Five levels at 1ms resolution: 256 slots of 1ms, then four levels of 64 slots
+ *          of 256ms, ~16s, ~17min and ~18h each. A timer is linked into the slot covering
+ *          its expiry on the lowest level that reaches it, so adding, cancelling and
+ *          refreshing are O(1). Each time a lower level wraps around, the next slot of the
+ *          level above is moved down. Timers beyond the top level (~49 days) wait in its
+ *          farthest slot and are placed again when it comes round.
+ *          A bitmap of non-empty slots per level lets the wheel skip empty stretches and
+ *          lets getNextTimer() find the next deadline without walking the timers.
+ */
+class TimerManager {
+friend class Timer;
+public:
+    typedef FutexMutex MutexType;
+
+    TimerManager();
+
+    virtual ~TimerManager();
+
+    /**
+     * @brief Add a timer
+     * @param[in] ms delay (period if recurring) in milliseconds
+     * @param[in] cb callback, returned by listExpiredCb() when due
+     * @param[in] recurring re-arm after each expiry
+     */
+    Timer::ptr addTimer(uint64_t ms, std::function<void()> cb
+                        ,bool recurring = false);
+
+    /**
+     * @brief Add a timer that only runs cb if weak_cond is still alive when it fires
+     */
+    Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb
+                        ,std::weak_ptr<void> weak_cond
+                        ,bool recurring = false);
+
+    /**
+     * @brief Milliseconds until the next timer may be due
+     * @details Exact for timers less than 256ms away, a lower bound otherwise: the
+     *          caller wakes up early, the wheel moves the timers down a level, and the
+     *          next call is more precise.
+     * @return 0 if a timer is due, ~0ull if there are no timers
+     */
+    uint64_t getNextTimer();
+
+    /**
+     * @brief Take the callbacks of all due timers, re-arming recurring ones
+     */
+    void listExpiredCb(std::vector<std::function<void()> >& cbs);
+
+    /**
+     * @brief true if any timer is armed
+     */
+    bool hasTimer();
+protected:
+    /**
+     * @brief Called when a timer is added that is due before the time getNextTimer()
+     *        last returned, so whoever waits on it can recompute its timeout
+     */
+    virtual void onTimerInsertedAtFront() = 0;
+private:
+    /**
+     * @brief Arm a timer at t->m_next, m_mutex must be held
+     * @return true if onTimerInsertedAtFront() should be called
+     */
+    bool insert(Timer::ptr t);
+
+    /**
+     * @brief Link into the slot for t->m_next, m_mutex must be held
+     */
+    void link(Timer* t);
+
+    /**
+     * @brief Unlink from its slot, m_mutex must be held
+     */
+    void unlink(Timer* t);
+
+    /**
+     * @brief Move the timers of the current slot of level down to lower levels
+     */
+    void cascade(int level);
+
+    /**
+     * @brief Process every tick up to now, appending due timers to expired
+     */
+    void advance(uint64_t now, std::vector<Timer::ptr>& expired);
+private:
+    static const int LEVELS = 5;
+    static const int ROOT_BITS = 8;
+    static const int LEVEL_BITS = 6;
+    static const size_t ROOT_SIZE = 1 << ROOT_BITS;
+    static const size_t LEVEL_SIZE = 1 << LEVEL_BITS;
+    /// m_level of timers on m_due
+    static const uint8_t DUE_LEVEL = 0xff;
+
+    MutexType m_mutex;
+    /// slot heads, level 0 has ROOT_SIZE slots and the others LEVEL_SIZE
+    Timer* m_root[ROOT_SIZE];
+    Timer* m_levels[LEVELS - 1][LEVEL_SIZE];
+    /// non-empty slots
+    uint64_t m_rootBits[ROOT_SIZE / 64];
+    uint64_t m_levelBits[LEVELS - 1];
+    /// timers armed for a tick that was already processed, due right away
+    Timer* m_due = nullptr;
+    /// next tick to process
+    uint64_t m_now = 0;
+    size_t m_count = 0;
+    /// deadline last returned by getNextTimer(), absolute
+    uint64_t m_nextHint = ~0ull;
+    /// onTimerInsertedAtFront() was called since the last getNextTimer()
+    bool m_tickled = false;
+};
+
+}
+
+#endif
@@ -0,0 +1,36 @@
+#include "util.h"
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace cppserver {
+
+static uint64_t MonotonicMS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+}
+
+/// taken during static initialization, i.e. program start
+static const uint64_t s_start_ms = MonotonicMS();
+
+pid_t GetThreadId() {
+    static thread_local pid_t t_tid = syscall(SYS_gettid);
+    return t_tid;
+}
+
+static thread_local uint64_t t_fiber_id = 0;
+
+uint64_t GetFiberId() {
+    return t_fiber_id;
+}
+
+void SetFiberId(uint64_t id) {
+    t_fiber_id = id;
+}
+
+uint64_t GetElapsedMS() {
+    return MonotonicMS() - s_start_ms;
+}
+
+}
@@ -0,0 +1,33 @@
+#ifndef __CPPSERVER_UTIL_H__
+#define __CPPSERVER_UTIL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+namespace cppserver {
+
+/**
+ * @brief Return kernel thread id of the calling thread (cached per thread)
+ */
+pid_t GetThreadId();
+
+/**
+ * @brief Return id of the fiber running on the calling thread, 0 if none
+ */
+uint64_t GetFiberId();
+
+/**
+ * @brief Set the id GetFiberId() returns on the calling thread; Fiber calls it on every switch,
+ *        so logging does not depend on the fiber module
+ */
+void SetFiberId(uint64_t id);
+
+/**
+ * @brief Return milliseconds elapsed since the program started (monotonic)
+ */
+uint64_t GetElapsedMS();
+
+}
+
+#endif
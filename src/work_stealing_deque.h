@@ -0,0 +1,137 @@
+#ifndef __CPPSERVER_WORK_STEALING_DEQUE_H__
+#define __CPPSERVER_WORK_STEALING_DEQUE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <type_traits>
+
+namespace cppserver {
+
+/**
+ * @brief Chase-Lev work-stealing deque
+ * @details One owner thread pushes at the bottom; any thread, the owner included, takes
+ *          from the top with steal(). Only the owner may call push(). The buffer grows
+ *          when full; replaced buffers are kept until the deque is destroyed because a
+ *          concurrent steal may still be reading them.
+ *          Memory orderings follow Le, Pop, Cohen, Zappa Nardelli, "Correct and Efficient
+ *          Work-Stealing for Weak Memory Models" (PPoPP 2013).
+ * @tparam T trivially copyable element, typically a pointer
+ */
+template<class T>
+class WorkStealingDeque {
+    static_assert(std::is_trivially_copyable<T>::value, "element must be trivially copyable");
+public:
+    enum StealResult {
+        /// got an element
+        SUCCESS,
+        /// nothing to take
+        EMPTY,
+        /// lost a race with another taker, worth retrying
+        ABORT
+    };
+
+    /**
+     * @param[in] capacity initial capacity, rounded up to a power of two
+     */
+    explicit WorkStealingDeque(size_t capacity = 256) {
+        size_t cap = 1;
+        while(cap < capacity) {
+            cap <<= 1;
+        }
+        m_array.store(new Array(cap), std::memory_order_relaxed);
+    }
+
+    ~WorkStealingDeque() {
+        delete m_array.load(std::memory_order_relaxed);
+        for(auto i : m_retired) {
+            delete i;
+        }
+    }
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    /**
+     * @brief Push at the bottom, owner only
+     */
+    void push(T v) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        Array* a = m_array.load(std::memory_order_relaxed);
+        if(b - t > (int64_t)a->mask) {
+            a = grow(a, t, b);
+        }
+        a->put(b, v);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Take the oldest element from the top, any thread
+     */
+    StealResult steal(T& v) {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if(t >= b) {
+            return EMPTY;
+        }
+        // acquire stands in for consume, pairs with the release store in grow()
+        T x = m_array.load(std::memory_order_acquire)->get(t);
+        if(!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst
+                                          ,std::memory_order_relaxed)) {
+            return ABORT;
+        }
+        v = x;
+        return SUCCESS;
+    }
+
+    /**
+     * @brief Number of elements, only a snapshot when other threads are stealing
+     */
+    size_t size() const {
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        return b > t ? b - t : 0;
+    }
+
+    bool empty() const { return size() == 0;}
+private:
+    struct Array {
+        explicit Array(size_t cap)
+            :mask(cap - 1)
+            ,buf(new std::atomic<T>[cap]) {
+        }
+        ~Array() {
+            delete [] buf;
+        }
+
+        T get(int64_t i) const { return buf[i & mask].load(std::memory_order_relaxed);}
+        void put(int64_t i, T v) { buf[i & mask].store(v, std::memory_order_relaxed);}
+
+        size_t mask;
+        std::atomic<T>* buf;
+    };
+
+    Array* grow(Array* a, int64_t t, int64_t b) {
+        Array* n = new Array((a->mask + 1) * 2);
+        for(int64_t i = t; i < b; ++i) {
+            n->put(i, a->get(i));
+        }
+        m_retired.push_back(a);
+        m_array.store(n, std::memory_order_release);
+        return n;
+    }
+private:
+    /// top and bottom on separate cache lines, thieves only write top
+    alignas(64) std::atomic<int64_t> m_top = {0};
+    alignas(64) std::atomic<int64_t> m_bottom = {0};
+    std::atomic<Array*> m_array;
+    /// replaced buffers, owner only
+    std::vector<Array*> m_retired;
+};
+
+}
+
+#endif
@@ -0,0 +1,77 @@
+// Turn a file written by BinaryLogAppender back into text using a LogFormatter pattern.
+//   log_decode [-p pattern] file...
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+#include "log_binary.h"
+
+using namespace cppserver;
+
+static const char *DEFAULT_PATTERN = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n";
+
+static void usage(const char *prog)
+{
+    std::cerr << "usage: " << prog << " [-p pattern] file..." << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string pattern = DEFAULT_PATTERN;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            pattern = argv[++i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (i >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    LogFormatter::ptr formatter(new LogFormatter(pattern));
+    if (formatter->isError())
+    {
+        std::cerr << "invalid pattern: " << pattern << std::endl;
+        return 1;
+    }
+
+    int ret = 0;
+    std::map<std::string, Logger::ptr> loggers; // only needed for %c
+    for (; i < argc; ++i)
+    {
+        std::ifstream ifs(argv[i], std::ios::in | std::ios::binary);
+        BinaryLogReader reader(ifs);
+        if (!ifs || !reader.isValid())
+        {
+            std::cerr << argv[i] << ": not a binary log file" << std::endl;
+            ret = 1;
+            continue;
+        }
+        BinaryLogReader::Entry entry;
+        while (reader.next(entry))
+        {
+            Logger::ptr &logger = loggers[entry.loggerName];
+            if (!logger)
+            {
+                logger.reset(new Logger(entry.loggerName));
+            }
+            formatter->format(std::cout, logger, entry.level, entry.event);
+        }
+        if (reader.isCorrupt())
+        {
+            std::cerr << argv[i] << ": truncated or corrupt record" << std::endl;
+            ret = 1;
+        }
+    }
+    return ret;
+}